@@ -0,0 +1,434 @@
+/** gtping/src/bench.c
+ *
+ *  By Thomas Habets <thomas@habets.se> 2010
+ *
+ * Benchmarks for the per-packet hot paths, run with "make bench".
+ *
+ * The functions measured are static in gtping.c, so it's included here
+ * with its main() renamed, instead of being linked in.
+ *
+ * With the path of a gtping binary as argument it also runs gtping -f
+ * against gtping -L on loopback, and reports packets per second and CPU
+ * time per packet of both.
+ */
+#define main gtpingMain
+#include "gtping.c"
+#undef main
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+/* run each benchmark at least this long (seconds) */
+#define BENCH_MINTIME 0.2
+
+/* default pings in loopback benchmark */
+#define BENCH_COUNT 200000
+
+static volatile unsigned long benchSink;
+
+/**
+ *
+ */
+static void
+benchMkpingV1(unsigned long n)
+{
+        options.version = 1;
+        while (n--) {
+                mkping();
+                benchSink += echoLen;
+        }
+}
+
+/**
+ *
+ */
+static void
+benchMkpingV2(unsigned long n)
+{
+        options.version = 2;
+        while (n--) {
+                mkping();
+                benchSink += echoLen;
+        }
+}
+
+/**
+ *
+ */
+static void
+benchPrepareEcho(unsigned long n)
+{
+        struct SendMsg msg;
+        union GtpEcho packet;
+        unsigned long c;
+
+        options.version = 1;
+        mkping();
+        for (c = 0; c < n; c++) {
+                prepareEcho(targets, c, 1.0, &msg, &packet);
+                benchSink += msg.len;
+        }
+}
+
+/**
+ * Echo reply of GTP version ver, length in *len.
+ */
+static union GtpEcho
+benchReply(int ver, size_t *len)
+{
+        union GtpEcho reply;
+
+        options.version = ver;
+        mkping();
+        reply = echoTemplate;
+        if (ver == 1) {
+                reply.v1.msg = GTPMSG_ECHOREPLY;
+        } else {
+                reply.v2.msg = GTPMSG_ECHOREPLY;
+        }
+        *len = echoLen;
+        return reply;
+}
+
+/**
+ *
+ */
+static void
+benchParseReplyV1(unsigned long n)
+{
+        size_t len;
+        union GtpEcho reply = benchReply(1, &len);
+
+        while (n--) {
+                benchSink += parseReply(&reply, len).seq;
+        }
+}
+
+/**
+ *
+ */
+static void
+benchParseReplyV2(unsigned long n)
+{
+        size_t len;
+        union GtpEcho reply = benchReply(2, &len);
+
+        while (n--) {
+                benchSink += parseReply(&reply, len).seq;
+        }
+}
+
+/**
+ *
+ */
+static void
+benchTos2String(unsigned long n)
+{
+        static const int tos[] = { 0x00, 0xb8, 0x10, 0x28 };
+        char buf[128];
+
+        while (n--) {
+                tos2String(tos[n & 3], buf, sizeof(buf));
+                benchSink += buf[0];
+        }
+}
+
+/**
+ * Control data as recvmmsg() gives it with -k: TTL, ToS and timestamp.
+ */
+static void
+benchParseCmsg(unsigned long n)
+{
+        union {
+                struct cmsghdr align;
+                char buf[CMSG_SPACE(sizeof(int))
+                         + CMSG_SPACE(sizeof(unsigned char))
+                         + CMSG_SPACE(sizeof(struct timespec))];
+        } control;
+        struct msghdr msgh;
+        struct cmsghdr *cmsg;
+        struct RecvMsg m;
+        struct timespec ts = { 1234567890, 0 };
+        unsigned char tos = 0xb8;
+        int ttl = 64;
+
+        memset(&control, 0, sizeof(control));
+        memset(&msgh, 0, sizeof(msgh));
+        msgh.msg_control = control.buf;
+        msgh.msg_controllen = sizeof(control.buf);
+
+        cmsg = CMSG_FIRSTHDR(&msgh);
+        cmsg->cmsg_level = IPPROTO_IP;
+        cmsg->cmsg_type = IP_TTL;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(ttl));
+        memcpy(CMSG_DATA(cmsg), &ttl, sizeof(ttl));
+
+        cmsg = CMSG_NXTHDR(&msgh, cmsg);
+        cmsg->cmsg_level = IPPROTO_IP;
+        cmsg->cmsg_type = IP_TOS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(tos));
+        memcpy(CMSG_DATA(cmsg), &tos, sizeof(tos));
+
+#ifdef SCM_TIMESTAMPNS
+        cmsg = CMSG_NXTHDR(&msgh, cmsg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_TIMESTAMPNS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(ts));
+        memcpy(CMSG_DATA(cmsg), &ts, sizeof(ts));
+#endif
+
+        while (n--) {
+                parseCmsg(&msgh, &m);
+                benchSink += m.ttl;
+        }
+}
+
+/**
+ * Statistics update for one reply, with the prepareEcho() that makes
+ * the ping it answers.
+ */
+static void
+benchAccountReply(unsigned long n)
+{
+        struct SendMsg msg;
+        union GtpEcho packet;
+        double lagf;
+        int isDup, isReorder;
+        unsigned long c;
+
+        options.version = 1;
+        mkping();
+        for (c = 0; c < n; c++) {
+                prepareEcho(targets, targets->curSeq, 1.0, &msg, &packet);
+                accountReply(targets, targets->curSeq++,
+                             1.0 + (c & 1023) / 1000000.0, 0,
+                             &lagf, &isDup, &isReorder);
+                benchSink += isDup;
+        }
+}
+
+/**
+ * Run fn with more and more iterations until it takes BENCH_MINTIME.
+ *
+ * return seconds per iteration
+ */
+static double
+benchRun(void (*fn)(unsigned long))
+{
+        unsigned long n = 1000;
+        double start, elapsed;
+
+        for (;;) {
+                start = clock_get_dbl();
+                fn(n);
+                elapsed = clock_get_dbl() - start;
+                if (elapsed >= BENCH_MINTIME) {
+                        return elapsed / n;
+                }
+                n *= 2;
+        }
+}
+
+/**
+ * CPU time (user + system) of waited-for children so far, in seconds.
+ */
+static double
+childCPU()
+{
+        struct rusage ru;
+
+        getrusage(RUSAGE_CHILDREN, &ru);
+        return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1000000.0
+                + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1000000.0;
+}
+
+/**
+ * Start gtping with args. Its stdout goes to *out if out is set,
+ * otherwise to /dev/null, same for stderr.
+ *
+ * return pid, or -1 on error
+ */
+static pid_t
+benchSpawn(char *const args[], int *out)
+{
+        int p[2] = { -1, -1 };
+        pid_t pid;
+
+        if (out && pipe(p)) {
+                fprintf(stderr, "%s: pipe(): %s\n", argv0, strerror(errno));
+                return -1;
+        }
+        if (0 > (pid = fork())) {
+                fprintf(stderr, "%s: fork(): %s\n", argv0, strerror(errno));
+                return -1;
+        }
+        if (!pid) {
+                int null = open("/dev/null", O_WRONLY);
+                dup2(out ? p[1] : null, 1);
+                dup2(null, 2);
+                execv(args[0], args);
+                _exit(127);
+        }
+        if (out) {
+                close(p[1]);
+                *out = p[0];
+        }
+        return pid;
+}
+
+/**
+ * Find a free UDP port on loopback.
+ *
+ * return 0 on success, <0 (-errno) on error
+ */
+static int
+benchPort(char *port, size_t portlen)
+{
+        struct sockaddr_in sa;
+        socklen_t salen = sizeof(sa);
+        int fd, err = 0;
+
+        if (0 > (fd = socket(AF_INET, SOCK_DGRAM, 0))) {
+                return -errno;
+        }
+        memset(&sa, 0, sizeof(sa));
+        sa.sin_family = AF_INET;
+        sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(fd, (struct sockaddr*)&sa, sizeof(sa))
+            || getsockname(fd, (struct sockaddr*)&sa, &salen)) {
+                err = -errno;
+        }
+        close(fd);
+        snprintf(port, portlen, "%u", ntohs(sa.sin_port));
+        return err;
+}
+
+/**
+ * gtping -f against gtping -L on loopback.
+ *
+ * return 0 on success, 1 on failure
+ */
+static int
+benchLoopback(const char *gtping, unsigned long count)
+{
+        char port[16], countStr[32];
+        char *responder[] = { (char*)gtping, "-L", "-s", "127.0.0.1",
+                              "-p", port, NULL };
+        char *client[] = { (char*)gtping, "-f", "-c", countStr,
+                           "-p", port, "127.0.0.1", NULL };
+        unsigned int sent = 0, recvd = 0, ms = 0;
+        double cpu, clientCPU, responderCPU;
+        char line[256];
+        pid_t rpid, cpid;
+        FILE *f;
+        int out;
+
+        if (benchPort(port, sizeof(port))) {
+                fprintf(stderr, "%s: no free port on loopback\n", argv0);
+                return 1;
+        }
+        snprintf(countStr, sizeof(countStr), "%lu", count);
+
+        if (0 > (rpid = benchSpawn(responder, NULL))) {
+                return 1;
+        }
+        /* let it bind */
+        usleep(200000);
+
+        cpu = childCPU();
+        if (0 > (cpid = benchSpawn(client, &out))) {
+                kill(rpid, SIGINT);
+                waitpid(rpid, NULL, 0);
+                return 1;
+        }
+        /* flood output has no newlines, so the summary starts a buffer */
+        f = fdopen(out, "r");
+        while (fgets(line, sizeof(line), f)) {
+                sscanf(line, "%u packets transmitted, %u received, "
+                       "%*d%% packet loss, time %ums", &sent, &recvd, &ms);
+        }
+        fclose(f);
+        waitpid(cpid, NULL, 0);
+        clientCPU = childCPU() - cpu;
+
+        kill(rpid, SIGINT);
+        waitpid(rpid, NULL, 0);
+        responderCPU = childCPU() - cpu - clientCPU;
+
+        if (!recvd || !ms) {
+                fprintf(stderr, "%s: loopback benchmark got no replies\n",
+                        argv0);
+                return 1;
+        }
+        printf("%-28s %u sent, %u received in %u ms\n",
+               "loopback flood", sent, recvd, ms);
+        printf("%-28s %10.0f pps\n", "  replies", recvd / (ms / 1000.0));
+        printf("%-28s %10.2f us/packet\n", "  client CPU",
+               1000000 * clientCPU / sent);
+        printf("%-28s %10.2f us/packet\n", "  responder CPU",
+               1000000 * responderCPU / sent);
+        return 0;
+}
+
+/**
+ *
+ */
+int
+main(int argc, char **argv)
+{
+        static const struct {
+                const char *name;
+                void (*fn)(unsigned long);
+        } benches[] = {
+                { "mkping v1", benchMkpingV1 },
+                { "mkping v2", benchMkpingV2 },
+                { "prepareEcho", benchPrepareEcho },
+                { "parseReply v1", benchParseReplyV1 },
+                { "parseReply v2", benchParseReplyV2 },
+                { "tos2String", benchTos2String },
+                { "parseCmsg", benchParseCmsg },
+                { "prepareEcho+accountReply", benchAccountReply },
+        };
+        unsigned long count = BENCH_COUNT;
+        unsigned int c;
+
+        argv0 = argv[0];
+        if (argc > 1 && !strcmp(argv[1], "-c") && argc > 2) {
+                count = strtoul(argv[2], 0, 0);
+                argv += 2;
+                argc -= 2;
+        }
+        if (argc > 2) {
+                fprintf(stderr, "Usage: %s [ -c <count> ] [ <gtping> ]\n",
+                        argv0);
+                return 1;
+        }
+
+        /* one target, as gtping would set it up */
+        if (addTarget("bench")) {
+                return 1;
+        }
+        targets->inflightSize = 1024;
+        if (!(targets->inflight = calloc(targets->inflightSize,
+                                         sizeof(struct InFlight)))) {
+                fprintf(stderr, "%s: out of memory\n", argv0);
+                return 1;
+        }
+
+        for (c = 0; c < sizeof(benches) / sizeof(benches[0]); c++) {
+                double t = benchRun(benches[c].fn);
+                printf("%-28s %10.1f ns/op %12.0f ops/s\n",
+                       benches[c].name, t * 1e9, 1 / t);
+        }
+        if (argc > 1) {
+                return benchLoopback(argv[1], count);
+        }
+        return 0;
+}
+
+/* ---- Emacs Variables ----
+ * Local Variables:
+ * c-basic-offset: 8
+ * indent-tabs-mode: nil
+ * End:
+ */
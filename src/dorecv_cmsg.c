@@ -9,11 +9,19 @@
  *
  * FreeBSD and Solaris don't seem to have IP_RECVTOS or equivalent, so
  * just TTL for them.
+ *
+ * Where recvmmsg() exists (Linux) doRecvBatch() drains many packets per
+ * syscall.
  */
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
 
+/* recvmmsg() is a GNU extension */
+#if defined (HAVE_RECVMMSG) && !defined (_GNU_SOURCE)
+# define _GNU_SOURCE
+#endif
+
 /* For Solaris we need some defines */
 #if defined (__SVR4) && defined (__sun)
 /* SUS (XPG4v2) */
@@ -23,13 +31,16 @@
 # define __EXTENSIONS__ 1
 #endif
 
+#include <errno.h>
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <time.h>
 #include <netinet/in.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 
 #ifdef HAVE_SYS_UIO_H
 #include <sys/uio.h>
@@ -45,41 +56,61 @@
 #define SOL_IPV6 IPPROTO_IPV6
 #endif
 
+/* control data space per message */
+#define CMSG_BUFSIZE 512
+
 /**
- * 
+ * Extract TTL, ToS and kernel receive timestamps of received packet from
+ * control messages. Software and hardware timestamps are kept apart, as
+ * the NIC clock need not have anything to do with the system clock.
  */
-ssize_t
-doRecv(int sock, void *data, size_t len, int *ttl, int *tos)
+void
+parseCmsg(struct msghdr *msgh, struct RecvMsg *m)
 {
-        struct msghdr msgh;
         struct cmsghdr *cmsg;
-        struct iovec iov;
-        char msgcontrol[10000];
-        ssize_t n;
-
-	if (options.verbose > 2) {
-		fprintf(stderr, "%s: doRecv[cmsg]()\n", argv0);
-	}
 
-        *ttl = -1;
-        *tos = -1;
+        m->ttl = -1;
+        m->tos = -1;
+        m->rxtime = 0;
+        m->rxhw = 0;
 
-        memset(&iov, 0, sizeof(iov));
-        iov.iov_base = data;
-        iov.iov_len = len;
-
-        memset(&msgh, 0, sizeof(msgh));
-        
-        msgh.msg_iov = &iov;
-        msgh.msg_iovlen = 1;
-        msgh.msg_control = msgcontrol;
-        msgh.msg_controllen = sizeof(msgcontrol);
-
-        n = recvmsg(sock, &msgh, MSG_WAITALL);
-
-        for (cmsg = CMSG_FIRSTHDR(&msgh);
-             (0 < n) && (cmsg != NULL);
-             cmsg = CMSG_NXTHDR(&msgh,cmsg)) {
+        for (cmsg = CMSG_FIRSTHDR(msgh);
+             cmsg != NULL;
+             cmsg = CMSG_NXTHDR(msgh,cmsg)) {
+                if (cmsg->cmsg_level == SOL_SOCKET) {
+                        switch (cmsg->cmsg_type) {
+#ifdef SCM_TIMESTAMPNS
+                        case SCM_TIMESTAMPNS: {
+                                struct timespec ts;
+                                memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+                                m->rxtime = ts.tv_sec + ts.tv_nsec / 1e9;
+                                break;
+                        }
+#endif
+#ifdef SCM_TIMESTAMP
+                        case SCM_TIMESTAMP: {
+                                struct timeval tv;
+                                memcpy(&tv, CMSG_DATA(cmsg), sizeof(tv));
+                                m->rxtime = tv.tv_sec + tv.tv_usec / 1e6;
+                                break;
+                        }
+#endif
+#ifdef SCM_TIMESTAMPING
+                        case SCM_TIMESTAMPING: {
+                                /* [0] is software, [2] is hardware */
+                                struct timespec ts[3];
+                                memcpy(ts, CMSG_DATA(cmsg), sizeof(ts));
+                                if (ts[0].tv_sec || ts[0].tv_nsec) {
+                                        m->rxtime = ts[0].tv_sec
+                                                + ts[0].tv_nsec / 1e9;
+                                }
+                                m->rxhw = ts[2].tv_sec + ts[2].tv_nsec / 1e9;
+                                break;
+                        }
+#endif
+                        }
+                        continue;
+                }
                 if (cmsg->cmsg_level == SOL_IP
                     || cmsg->cmsg_level == SOL_IPV6) {
                         switch(cmsg->cmsg_type) {
@@ -93,7 +124,7 @@ doRecv(int sock, void *data, size_t len, int *ttl, int *tos)
 #ifdef IPV6_RECVTCLASS
                         case IPV6_RECVTCLASS:
 #endif
-                                *tos=*(unsigned char*)CMSG_DATA(cmsg);
+                                m->tos=*(unsigned char*)CMSG_DATA(cmsg);
                                 break;
                         case IP_TTL:
                         case IP_RECVTTL:
@@ -101,7 +132,7 @@ doRecv(int sock, void *data, size_t len, int *ttl, int *tos)
 #ifdef IPV6_RECVHOPLIMIT
                         case IPV6_RECVHOPLIMIT:
 #endif
-                                *ttl=*(unsigned char*)CMSG_DATA(cmsg);
+                                m->ttl=*(unsigned char*)CMSG_DATA(cmsg);
                                 break;
                         default:
                                 fprintf(stderr,
@@ -110,6 +141,62 @@ doRecv(int sock, void *data, size_t len, int *ttl, int *tos)
                         }
                 }
         }
+}
+
+/**
+ * Receive one packet into m, with recvmsg() flags.
+ *
+ * return length of packet, or -1 (errno set)
+ */
+static ssize_t
+recvOne(int sock, struct RecvMsg *m, int flags)
+{
+        struct msghdr msgh;
+        struct iovec iov;
+        char msgcontrol[CMSG_BUFSIZE];
+        ssize_t n;
+
+        memset(&iov, 0, sizeof(iov));
+        iov.iov_base = m->data;
+        iov.iov_len = sizeof(m->data);
+
+        memset(&msgh, 0, sizeof(msgh));
+        
+        msgh.msg_name = &m->from;
+        msgh.msg_namelen = sizeof(m->from);
+        msgh.msg_iov = &iov;
+        msgh.msg_iovlen = 1;
+        msgh.msg_control = msgcontrol;
+        msgh.msg_controllen = sizeof(msgcontrol);
+
+        m->len = n = recvmsg(sock, &msgh, flags);
+        m->fromlen = msgh.msg_namelen;
+        if (0 < n) {
+                parseCmsg(&msgh, m);
+        } else {
+                m->ttl = -1;
+                m->tos = -1;
+                m->rxtime = 0;
+                m->rxhw = 0;
+        }
+        return n;
+}
+
+/**
+ * Receive one packet into m.
+ *
+ * return length of packet, or -1 (errno set)
+ */
+ssize_t
+doRecv(int sock, struct RecvMsg *m)
+{
+        ssize_t n;
+
+	if (options.verbose > 2) {
+		fprintf(stderr, "%s: doRecv[cmsg]()\n", argv0);
+	}
+
+        n = recvOne(sock, m, MSG_WAITALL);
 
 	if (options.verbose > 2) {
 		fprintf(stderr, "%s: doRecv[cmsg]() = %d\n", argv0, (int)n);
@@ -118,6 +205,96 @@ doRecv(int sock, void *data, size_t len, int *ttl, int *tos)
         return n;
 }
 
+#ifdef HAVE_RECVMMSG
+/**
+ * Receive up to n packets in one recvmmsg() call, without blocking.
+ * Message headers and control areas are preallocated and reused.
+ *
+ * return number of packets received, or -1 (errno set)
+ */
+int
+doRecvBatch(int sock, struct RecvMsg *msgs, unsigned int n)
+{
+        static THREAD_LOCAL struct mmsghdr mm[MAX_RECVBATCH];
+        static THREAD_LOCAL struct iovec iov[MAX_RECVBATCH];
+        static THREAD_LOCAL char msgcontrol[MAX_RECVBATCH][CMSG_BUFSIZE];
+        unsigned int c;
+        int ret;
+
+        if (n > MAX_RECVBATCH) {
+                n = MAX_RECVBATCH;
+        }
+
+        for (c = 0; c < n; c++) {
+                iov[c].iov_base = msgs[c].data;
+                iov[c].iov_len = sizeof(msgs[c].data);
+                mm[c].msg_hdr.msg_name = &msgs[c].from;
+                mm[c].msg_hdr.msg_namelen = sizeof(msgs[c].from);
+                mm[c].msg_hdr.msg_iov = &iov[c];
+                mm[c].msg_hdr.msg_iovlen = 1;
+                mm[c].msg_hdr.msg_control = msgcontrol[c];
+                mm[c].msg_hdr.msg_controllen = CMSG_BUFSIZE;
+                mm[c].msg_hdr.msg_flags = 0;
+                mm[c].msg_len = 0;
+        }
+
+        ret = recvmmsg(sock, mm, n, MSG_DONTWAIT, NULL);
+
+        for (c = 0; (int)c < ret; c++) {
+                msgs[c].len = mm[c].msg_len;
+                msgs[c].fromlen = mm[c].msg_hdr.msg_namelen;
+                parseCmsg(&mm[c].msg_hdr, &msgs[c]);
+        }
+
+	if (options.verbose > 2) {
+		fprintf(stderr, "%s: doRecvBatch[cmsg](%d, %u) = %d\n",
+                        argv0, sock, n, ret);
+	}
+        return ret;
+}
+#else
+/**
+ * Receive up to n packets, one recvmsg() each, without blocking. Like
+ * recvmmsg() returns less than n only once the socket is drained, so
+ * that edge triggered callers don't leave packets behind. An error after
+ * the first packet is held back and returned by the next call on sock,
+ * as recvmmsg() does.
+ *
+ * return number of packets received, or -1 (errno set)
+ */
+int
+doRecvBatch(int sock, struct RecvMsg *msgs, unsigned int n)
+{
+        static THREAD_LOCAL int heldFd = -1;
+        static THREAD_LOCAL int heldErr;
+        unsigned int c;
+
+        if (heldFd == sock) {
+                heldFd = -1;
+                errno = heldErr;
+                return -1;
+        }
+        for (c = 0; c < n; c++) {
+                if (0 > recvOne(sock, &msgs[c], MSG_DONTWAIT)) {
+                        if (!c) {
+                                return -1;
+                        }
+                        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                                heldFd = sock;
+                                heldErr = errno;
+                        }
+                        break;
+                }
+        }
+
+	if (options.verbose > 2) {
+		fprintf(stderr, "%s: doRecvBatch[cmsg](%d, %u) = %u\n",
+                        argv0, sock, n, c);
+	}
+        return c;
+}
+#endif
+
 /* ---- Emacs Variables ----
  * Local Variables:
  * c-basic-offset: 8
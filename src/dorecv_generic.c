@@ -11,6 +11,7 @@
 #include "config.h"
 #endif
 
+#include <errno.h>
 #include <string.h>
 #include <stdio.h>
 #include <sys/types.h>
@@ -19,14 +20,78 @@
 #include "gtping.h"
 
 /**
- * 
+ * No control messages here, so no TTL, ToS or timestamp.
+ */
+void
+parseCmsg(struct msghdr *msgh, struct RecvMsg *m)
+{
+        msgh = msgh;
+        m->ttl = -1;
+        m->tos = -1;
+        m->rxtime = 0;
+        m->rxhw = 0;
+}
+
+/**
+ * Receive one packet into m, with recvfrom() flags.
+ *
+ * return length of packet, or -1 (errno set)
+ */
+static ssize_t
+recvOne(int sock, struct RecvMsg *m, int flags)
+{
+        m->ttl = -1;
+        m->tos = -1;
+        m->rxtime = 0;
+        m->rxhw = 0;
+        m->fromlen = sizeof(m->from);
+        return m->len = recvfrom(sock, m->data, sizeof(m->data), flags,
+                                 (struct sockaddr*)&m->from, &m->fromlen);
+}
+
+/**
+ * Receive one packet into m.
+ *
+ * return length of packet, or -1 (errno set)
  */
 ssize_t
-doRecv(int sock, void *data, size_t len, int *ttl, int *tos)
+doRecv(int sock, struct RecvMsg *m)
 {
-        *ttl = -1;
-        *tos = -1;
-        return recv(sock, data, len, 0);
+        return recvOne(sock, m, 0);
+}
+
+/**
+ * Receive up to n packets, one recvfrom() each, without blocking. Less
+ * than n means the socket is drained. An error after the first packet is
+ * held back and returned by the next call on sock.
+ *
+ * return number of packets received, or -1 (errno set)
+ */
+int
+doRecvBatch(int sock, struct RecvMsg *msgs, unsigned int n)
+{
+        static THREAD_LOCAL int heldFd = -1;
+        static THREAD_LOCAL int heldErr;
+        unsigned int c;
+
+        if (heldFd == sock) {
+                heldFd = -1;
+                errno = heldErr;
+                return -1;
+        }
+        for (c = 0; c < n; c++) {
+                if (0 > recvOne(sock, &msgs[c], MSG_DONTWAIT)) {
+                        if (!c) {
+                                return -1;
+                        }
+                        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                                heldFd = sock;
+                                heldErr = errno;
+                        }
+                        break;
+                }
+        }
+        return c;
 }
 
 /* ---- Emacs Variables ----
@@ -0,0 +1,80 @@
+/** gtping/dosend_generic.c
+ *
+ *  By Thomas Habets <thomas@habets.se> 2010
+ *
+ * This provides the batched send*() wrapper for systems that don't have
+ * sendmmsg(). Packets are sent one sendto() at a time. Per packet TTL
+ * is set with setsockopt(), since not all of these take it as ancillary
+ * data.
+ *
+ * Systems known to use this code: FreeBSD, OpenBSD, Solaris, IRIX
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "gtping.h"
+
+/**
+ * Set TTL (hop limit for IPv6) of packets sent on sock from now on.
+ */
+static void
+setTTL(int sock, int af, int ttl)
+{
+        if (af == AF_INET6) {
+#ifdef IPV6_UNICAST_HOPS
+                if (setsockopt(sock, IPPROTO_IPV6, IPV6_UNICAST_HOPS,
+                               &ttl, sizeof(ttl))) {
+                        fprintf(stderr,
+                                "%s: setsockopt(%d, IPPROTO_IPV6, "
+                                "IPV6_UNICAST_HOPS, %d): %s\n",
+                                argv0, sock, ttl, strerror(errno));
+                }
+#endif
+                return;
+        }
+        if (setsockopt(sock, IPPROTO_IP, IP_TTL, &ttl, sizeof(ttl))) {
+                fprintf(stderr,
+                        "%s: setsockopt(%d, IPPROTO_IP, IP_TTL, %d): %s\n",
+                        argv0, sock, ttl, strerror(errno));
+        }
+}
+
+/**
+ * Send up to n packets.
+ *
+ * return number of packets sent, or -1 (errno set) if the first one
+ * failed.
+ */
+int
+doSendBatch(int sock, const struct SendMsg *msgs, unsigned int n)
+{
+        unsigned int c;
+
+        for (c = 0; c < n; c++) {
+                if (msgs[c].ttl > 0) {
+                        setTTL(sock, msgs[c].af, msgs[c].ttl);
+                }
+                if (0 > sendto(sock,
+                               msgs[c].data, msgs[c].len,
+                               0,
+                               msgs[c].to, msgs[c].tolen)) {
+                        return c ? (int)c : -1;
+                }
+        }
+        return n;
+}
+
+/* ---- Emacs Variables ----
+ * Local Variables:
+ * c-basic-offset: 8
+ * indent-tabs-mode: nil
+ * End:
+ */
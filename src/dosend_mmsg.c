@@ -0,0 +1,110 @@
+/** gtping/dosend_mmsg.c
+ *
+ *  By Thomas Habets <thomas@habets.se> 2010
+ *
+ * This provides the batched send*() wrapper for systems that have
+ * sendmmsg(), handing a whole batch of packets to the kernel in one
+ * syscall. Packets with their own TTL get it as ancillary data, so that
+ * probes with different TTLs still go out in one call.
+ *
+ * Systems known to use this code: Linux
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+/* sendmmsg() is a GNU extension */
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE
+#endif
+
+#include <string.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
+
+#include "gtping.h"
+
+/**
+ * Control data buffer for one TTL, aligned for struct cmsghdr.
+ */
+union TtlCmsg {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+};
+
+/**
+ * Attach TTL (hop limit for IPv6) to hdr, with control data in cbuf.
+ */
+static void
+ttlCmsg(struct msghdr *hdr, union TtlCmsg *cbuf, int af, int ttl)
+{
+        struct cmsghdr *cmsg;
+
+        hdr->msg_control = cbuf->buf;
+        hdr->msg_controllen = sizeof(cbuf->buf);
+        cmsg = CMSG_FIRSTHDR(hdr);
+        cmsg->cmsg_len = CMSG_LEN(sizeof(ttl));
+        if (af == AF_INET6) {
+                cmsg->cmsg_level = IPPROTO_IPV6;
+                cmsg->cmsg_type = IPV6_HOPLIMIT;
+        } else {
+                cmsg->cmsg_level = IPPROTO_IP;
+                cmsg->cmsg_type = IP_TTL;
+        }
+        memcpy(CMSG_DATA(cmsg), &ttl, sizeof(ttl));
+}
+
+/**
+ * Send up to n packets in one sendmmsg() call.
+ *
+ * return number of packets sent, or -1 (errno set) if the first one
+ * failed.
+ */
+int
+doSendBatch(int sock, const struct SendMsg *msgs, unsigned int n)
+{
+        struct mmsghdr mm[MAX_SENDBATCH];
+        struct iovec iov[MAX_SENDBATCH];
+        union TtlCmsg cbuf[MAX_SENDBATCH];
+        unsigned int c;
+        int ret;
+
+        if (n > MAX_SENDBATCH) {
+                n = MAX_SENDBATCH;
+        }
+
+        memset(mm, 0, n * sizeof(mm[0]));
+        for (c = 0; c < n; c++) {
+                iov[c].iov_base = msgs[c].data;
+                iov[c].iov_len = msgs[c].len;
+                mm[c].msg_hdr.msg_name = (void*)msgs[c].to;
+                mm[c].msg_hdr.msg_namelen = msgs[c].tolen;
+                mm[c].msg_hdr.msg_iov = &iov[c];
+                mm[c].msg_hdr.msg_iovlen = 1;
+                if (msgs[c].ttl > 0) {
+                        ttlCmsg(&mm[c].msg_hdr, &cbuf[c],
+                                msgs[c].af, msgs[c].ttl);
+                }
+        }
+
+        ret = sendmmsg(sock, mm, n, 0);
+
+	if (options.verbose > 2) {
+		fprintf(stderr, "%s: doSendBatch[mmsg](%d, %u) = %d\n",
+                        argv0, sock, n, ret);
+	}
+        return ret;
+}
+
+/* ---- Emacs Variables ----
+ * Local Variables:
+ * c-basic-offset: 8
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -15,11 +15,17 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
 
 #include <netdb.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <net/if.h>
+#ifdef HAVE_PTHREAD_CREATE
+#include <pthread.h>
+#endif
 
 #include "getaddrinfo.h"
 
@@ -30,6 +36,10 @@
 # define __u8 uint8_t
 # define __u32 uint32_t
 # include <linux/errqueue.h>
+# if defined(SO_TIMESTAMPING) && defined(SO_EE_ORIGIN_TIMESTAMPING)
+#  include <linux/net_tstamp.h>
+#  define HAVE_TX_TIMESTAMPS 1
+# endif
 # undef __u8
 # undef __u32
  /* Sometimes these constants are wrong in the headers, so we check both the
@@ -41,12 +51,239 @@
 
 static unsigned int icmpError = 0;
 
+/* Cache of offender address strings, so that a flood of errors from the
+ * same router doesn't call getnameinfo() for every one. Direct mapped,
+ * one per thread. */
+#define OFFENDER_CACHE_SIZE 256   /* power of two */
+#define OFFENDER_MAXLEN (INET6_ADDRSTRLEN + IF_NAMESIZE + 1)
+struct Offender {
+        struct sockaddr_storage addr;  /* ss_family AF_UNSPEC if unused */
+        char str[OFFENDER_MAXLEN];
+};
+static THREAD_LOCAL struct Offender offenderCache[OFFENDER_CACHE_SIZE];
+
+/* Error counts by (offender, origin, type, code, errno), for the
+ * summary and interval reports. Shared by all threads. */
+#define ERRSTAT_SIZE 1024          /* power of two */
+#define ERRSTAT_MAX (ERRSTAT_SIZE * 3 / 4)
+struct ErrStat {
+        struct sockaddr_storage offender; /* AF_UNSPEC if local/unknown */
+        uint8_t origin;
+        uint8_t type;
+        uint8_t code;
+        uint32_t err;
+        int used;
+        char what[32];
+        char from[OFFENDER_MAXLEN];
+        unsigned int count;
+        unsigned int reported;     /* count at last interval report */
+};
+static struct ErrStat errStats[ERRSTAT_SIZE];
+static unsigned int errStatsUsed = 0;
+static unsigned int errStatsOther = 0;   /* didn't fit in table */
+static unsigned int errStatsOtherReported = 0;
+
+/* Rows of errInspectionReport(), copied out of the table so that
+ * printing doesn't hold the lock. Only the main thread reports. */
+static struct ErrStat errReport[ERRSTAT_MAX];
+
+#ifdef HAVE_THREADS
+static pthread_mutex_t errStatsLock = PTHREAD_MUTEX_INITIALIZER;
+# define ERRSTAT_LOCK() pthread_mutex_lock(&errStatsLock)
+# define ERRSTAT_UNLOCK() pthread_mutex_unlock(&errStatsLock)
+#else
+# define ERRSTAT_LOCK()
+# define ERRSTAT_UNLOCK()
+#endif
+
 void
 errInspectionPrintSummary()
 {
         printf(", %u ICMP error", icmpError);
 }
 
+/**
+ * Name of ee_origin.
+ */
+static const char*
+originString(int origin)
+{
+        switch (origin) {
+        case SO_EE_ORIGIN_LOCAL:
+                return "local";
+        case SO_EE_ORIGIN_ICMP:
+                return "icmp";
+        case SO_EE_ORIGIN_ICMP6:
+                return "icmp6";
+        }
+        return "other";
+}
+
+/**
+ * Print counts from the error table. Interval reports show the errors
+ * since the last interval report, others the totals.
+ */
+void
+errInspectionReport(int interval)
+{
+        unsigned int c;
+        unsigned int rows = 0;
+        unsigned int other;
+        int header = 0;
+
+        ERRSTAT_LOCK();
+        for (c = 0; c < ERRSTAT_SIZE && rows < ERRSTAT_MAX; c++) {
+                struct ErrStat *e = &errStats[c];
+                unsigned int n = e->count;
+
+                if (!e->used) {
+                        continue;
+                }
+                if (interval) {
+                        n -= e->reported;
+                        e->reported = e->count;
+                }
+                if (!n) {
+                        continue;
+                }
+                errReport[rows] = *e;
+                errReport[rows++].count = n;
+        }
+        other = errStatsOther;
+        if (interval) {
+                other -= errStatsOtherReported;
+                errStatsOtherReported = errStatsOther;
+        }
+        ERRSTAT_UNLOCK();
+
+        for (c = 0; c < rows; c++) {
+                const struct ErrStat *e = &errReport[c];
+                unsigned int n = e->count;
+
+                if (options.output != OUTPUT_TEXT) {
+                        outputErrorStat(interval, e->from,
+                                        originString(e->origin),
+                                        e->type, e->code, e->err,
+                                        e->what, n);
+                        continue;
+                }
+                if (!header) {
+                        if (interval) {
+                                printf("errors:\n");
+                        } else {
+                                printf("\n--- errors ---\n"
+                                       "%-39s %-6s %-9s %-24s %s\n",
+                                       "from", "origin", "type/code",
+                                       "error", "count");
+                        }
+                        header = 1;
+                }
+                printf("%s%-39s %-6s %4d/%-4d %-24s %u\n",
+                       interval ? "  " : "",
+                       e->from, originString(e->origin),
+                       e->type, e->code, e->what, n);
+        }
+        if (other) {
+                if (options.output != OUTPUT_TEXT) {
+                        outputErrorStat(interval, "other", "other",
+                                        -1, -1, 0, "other", other);
+                } else {
+                        printf("%s%u more errors from other sources\n",
+                               interval ? "  " : "", other);
+                }
+        }
+}
+
+/**
+ * Call fn with the total count of each kind of error in the error table,
+ * for the exporter. type and code < 0 if unknown.
+ */
+void
+errInspectionForEach(void (*fn)(void *arg, const char *from,
+                                const char *origin, int type, int code,
+                                const char *error, unsigned int count),
+                     void *arg)
+{
+        unsigned int c;
+
+        ERRSTAT_LOCK();
+        for (c = 0; c < ERRSTAT_SIZE; c++) {
+                const struct ErrStat *e = &errStats[c];
+                if (e->used) {
+                        fn(arg, e->from, originString(e->origin),
+                           e->type, e->code, e->what, e->count);
+                }
+        }
+        if (errStatsOther) {
+                fn(arg, "other", "other", -1, -1, "other", errStatsOther);
+        }
+        ERRSTAT_UNLOCK();
+}
+
+/**
+ * Count error see in the error table. offender is from offenderKey(), or
+ * AF_UNSPEC if local or unknown.
+ */
+static void
+errStatAdd(const struct sock_extended_err *see,
+           const struct sockaddr_storage *offender,
+           const char *from, const char *what)
+{
+        unsigned int h = 2166136261U;
+        unsigned int pos;
+        const unsigned char *p = (const unsigned char*)offender;
+        size_t len = sizeof(*offender);
+
+        h = (h ^ see->ee_origin) * 16777619U;
+        h = (h ^ see->ee_type) * 16777619U;
+        h = (h ^ see->ee_code) * 16777619U;
+        h = (h ^ see->ee_errno) * 16777619U;
+        while (len--) {
+                h = (h ^ *p++) * 16777619U;
+        }
+
+        ERRSTAT_LOCK();
+        for (pos = h & (ERRSTAT_SIZE - 1);
+             errStats[pos].used;
+             pos = (pos + 1) & (ERRSTAT_SIZE - 1)) {
+                struct ErrStat *e = &errStats[pos];
+                if (e->origin == see->ee_origin
+                    && e->type == see->ee_type
+                    && e->code == see->ee_code
+                    && e->err == see->ee_errno
+                    && !memcmp(&e->offender, offender, sizeof(*offender))) {
+                        e->count++;
+                        ERRSTAT_UNLOCK();
+                        return;
+                }
+        }
+        if (errStatsUsed >= ERRSTAT_MAX) {
+                errStatsOther++;
+        } else {
+                struct ErrStat *e = &errStats[pos];
+                e->offender = *offender;
+                e->origin = see->ee_origin;
+                e->type = see->ee_type;
+                e->code = see->ee_code;
+                e->err = see->ee_errno;
+                snprintf(e->what, sizeof(e->what), "%s", what);
+                snprintf(e->from, sizeof(e->from), "%s", from);
+                e->count = 1;
+                e->used = 1;
+                errStatsUsed++;
+        }
+        ERRSTAT_UNLOCK();
+}
+
+/**
+ *
+ */
+unsigned int
+errInspectionCount()
+{
+        return icmpError;
+}
+
 /**
  *
  */
@@ -61,6 +298,32 @@ errInspectionInit(int fd, const struct addrinfo *addrs)
 				"%s\n", argv0, fd, strerror(errno));
 		}
 	}
+        if (options.kerneltime) {
+#ifdef HAVE_TX_TIMESTAMPS
+                /* TX timestamps come back on the error queue, tagged with
+                 * a per-socket counter (OPT_ID) instead of the packet */
+                int flags = SOF_TIMESTAMPING_TX_SOFTWARE
+                        | SOF_TIMESTAMPING_SOFTWARE
+                        | SOF_TIMESTAMPING_OPT_ID
+                        | SOF_TIMESTAMPING_OPT_TSONLY;
+                if (options.kerneltime > 1) {
+                        flags |= SOF_TIMESTAMPING_TX_HARDWARE
+                                | SOF_TIMESTAMPING_RX_HARDWARE
+                                | SOF_TIMESTAMPING_RAW_HARDWARE;
+                }
+                if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING,
+                               &flags, sizeof(flags))) {
+			fprintf(stderr,
+				"%s: setsockopt(%d, SOL_SOCKET, "
+                                "SO_TIMESTAMPING, 0x%x): %s\n",
+                                argv0, fd, flags, strerror(errno));
+                }
+#else
+                fprintf(stderr,
+                        "%s: TX timestamps are not supported "
+                        "on your OS\n", argv0);
+#endif
+        }
 	if (addrs->ai_family == AF_INET6) {
 		int on = 1;
 		if (setsockopt(fd,
@@ -89,6 +352,84 @@ errInspectionInit(int fd, const struct addrinfo *addrs)
 }
 
 /**
+ * Hash offender address to a cache slot, and copy the parts of it that
+ * matter (family, address, scope) to key.
+ *
+ * return -1 if not an IP address
+ */
+static int
+offenderKey(const struct sockaddr *sa, struct sockaddr_storage *key)
+{
+        const unsigned char *p;
+        size_t len;
+        unsigned int h = 2166136261U;
+
+        memset(key, 0, sizeof(*key));
+        switch (sa->sa_family) {
+        case AF_INET: {
+                struct sockaddr_in *k4 = (struct sockaddr_in*)key;
+                k4->sin_family = AF_INET;
+                k4->sin_addr = ((const struct sockaddr_in*)sa)->sin_addr;
+                p = (const unsigned char*)&k4->sin_addr;
+                len = sizeof(k4->sin_addr);
+                break;
+        }
+        case AF_INET6: {
+                const struct sockaddr_in6 *s6 = (const void*)sa;
+                struct sockaddr_in6 *k6 = (struct sockaddr_in6*)key;
+                k6->sin6_family = AF_INET6;
+                k6->sin6_addr = s6->sin6_addr;
+                k6->sin6_scope_id = s6->sin6_scope_id;
+                p = (const unsigned char*)&k6->sin6_addr;
+                len = sizeof(k6->sin6_addr);
+                break;
+        }
+        default:
+                return -1;
+        }
+        while (len--) {
+                h = (h ^ *p++) * 16777619U;
+        }
+        return h & (OFFENDER_CACHE_SIZE - 1);
+}
+
+/**
+ * Numeric address of ICMP error sender, from cache if seen before.
+ *
+ * return NULL if it can't be formatted
+ */
+static const char*
+offenderString(const struct sockaddr *sa)
+{
+        struct sockaddr_storage key;
+        struct Offender *o;
+        int slot;
+        int err;
+
+        if (0 > (slot = offenderKey(sa, &key))) {
+                return NULL;
+        }
+        o = &offenderCache[slot];
+        if (!memcmp(&o->addr, &key, sizeof(key))) {
+                return o->str;
+        }
+        if ((err = getnameinfo((struct sockaddr*)&key,
+                               sockaddrlen(key.ss_family),
+                               o->str, sizeof(o->str),
+                               NULL, 0,
+                               NI_NUMERICHOST))) {
+                fprintf(stderr, "%s: getnameinfo(): %s\n",
+                        argv0, gai_strerror(err));
+                o->addr.ss_family = AF_UNSPEC;
+                return NULL;
+        }
+        o->addr = key;
+        return o->str;
+}
+
+/**
+ * Handle error see for a packet that was sent to dst (NULL if unknown).
+ *
  * return:
  *      0 if no error
  *      1 if TTL exceeded
@@ -96,40 +437,111 @@ errInspectionInit(int fd, const struct addrinfo *addrs)
  */
 static int
 handleRecvErrSEE(struct sock_extended_err *see,
+                 const struct sockaddr *dst,
                  int returnttl,
-                 const char *tos,
-                 double lastPingTime)
+                 int tos,
+                 double lastPingTime,
+                 struct RecvErr *re)
 {
-	int isicmp = 0;
         int ret = 0;
+        const char *what;
+        const char *tosStr = NULL;
+        char tosBuf[128];
+        char pmtu[32];
+        struct sockaddr *offender;
+        struct sockaddr_storage key;
+        const char *from = NULL;
 
 	if (!see) {
 		fprintf(stderr, "%s: Error, but no error info\n", argv0);
 		return ret;
 	}
+        offender = SO_EE_OFFENDER(see);
 
+        /* Find error message */
+        switch (see->ee_errno) {
+        case ECONNREFUSED:
+                what = "Port closed";
+                ret = 2;
+                break;
+        case EMSGSIZE:
+                snprintf(pmtu, sizeof(pmtu), "PMTU %d", see->ee_info);
+                what = pmtu;
+                ret = 2;
+                break;
+        case EPROTO:
+                what = "Protocol error";
+                ret = 2;
+                break;
+        case ENETUNREACH:
+                what = "Network unreachable";
+                ret = 2;
+                break;
+        case EACCES:
+                what = "Access denied";
+                ret = 2;
+                break;
+        case EHOSTUNREACH:
+                /* ICMP type 11, ICMPv6 type 3 */
+                if (see->ee_code == 0
+                    && ((see->ee_origin == SO_EE_ORIGIN_ICMP
+                         && see->ee_type == 11)
+                        || (see->ee_origin == SO_EE_ORIGIN_ICMP6
+                            && see->ee_type == 3))) {
+                        what = "TTL exceeded";
+                        ret = 1;
+                } else {
+                        what = "Host unreachable";
+                        ret = 2;
+                }
+                break;
+        default:
+                what = strerror(see->ee_errno);
+                ret = 2;
+                break;
+        }
+        /* who sent it. NULL if unknown */
+        memset(&key, 0, sizeof(key));
+        if (see->ee_origin == SO_EE_ORIGIN_LOCAL) {
+                from = "local";
+        } else if (0 <= offenderKey(offender, &key)) {
+                from = offenderString(offender);
+        }
+        errStatAdd(see, &key, from ? from : "<unknown>", what);
+        targetError(dst, see->ee_errno == ECONNREFUSED);
+
+        if (re) {
+                /* caller prints it */
+                re->ret = ret;
+                snprintf(re->from, sizeof(re->from), "%s", from ? from : "");
+                snprintf(re->error, sizeof(re->error), "%s", what);
+                return ret;
+        }
+
+        if (options.output != OUTPUT_TEXT) {
+                outputError(from, returnttl, tos,
+                            lastPingTime
+                            ? clock_get_dbl() - lastPingTime : -1,
+                            what);
+                return ret;
+        }
+
+        if (tos >= 0) {
+                tosStr = tos2String(tos, tosBuf, sizeof(tosBuf));
+        }
+        flockfile(stdout);
 	/* print "From ...: */
         if (see->ee_origin == SO_EE_ORIGIN_LOCAL) {
 		printf("From local system: ");
 	} else {
-		struct sockaddr *offender = SO_EE_OFFENDER(see);
-		char abuf[NI_MAXHOST];
-		int err;
-		
 		if (offender->sa_family == AF_UNSPEC) {
                         if (!options.traceroute) { printf("From "); }
                         printf("<unknown>: ");
-		} else if ((err = getnameinfo(offender,
-					      sizeof(struct sockaddr_storage),
-					      abuf, NI_MAXHOST,
-					      NULL, 0,
-					      NI_NUMERICHOST))) {
-			fprintf(stderr, "%s: getnameinfo(): %s\n",
-				argv0, gai_strerror(err));
+		} else if (!from) {
                         if (!options.traceroute) { printf("From "); }
                         printf("<unknown>");
-                        if (tos) {
-                                printf(" %s", tos);
+                        if (tosStr) {
+                                printf(" %s", tosStr);
                         }
                         if (returnttl > 0) {
                                 printf(" ttl=%d", returnttl);
@@ -137,9 +549,9 @@ handleRecvErrSEE(struct sock_extended_err *see,
                         printf(": ");
 		} else {
                         if (!options.traceroute) { printf("From "); }
-                        printf("%s", abuf);
-                        if (tos) {
-                                printf(" %s", tos);
+                        printf("%s", from);
+                        if (tosStr) {
+                                printf(" %s", tosStr);
                         }
                         if (returnttl > 0) {
                                 printf(" ttl=%d", returnttl);
@@ -151,64 +563,44 @@ handleRecvErrSEE(struct sock_extended_err *see,
                         printf(": ");
 		}
 	}
-	
-	if (see->ee_origin == SO_EE_ORIGIN_ICMP6
-	    || see->ee_origin == SO_EE_ORIGIN_ICMP) {
-		isicmp = 1;
-	}
 
-	/* Print error message */
-	switch (see->ee_errno) {
-	case ECONNREFUSED:
-		printf("Port closed");
-                ret = 2;
-		break;
-	case EMSGSIZE:
-		printf("PMTU %d", see->ee_info);
-                ret = 2;
-		break;
-	case EPROTO:
-		printf("Protocol error");
-                ret = 2;
-		break;
-	case ENETUNREACH:
-		printf("Network unreachable");
-                ret = 2;
-		break;
-	case EACCES:
-		printf("Access denied");
-                ret = 2;
-		break;
-	case EHOSTUNREACH:
-		if (isicmp && see->ee_type == 11 && see->ee_code == 0) {
-                        printf("TTL exceeded");
-                        ret = 1;
-                } else {
-			printf("Host unreachable");
-                        ret = 2;
-		}
-		break;
-	default:
-		printf("%s", strerror(see->ee_errno));
-                ret = 2;
-		break;
-	}
-        icmpError++;
+	printf("%s", what);
 	if (options.verbose && (0 < returnttl)) {
 		printf(". return TTL: %d.", returnttl);
 	}
 	printf("\n");
+        funlockfile(stdout);
         return ret;
 }
 
 /**
+ * Add n to the total error count.
+ */
+static void
+countErrors(unsigned int n)
+{
+        if (!n) {
+                return;
+        }
+#ifdef HAVE_THREADS
+        __sync_fetch_and_add(&icmpError, n);
+#else
+        icmpError += n;
+#endif
+}
+
+/**
+ * Read and handle one message from the error queue. *empty is set if
+ * there was none. If re is set the error is stored there instead of
+ * printed.
+ *
  * return:
  *      0 if no error
  *      1 if TTL exceeded
  *     >1 if other icmp-like error
  */
-int
-handleRecvErr(int fd, const char *reason, double lastPingTime)
+static int
+recvErrOne(int fd, double lastPingTime, int *empty, struct RecvErr *re)
 {
 	struct msghdr msg;
 	struct cmsghdr *cmsg;
@@ -218,11 +610,10 @@ handleRecvErr(int fd, const char *reason, double lastPingTime)
 	struct iovec iov;
 	int n;
 	int returnttl = -1;
-        char *tos = 0;
+        int tos = -1;
         int ret = 0;
-
-        /* ignore reason, we know better */
-        reason = reason;
+        double txtime = 0;
+        double txhw = 0;
 
 	/* get error data */
 	iov.iov_base = buf;
@@ -236,13 +627,20 @@ handleRecvErr(int fd, const char *reason, double lastPingTime)
 	msg.msg_controllen = sizeof(cbuf);
 	
 	if (0 > (n = recvmsg(fd, &msg, MSG_ERRQUEUE))) {
-		if (errno == EAGAIN) {
+                *empty = 1;
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
                         goto errout;
 		}
 		fprintf(stderr, "%s: recvmsg(%d, ..., MSG_ERRQUEUE): %s\n",
 			argv0, fd, strerror(errno));
                 goto errout;
 	}
+        if (re) {
+                /* the payload we sent, to tell which probe it was */
+                re->len = (size_t)n < sizeof(re->data)
+                        ? (size_t)n : sizeof(re->data);
+                memcpy(re->data, buf, re->len);
+        }
 
 	/* First find ttl */
 	for (cmsg = CMSG_FIRSTHDR(&msg);
@@ -260,6 +658,18 @@ handleRecvErr(int fd, const char *reason, double lastPingTime)
 	for (cmsg = CMSG_FIRSTHDR(&msg);
 	     cmsg;
 	     cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+#ifdef HAVE_TX_TIMESTAMPS
+                if (cmsg->cmsg_level == SOL_SOCKET
+                    && cmsg->cmsg_type == SCM_TIMESTAMPING) {
+                        /* [0] is software, [2] is hardware. They come in
+                         * separate messages, and are different clocks */
+                        struct scm_timestamping ts;
+                        memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+                        txtime = ts.ts[0].tv_sec + ts.ts[0].tv_nsec / 1e9;
+                        txhw = ts.ts[2].tv_sec + ts.ts[2].tv_nsec / 1e9;
+                        continue;
+                }
+#endif
                 if (cmsg->cmsg_level == SOL_IP
 		    || cmsg->cmsg_level == SOL_IPV6) {
 			switch(cmsg->cmsg_type) {
@@ -267,33 +677,38 @@ handleRecvErr(int fd, const char *reason, double lastPingTime)
 #ifdef IPV6_TCLASS
                         case IPV6_TCLASS:
 #endif
+                                tos = *(unsigned char*)CMSG_DATA(cmsg);
+                                break;
+			case IP_RECVERR:
+			case IPV6_RECVERR:
+#ifdef HAVE_TX_TIMESTAMPS
                                 {
-                                        char scratch[128];
-                                        free(tos);
-                                        if (!(tos = malloc(128))) {
-                                                fprintf(stderr,
-                                                        "%s: "
-                                                        "malloc(128): %s\n",
-                                                        argv0,
-                                                        strerror(errno));
-                                                goto errout;
+                                        struct sock_extended_err *see;
+                                        see = (struct sock_extended_err*)
+                                                CMSG_DATA(cmsg);
+                                        if (see->ee_origin
+                                            == SO_EE_ORIGIN_TIMESTAMPING) {
+                                                /* not an error */
+                                                if (txtime || txhw) {
+                                                        txTimestamp(fd,
+                                                                    see->ee_data,
+                                                                    txtime,
+                                                                    txhw);
+                                                }
+                                                break;
                                         }
-                                        snprintf(tos, 128,
-                                                 "%s",
-                                                 tos2String(*(unsigned char*)
-                                                            CMSG_DATA(cmsg),
-                                                            scratch,
-                                                            sizeof(scratch)));
-                                        break;
                                 }
-			case IP_RECVERR:
-			case IPV6_RECVERR:
+#endif
                                 ret = handleRecvErrSEE((struct
                                                         sock_extended_err*)
                                                        CMSG_DATA(cmsg),
+                                                       msg.msg_namelen
+                                                       ? (struct sockaddr*)&sa
+                                                       : NULL,
                                                        returnttl,
                                                        tos,
-                                                       lastPingTime);
+                                                       lastPingTime,
+                                                       re);
 				break;
 			case IP_TTL:
 #if IPV6_HOPLIMIT != REAL_IPV6_HOPLIMIT
@@ -317,7 +732,84 @@ handleRecvErr(int fd, const char *reason, double lastPingTime)
 		}
 	}
  errout:;
-        free(tos);
+        if (re && ret) {
+                re->ttl = returnttl;
+                re->tos[0] = 0;
+                if (tos >= 0) {
+                        char scratch[128];
+                        snprintf(re->tos, sizeof(re->tos), "%s",
+                                 tos2String(tos, scratch, sizeof(scratch)));
+                }
+        }
+        return ret;
+}
+
+/**
+ * Handle one error from the error queue. Reason is ignored, we know
+ * better.
+ *
+ * return:
+ *      0 if no error
+ *      1 if TTL exceeded
+ *     >1 if other icmp-like error
+ */
+int
+handleRecvErr(int fd, const char *reason, double lastPingTime)
+{
+        int empty = 0;
+        int ret;
+
+        /* ignore reason, we know better */
+        reason = reason;
+
+        if ((ret = recvErrOne(fd, lastPingTime, &empty, NULL))) {
+                countErrors(1);
+        }
+        return ret;
+}
+
+/**
+ * Handle up to max errors from the error queue, so that a flood of
+ * errors doesn't take one event loop round each. *more is set if the
+ * queue may not be empty.
+ *
+ * return number of errors (not counting TX timestamps)
+ */
+unsigned int
+handleRecvErrs(int fd, unsigned int max, int *more)
+{
+        unsigned int n = 0;
+        unsigned int c;
+        int empty = 0;
+
+        for (c = 0; c < max && !empty; c++) {
+                if (recvErrOne(fd, 0, &empty, NULL)) {
+                        n++;
+                }
+        }
+        countErrors(n);
+        *more = !empty;
+        return n;
+}
+
+/**
+ * Read one error from the error queue, without printing it, for callers
+ * that match it to the packet that caused it (parallel traceroute).
+ * *empty is set if the queue was empty.
+ *
+ * return as handleRecvErr()
+ */
+int
+recvErrDetail(int fd, struct RecvErr *re, int *empty)
+{
+        int ret;
+
+        memset(re, 0, sizeof(*re));
+        re->ttl = -1;
+        *empty = 0;
+        if ((ret = recvErrOne(fd, 0, empty, re))) {
+                countErrors(1);
+        }
         return ret;
 }
 
@@ -9,7 +9,9 @@
 #include "config.h"
 #endif
 
+#include <errno.h>
 #include <stdio.h>
+#include <string.h>
 #include <netdb.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -34,6 +36,34 @@ errInspectionPrintSummary()
 {
 }
 
+/**
+ * Errors are not told apart, so there's no table to print.
+ */
+void
+errInspectionReport(int interval)
+{
+}
+
+/**
+ *
+ */
+unsigned int
+errInspectionCount()
+{
+        return 0;
+}
+
+/**
+ * No error table.
+ */
+void
+errInspectionForEach(void (*fn)(void *arg, const char *from,
+                                const char *origin, int type, int code,
+                                const char *error, unsigned int count),
+                     void *arg)
+{
+}
+
 /**
  * return:
  *      0 if no error
@@ -43,16 +73,52 @@ errInspectionPrintSummary()
 int
 handleRecvErr(int fd, const char *reason, double lastPingTime)
 {
+        /* called right after the failed recv() */
+        int refused = (errno == ECONNREFUSED);
+
         fd = fd;
-        if (reason) {
-                printf("%s\n", reason);
+        targetError(NULL, reason && refused);
+        if (!reason) {
+                reason = "Destination unreachable "
+                        "(closed, filtered or TTL exceeded)";
+        }
+        if (options.output != OUTPUT_TEXT) {
+                outputError(NULL, -1, -1, -1, reason);
         } else {
-                printf("Destination unreachable "
-                       "(closed, filtered or TTL exceeded)\n");
+                printf("%s\n", reason);
         }
         return 0;
 }
 
+/**
+ * Only one error is known per poll() wakeup, so there's nothing to drain.
+ *
+ * return number of errors
+ */
+unsigned int
+handleRecvErrs(int fd, unsigned int max, int *more)
+{
+        *more = 0;
+        handleRecvErr(fd, NULL, 0);
+        return 1;
+}
+
+/**
+ * No way to tell which packet caused the error, so it's printed here and
+ * left unmatched.
+ *
+ * return as handleRecvErr()
+ */
+int
+recvErrDetail(int fd, struct RecvErr *re, int *empty)
+{
+        memset(re, 0, sizeof(*re));
+        re->ttl = -1;
+        *empty = 1;
+        handleRecvErr(fd, NULL, 0);
+        return 0;
+}
+
 /* ---- Emacs Variables ----
  * Local Variables:
  * c-basic-offset: 8
@@ -0,0 +1,206 @@
+/** gtping/src/eventloop_epoll.c
+ *
+ *  By Thomas Habets <thomas@habets.se> 2009
+ *
+ * Event loop using edge-triggered epoll. Signals are delivered through
+ * a signalfd, so they are handled in the loop and not asynchronously.
+ *
+ * Edge-triggered means a ready fd is only reported once. Callers that
+ * don't read everything must call evRearm().
+ *
+ * Systems known to use this code: Linux
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+
+#include "gtping.h"
+
+/* one loop per thread. Signals only go to the main thread's loop. */
+static THREAD_LOCAL int epfd = -1;
+static int sigfd = -1;
+static sigset_t sigmask;
+static void (*sigHandlers[NSIG])(int);
+
+/**
+ * return 0 on success, <0 on error.
+ */
+int
+evInit()
+{
+        if (0 > (epfd = epoll_create1(EPOLL_CLOEXEC))) {
+                int err = errno;
+                fprintf(stderr, "%s: epoll_create1(): %s\n",
+                        argv0, strerror(err));
+                return -err;
+        }
+        return 0;
+}
+
+/**
+ *
+ */
+static int
+evCtl(int op, int fd)
+{
+        struct epoll_event ev;
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLERR | EPOLLET;
+        ev.data.fd = fd;
+        if (epoll_ctl(epfd, op, fd, &ev)) {
+                int err = errno;
+                fprintf(stderr, "%s: epoll_ctl(%d, %d, %d): %s\n",
+                        argv0, epfd, op, fd, strerror(err));
+                return -err;
+        }
+        return 0;
+}
+
+/**
+ * Watch fd for readability and errors.
+ */
+int
+evAdd(int fd)
+{
+        return evCtl(EPOLL_CTL_ADD, fd);
+}
+
+/**
+ *
+ */
+int
+evDel(int fd)
+{
+        if (epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL)) {
+                int err = errno;
+                fprintf(stderr, "%s: epoll_ctl(%d, DEL, %d): %s\n",
+                        argv0, epfd, fd, strerror(err));
+                return -err;
+        }
+        return 0;
+}
+
+/**
+ * Caller didn't drain fd. Modifying it makes epoll check it again, so
+ * it's reported by the next evWait() if still ready.
+ */
+void
+evRearm(int fd)
+{
+        evCtl(EPOLL_CTL_MOD, fd);
+}
+
+/**
+ * Call handler from evWait() when sig is received.
+ */
+int
+evSignal(int sig, void (*handler)(int))
+{
+        int fd;
+
+        if (sigfd < 0) {
+                sigemptyset(&sigmask);
+        }
+        sigHandlers[sig] = handler;
+        sigaddset(&sigmask, sig);
+        if (sigprocmask(SIG_BLOCK, &sigmask, NULL)) {
+                int err = errno;
+                fprintf(stderr, "%s: sigprocmask(): %s\n",
+                        argv0, strerror(err));
+                return -err;
+        }
+        /* first call creates the signalfd, later calls update its mask */
+        if (0 > (fd = signalfd(sigfd, &sigmask, SFD_NONBLOCK | SFD_CLOEXEC))) {
+                int err = errno;
+                fprintf(stderr, "%s: signalfd(): %s\n",
+                        argv0, strerror(err));
+                return -err;
+        }
+        if (sigfd < 0) {
+                sigfd = fd;
+                return evAdd(sigfd);
+        }
+        return 0;
+}
+
+/**
+ * Run handlers of signals queued on the signalfd.
+ */
+static void
+evReadSignals()
+{
+        struct signalfd_siginfo si;
+
+        while (sizeof(si) == read(sigfd, &si, sizeof(si))) {
+                if (si.ssi_signo < NSIG && sigHandlers[si.ssi_signo]) {
+                        sigHandlers[si.ssi_signo](si.ssi_signo);
+                }
+        }
+}
+
+/**
+ * Wait up to timeout seconds (<0 is forever) for events.
+ *
+ * return number of events stored in evs, 0 on timeout or signal.
+ */
+int
+evWait(struct Event *evs, int max, double timeout)
+{
+        struct epoll_event eevs[MAX_EVENTS];
+        int ms = -1;
+        int n;
+        int c;
+        int ret = 0;
+
+        if (max > MAX_EVENTS) {
+                max = MAX_EVENTS;
+        }
+        if (timeout >= 0) {
+                /* round up, or we'd wake up early and spin */
+                ms = (int)(timeout * 1000);
+                if (ms < timeout * 1000) {
+                        ms++;
+                }
+        }
+        if (0 > (n = epoll_wait(epfd, eevs, max, ms))) {
+                if (errno == EINTR) {
+                        return 0;
+                }
+                fprintf(stderr, "%s: epoll_wait(%d, ..., %d, %d): %s\n",
+                        argv0, epfd, max, ms, strerror(errno));
+                exit(2);
+        }
+        for (c = 0; c < n; c++) {
+                if (eevs[c].data.fd == sigfd) {
+                        evReadSignals();
+                        continue;
+                }
+                evs[ret].fd = eevs[c].data.fd;
+                evs[ret].events = 0;
+                if (eevs[c].events & (EPOLLIN | EPOLLHUP)) {
+                        evs[ret].events |= EV_IN;
+                }
+                if (eevs[c].events & EPOLLERR) {
+                        evs[ret].events |= EV_ERR;
+                }
+                ret++;
+        }
+        return ret;
+}
+
+/* ---- Emacs Variables ----
+ * Local Variables:
+ * c-basic-offset: 8
+ * indent-tabs-mode: nil
+ * End:
+ */
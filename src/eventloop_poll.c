@@ -0,0 +1,147 @@
+/** gtping/src/eventloop_poll.c
+ *
+ *  By Thomas Habets <thomas@habets.se> 2009
+ *
+ * Event loop using poll(), for systems without epoll. Level-triggered,
+ * so evRearm() is not needed. Signals use normal signal handlers and
+ * interrupt the poll().
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+
+#include "gtping.h"
+
+/* one loop per thread */
+static THREAD_LOCAL struct pollfd fds[MAX_EVENTS];
+static THREAD_LOCAL unsigned int nfds = 0;
+
+/**
+ *
+ */
+int
+evInit()
+{
+        nfds = 0;
+        return 0;
+}
+
+/**
+ * Watch fd for readability and errors.
+ */
+int
+evAdd(int fd)
+{
+        if (nfds == MAX_EVENTS) {
+                fprintf(stderr, "%s: can't poll more than %d fds\n",
+                        argv0, MAX_EVENTS);
+                return -EMFILE;
+        }
+        fds[nfds].fd = fd;
+        fds[nfds].events = POLLIN;
+        nfds++;
+        return 0;
+}
+
+/**
+ *
+ */
+int
+evDel(int fd)
+{
+        unsigned int c;
+
+        for (c = 0; c < nfds; c++) {
+                if (fds[c].fd == fd) {
+                        fds[c] = fds[--nfds];
+                        return 0;
+                }
+        }
+        return -ENOENT;
+}
+
+/**
+ * Level-triggered, nothing to do.
+ */
+void
+evRearm(int fd)
+{
+}
+
+/**
+ *
+ */
+int
+evSignal(int sig, void (*handler)(int))
+{
+        if (SIG_ERR == signal(sig, handler)) {
+                int err = errno;
+                fprintf(stderr, "%s: signal(%d, ...): %s\n",
+                        argv0, sig, strerror(err));
+                return -err;
+        }
+        return 0;
+}
+
+/**
+ * Wait up to timeout seconds (<0 is forever) for events.
+ *
+ * return number of events stored in evs, 0 on timeout or signal.
+ */
+int
+evWait(struct Event *evs, int max, double timeout)
+{
+        int ms = -1;
+        int n;
+        unsigned int c;
+        int ret = 0;
+
+        if (timeout >= 0) {
+                /* round up, or we'd wake up early and spin */
+                ms = (int)(timeout * 1000);
+                if (ms < timeout * 1000) {
+                        ms++;
+                }
+        }
+        for (c = 0; c < nfds; c++) {
+                fds[c].revents = 0;
+        }
+        if (0 > (n = poll(fds, nfds, ms))) {
+                if (errno == EINTR || errno == EAGAIN) {
+                        return 0;
+                }
+                fprintf(stderr, "%s: poll(..., %d, %d): %s\n",
+                        argv0, nfds, ms, strerror(errno));
+                exit(2);
+        }
+        for (c = 0; c < nfds && n && ret < max; c++) {
+                if (!fds[c].revents) {
+                        continue;
+                }
+                n--;
+                evs[ret].fd = fds[c].fd;
+                evs[ret].events = 0;
+                if (fds[c].revents & (POLLIN | POLLHUP)) {
+                        evs[ret].events |= EV_IN;
+                }
+                if (fds[c].revents & POLLERR) {
+                        evs[ret].events |= EV_ERR;
+                }
+                ret++;
+        }
+        return ret;
+}
+
+/* ---- Emacs Variables ----
+ * Local Variables:
+ * c-basic-offset: 8
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -31,15 +31,17 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <errno.h>
 #include <stdarg.h>
 #include <signal.h>
 #include <time.h>
-#include <poll.h>
 #include <math.h>
 #include <ctype.h>
+#include <limits.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <assert.h>
 #include <arpa/inet.h>
@@ -60,10 +62,12 @@
 #define SOL_IPV6 IPPROTO_IPV6
 #endif
 
-/* pings older than TRACKPINGS_SIZE * the_wait_time are ignored.
- * They are old and are considered lost.
- */
-#define TRACKPINGS_SIZE 1000
+/* max number of replies read from a socket before going back to check
+ * if it's time to send */
+#define RECV_DRAINMAX (16 * MAX_RECVBATCH)
+
+/* socket buffers asked for in responder mode (-L) */
+#define RESPONDER_SOCKBUF (4 * 1024 * 1024)
 
 /* For those OSs that don't read RFC3493, even though their manpage
  * points to it. */
@@ -74,19 +78,41 @@
 static const char *version = PACKAGE_VERSION;
 
 static volatile sig_atomic_t sigintReceived = 0;
-static unsigned int curSeq = 0;
+static volatile sig_atomic_t sigquitReceived = 0;
 static double startTime;
-static double sendTimes[TRACKPINGS_SIZE]; /* RTT data*/
-static int gotIt[TRACKPINGS_SIZE];        /* duplicate-check scratchpad  */
-static unsigned int totalTimeCount = 0;
-static double totalTime = 0;
-static double totalTimeSquared = 0;
-static double totalMin = -1;
-static double totalMax = -1;
-static unsigned int dups = 0;
-static unsigned int reorder = 0;
-static unsigned int highestSeq = 0;
-static unsigned int connectionRefused = 0;
+
+/* With worker threads (-j) each worker has its own shard of the
+ * targets, sockets and so on. In the main thread these are all
+ * targets. */
+static THREAD_LOCAL struct Target *targets = 0;
+static THREAD_LOCAL unsigned int numTargets = 0;
+
+/* multi-target mode: one unconnected socket per address family, and
+ * a hash table from reply source address to target */
+static THREAD_LOCAL int sockets[2] = { -1, -1 };   /* AF_INET, AF_INET6 */
+static THREAD_LOCAL struct Target **targetHash = 0;
+static THREAD_LOCAL unsigned int targetHashSize = 0; /* power of two */
+
+/* lookups of targets, parallel to targets[] */
+static struct Resolve *resolves = 0;
+
+/* options.wait, or adjusted to the RTT seen (autowait) */
+static THREAD_LOCAL double waitTime;
+
+/* what was sent, in order, per socket. For matching TX timestamps (-k),
+ * which the kernel numbers by order sent, to pings */
+struct SendInfo {
+        struct Target *t;
+        unsigned int seq;
+};
+#define TXID_RING_SIZE 4096
+static THREAD_LOCAL struct SendInfo txIds[2][TXID_RING_SIZE];
+static THREAD_LOCAL uint32_t txIdNext[2] = { 0, 0 };
+
+/* echo request that all sent packets are copied from */
+static union GtpEcho echoTemplate;
+static size_t echoLen;
+static size_t echoSeqOffset;
 
 /* from cmdline */
 const char *argv0 = 0;
@@ -95,6 +121,12 @@ struct Options options = {
         verbose: DEFAULT_VERBOSE,   /* -v increments */
 
         flood: 0,      /* -f */
+        kerneltime: 0, /* -k */
+        output: OUTPUT_TEXT, /* -o <format> */
+        batch: DEFAULT_BATCH, /* -b <num> */
+        inflight: 0,   /* -m <num>, 0 = from rate and wait */
+        threads: 1,    /* -j <num> */
+        numPercentiles: 0, /* -l <list>, 0 = DEFAULT_PERCENTILES */
 
         /* if still <0, set to DEFAULT_INTERVAL.
          * set this way to make -f work with -i  */
@@ -102,10 +134,11 @@ struct Options options = {
 
         wait: -1,      /* -w <time> */
         autowait: 0,   /* 0 = -w not used, continuously update options.wait  */
+        report: 0,     /* -I <time>, 0 = only on SIGQUIT */
 
         count: 0,      /* -c, 0 is infinite */
-        target: 0,     /* arg */
-        targetip: 0,   /* resolved arg */
+        targetfile: 0, /* -F <file> */
+        multi: 0,      /* more than one target */
         ttl: -1,       /* -T <ttl> */
         tos: -1,       /* -Q <dscp> */
         has_teid: 0,   /* -t <teid> */
@@ -116,8 +149,11 @@ struct Options options = {
         source:      NULL,  /* -s <source if or addr> */
         source_port: "0",   /* -P <num> */
 
-        traceroute: 0, /* -r */
+        traceroute: TRACEROUTE_OFF, /* -r or -R */
         traceroutehops: DEFAULT_TRACEROUTEHOPS,  /* -r[<# per hop>] */
+        traceroutemaxttl: DEFAULT_TRACEROUTEMAXTTL, /* -R -T <ttl> */
+        traceflows: 1,  /* -M <flows> */
+        responder: 0,   /* -L */
 };
 
 static const char *dscpTable[][2] = {
@@ -219,16 +255,17 @@ sockaddrlen(int af)
  *
  */
 static void
-bindSocket(int fd, const struct addrinfo *dest)
+bindSocket(int fd, const struct addrinfo *dest, const char *port)
 {
-        struct addrinfo hints;
-        struct addrinfo *addrs = 0;
-        struct addrinfo *curaddr = 0;
+        struct Resolve r;
+        struct addrinfo *ifaddrs = 0;
+        const struct addrinfo *addrs = 0;
+        const struct addrinfo *curaddr = 0;
         int gerr;
         const char *source = options.source;
 
         if (!source) {
-                if (!strcmp(options.source_port, "0")) {
+                if (!strcmp(port, "0")) {
                         return;
                 }
                 if (dest->ai_family == AF_INET) {
@@ -243,31 +280,32 @@ bindSocket(int fd, const struct addrinfo *dest)
                 }
         }
 
-        addrs = getIfAddrs(dest);
+        addrs = ifaddrs = getIfAddrs(dest);
         if (addrs) {
                 goto try_to_bind;
         }
 
         /* try to resolve it as an address. By now the target is set up so
-         * we know what we want */
-        memset(&hints, 0, sizeof(hints));
-        hints.ai_flags = AI_ADDRCONFIG;
-        hints.ai_family = dest->ai_family;
-        hints.ai_socktype = dest->ai_socktype;
-        hints.ai_protocol = dest->ai_protocol;
-        if (0 > (gerr = getaddrinfo(source,
-                                    options.source_port,
-                                    &hints,
-                                    &addrs))) {
+         * we know what we want. Every socket binds to the same source, so
+         * this is only looked up once. */
+        memset(&r, 0, sizeof(r));
+        r.name = source;
+        r.service = port;
+        r.hints.ai_flags = AI_ADDRCONFIG;
+        r.hints.ai_family = dest->ai_family;
+        r.hints.ai_socktype = dest->ai_socktype;
+        r.hints.ai_protocol = dest->ai_protocol;
+        if ((gerr = resolveSync(&r))) {
                 if (gerr == EAI_SYSTEM) {
                         fprintf(stderr, "%s: getaddrinfo(%s): %s\n",
-                                argv0, source, strerror(errno));
+                                argv0, source, strerror(r.syserr));
                 }
                 fprintf(stderr, "%s: getaddrinfo(addr=%s, port=%s): %s\n",
-                        argv0, source, options.source_port,
+                        argv0, source, port,
                         gai_strerror(gerr));
                 goto err;
         }
+        addrs = r.addrs;
 
  try_to_bind:
         /* try to bind to every one */
@@ -280,12 +318,12 @@ bindSocket(int fd, const struct addrinfo *dest)
         fprintf(stderr,
                 "%s: bind(addr=%s, port=%s) failed. "
                 "Using dynamic addr/port.\n",
-                argv0, source, options.source_port);
+                argv0, source, port);
  success:;
         /* manpage doesn't say what happens if addrs is null, so don't take
          * any chances */
-        if (addrs) {
-                freeaddrinfo(addrs);
+        if (ifaddrs) {
+                freeaddrinfo(ifaddrs);
         }
 }
 
@@ -300,62 +338,74 @@ sigint(int unused)
 }
 
 /**
- * Create socket and "connect" it to target
- * allocates and sets options.targetip
+ * callback function for SIGQUIT. Print interval stats, like ping does.
+ */
+static void
+sigquit(int unused)
+{
+	unused = unused; /* silence warning */
+	sigquitReceived = 1;
+}
+
+/**
+ * Start looking up t->name, for targetResolved() to pick up.
  *
- * return fd, or <0 (-errno) on error
+ * return 0 on success, or <0 (-errno) on error
  */
 static int
-setupSocket()
+resolveTarget(struct Target *t, struct Resolve *r)
 {
-	int fd = -1;
-	int err = 0;
-	struct addrinfo *addrs = 0;
-	struct addrinfo hints;
-
 	if (options.verbose > 2) {
-		fprintf(stderr, "%s: setupSocket(%s)\n",
-			argv0, options.target);
-	}
-	if (!(options.targetip = malloc(NI_MAXHOST))) {
-		err = errno;
-		fprintf(stderr, "%s: malloc(NI_MAXHOST): %s\n",
-			argv0, strerror(err));
-		goto errout;
+		fprintf(stderr, "%s: resolveTarget(%s)\n",
+			argv0, t->name);
 	}
 
-	/* resolve to sockaddr */
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_flags = AI_ADDRCONFIG;
-	hints.ai_family = options.af;
-	hints.ai_socktype = SOCK_DGRAM;
-	if (0 > (err = getaddrinfo(options.target,
-				   options.port,
-				   &hints,
-				   &addrs))) {
+	memset(r, 0, sizeof(*r));
+        r->name = t->name;
+        r->service = options.port;
+	r->hints.ai_flags = AI_ADDRCONFIG;
+	r->hints.ai_family = options.af;
+	r->hints.ai_socktype = SOCK_DGRAM;
+        r->data = t;
+        return resolveQueue(r);
+}
+
+/**
+ * Lookup of r->data (a target) is done. Set t->addr and t->ip, and
+ * t->resolved to 1 or -errno.
+ *
+ * return 0 on success, or <0 (-errno) on error
+ */
+static int
+targetResolved(const struct Resolve *r)
+{
+        struct Target *t = r->data;
+	int err = 0;
+
+	if (r->err) {
 		int gai_err;
-		gai_err = err;
+		gai_err = r->err;
 		if (gai_err == EAI_SYSTEM) {
-			err = errno;
+			err = r->syserr;
 		} else {
 			err = EINVAL;
 		}
 		if (gai_err == EAI_NONAME) {
 			fprintf(stderr, "%s: unknown host %s\n",
-				argv0, options.target);
+				argv0, t->name);
 			err = EINVAL;
 			goto errout;
 		}
                 fprintf(stderr, "%s: getaddrinfo(%s): %s\n",
-                        argv0, options.target, gai_strerror(gai_err));
+                        argv0, t->name, gai_strerror(gai_err));
 		goto errout;
 	}
 
-	/* get ip address string options.targetip */
-	if ((err = getnameinfo(addrs->ai_addr,
-			       addrs->ai_addrlen,
-			       options.targetip,
-			       NI_MAXHOST,
+	/* get ip address string t->ip */
+	if ((err = getnameinfo(r->addrs->ai_addr,
+			       r->addrs->ai_addrlen,
+			       t->ip,
+			       sizeof(t->ip),
 			       NULL, 0,
 			       NI_NUMERICHOST))) {
 		int gai_err;
@@ -372,8 +422,38 @@ setupSocket()
 	if (options.verbose > 1) {
 		fprintf(stderr, "%s: target=<%s> targetip=<%s>\n",
 			argv0,
-			options.target,
-			options.targetip);
+			t->name,
+			t->ip);
+	}
+        memcpy(&t->addr, r->addrs->ai_addr, r->addrs->ai_addrlen);
+        t->addrlen = r->addrs->ai_addrlen;
+        t->resolved = 1;
+        return 0;
+ errout:
+	if (err == 0) {
+		err = EINVAL;
+	}
+	if (err > 0) {
+		err = -err;
+	}
+        t->resolved = err;
+	return err;
+}
+/**
+ * Create socket of the right family for addrs, bound to source port
+ * port ("0" for any), and set socket options.
+ *
+ * return fd, or <0 (-errno) on error
+ */
+static int
+setupSocket(const struct addrinfo *addrs, const char *port)
+{
+	int fd = -1;
+	int err = 0;
+
+	if (options.verbose > 2) {
+		fprintf(stderr, "%s: setupSocket(%d)\n",
+			argv0, addrs->ai_family);
 	}
 
 	/* socket() */
@@ -387,12 +467,43 @@ setupSocket()
 			addrs->ai_socktype,
 			addrs->ai_protocol,
 			strerror(err));
-		goto errout;
+		return -err;
 	}
 
         errInspectionInit(fd, addrs);
 
-        bindSocket(fd, addrs);
+        bindSocket(fd, addrs, port);
+
+        if (options.kerneltime) {
+                int on = 1;
+#if defined(SO_TIMESTAMPNS)
+                if (setsockopt(fd,
+                               SOL_SOCKET,
+                               SO_TIMESTAMPNS,
+                               &on,
+                               sizeof(on))) {
+                        fprintf(stderr,
+                                "%s: setsockopt(%d, SOL_SOCKET, "
+                                "SO_TIMESTAMPNS, on): %s\n",
+                                argv0, fd, strerror(errno));
+                }
+#elif defined(SO_TIMESTAMP)
+                if (setsockopt(fd,
+                               SOL_SOCKET,
+                               SO_TIMESTAMP,
+                               &on,
+                               sizeof(on))) {
+                        fprintf(stderr,
+                                "%s: setsockopt(%d, SOL_SOCKET, "
+                                "SO_TIMESTAMP, on): %s\n",
+                                argv0, fd, strerror(errno));
+                }
+#else
+                fprintf(stderr,
+                        "%s: Kernel timestamps are not supported "
+                        "on your OS\n", argv0);
+#endif
+        }
 
 	if (addrs->ai_family == AF_INET) {
                 int on = 1;
@@ -509,53 +620,378 @@ setupSocket()
 #endif
 	}
 
-	/* connect() */
-	if (connect(fd,
-		    addrs->ai_addr,
-		    addrs->ai_addrlen)) {
-		err = errno;
-		fprintf(stderr, "%s: connect(%d, ...): %s\n",
-			argv0, fd, strerror(err));
-		goto errout;
-	}
-
-	freeaddrinfo(addrs);
 	return fd;
- errout:
-	if (addrs) {
-		freeaddrinfo(addrs);
-		addrs = 0;
-	}
-	if (options.targetip) {
-		free(options.targetip);
-		options.targetip = 0;
-	}
-	if (err == 0) {
-		err = -EINVAL;
-	}
-	if (fd >= 0) {
-		close(fd);
-		fd = -1;
-	}
-	if (err > 0) {
-		err = -err;
-	}
-	return err;
 }
 
 /**
+ * Hash function for target lookup by reply source address.
+ */
+static unsigned int
+sockaddrHash(const struct sockaddr *sa)
+{
+        const unsigned char *p;
+        size_t len;
+        size_t c;
+        unsigned int h = 2166136261U; /* FNV-1a */
+        uint16_t port;
+
+        switch (sa->sa_family) {
+        case AF_INET:
+                p = (const void*)&((const struct sockaddr_in*)sa)->sin_addr;
+                len = sizeof(struct in_addr);
+                port = ((const struct sockaddr_in*)sa)->sin_port;
+                break;
+        case AF_INET6:
+                p = (const void*)&((const struct sockaddr_in6*)sa)->sin6_addr;
+                len = sizeof(struct in6_addr);
+                port = ((const struct sockaddr_in6*)sa)->sin6_port;
+                break;
+        default:
+                return 0;
+        }
+        for (c = 0; c < len; c++) {
+                h = (h ^ p[c]) * 16777619U;
+        }
+        h = (h ^ (port & 0xff)) * 16777619U;
+        h = (h ^ (port >> 8)) * 16777619U;
+        return h;
+}
+
+/**
+ * return true if a and b are the same address and port
+ */
+static int
+sockaddrEqual(const struct sockaddr *a, const struct sockaddr *b)
+{
+        if (a->sa_family != b->sa_family) {
+                return 0;
+        }
+        switch (a->sa_family) {
+        case AF_INET: {
+                const struct sockaddr_in *a4 = (const void*)a;
+                const struct sockaddr_in *b4 = (const void*)b;
+                return a4->sin_port == b4->sin_port
+                        && !memcmp(&a4->sin_addr, &b4->sin_addr,
+                                   sizeof(a4->sin_addr));
+        }
+        case AF_INET6: {
+                const struct sockaddr_in6 *a6 = (const void*)a;
+                const struct sockaddr_in6 *b6 = (const void*)b;
+                return a6->sin6_port == b6->sin6_port
+                        && !memcmp(&a6->sin6_addr, &b6->sin6_addr,
+                                   sizeof(a6->sin6_addr));
+        }
+        }
+        return 0;
+}
+
+/**
+ * Find the target that a reply from sa belongs to.
  *
+ * return target, or NULL if not found
  */
-static size_t
-mkping_v1(int seq, void **packet)
+static struct Target*
+targetLookup(const struct sockaddr *sa)
+{
+        unsigned int pos;
+
+        for (pos = sockaddrHash(sa) & (targetHashSize - 1);
+             targetHash[pos];
+             pos = (pos + 1) & (targetHashSize - 1)) {
+                if (sockaddrEqual(sa,
+                                  (struct sockaddr*)&targetHash[pos]->addr)) {
+                        return targetHash[pos];
+                }
+        }
+        return NULL;
+}
+
+/**
+ * Allocate open-addressed hash table of targets, keyed on address, big
+ * enough for all targets.
+ *
+ * return 0 on success, <0 (-errno) on error
+ */
+static int
+targetHashAlloc()
+{
+        for (targetHashSize = 16;
+             targetHashSize < 2 * numTargets;
+             targetHashSize <<= 1);
+        if (!(targetHash = calloc(targetHashSize, sizeof(struct Target*)))) {
+                int err = errno;
+                fprintf(stderr, "%s: calloc(%u, ...): %s\n",
+                        argv0, targetHashSize, strerror(err));
+                return -err;
+        }
+        return 0;
+}
+
+/**
+ * Add t to the target hash table.
+ *
+ * return 0 on success, -EEXIST if another target has the same address
+ */
+static int
+targetHashAdd(struct Target *t)
+{
+        unsigned int pos;
+
+        if (targetLookup((struct sockaddr*)&t->addr)) {
+                fprintf(stderr,
+                        "%s: %s (%s) is a duplicate target, "
+                        "ignoring it\n",
+                        argv0, t->name, t->ip);
+                return -EEXIST;
+        }
+        for (pos = sockaddrHash((struct sockaddr*)&t->addr)
+                     & (targetHashSize - 1);
+             targetHash[pos];
+             pos = (pos + 1) & (targetHashSize - 1));
+        targetHash[pos] = t;
+        return 0;
+}
+
+/**
+ * Build hash table of targets. Targets resolving to an address already in
+ * the table are dropped.
+ *
+ * return 0 on success, <0 (-errno) on error
+ */
+static int
+targetHashInit()
+{
+        unsigned int c;
+        unsigned int n = 0;
+        int err;
+
+        if ((err = targetHashAlloc())) {
+                return err;
+        }
+        for (c = 0; c < numTargets; c++) {
+                if (n != c) {
+                        targets[n] = targets[c];
+                }
+                if (!targetHashAdd(&targets[n])) {
+                        n++;
+                }
+        }
+        numTargets = n;
+        return 0;
+}
+/**
+ * Number of in-flight records needed per target: enough to hold every
+ * ping sent during the wait time, unless set with -m.
+ */
+static unsigned int
+inflightSize()
+{
+        double want;
+        unsigned int size;
+
+        if (options.traceroute == TRACEROUTE_PARALLEL) {
+                /* all probes are in flight at once */
+                want = options.traceroutemaxttl * options.traceroutehops
+                        * options.traceflows;
+        } else if (options.inflight) {
+                want = options.inflight;
+        } else if (options.interval > 0) {
+                want = 2 * options.batch * options.wait / options.interval;
+        } else {
+                want = MAX_INFLIGHT;
+        }
+        for (size = MIN_INFLIGHT; size < want && size < MAX_INFLIGHT;
+             size <<= 1);
+        return size;
+}
+
+/**
+ * Start looking up all targets.
+ *
+ * return 0 on success, <0 (-errno) on error
+ */
+static int
+resolveTargetsStart()
+{
+        unsigned int c;
+        int err;
+
+        if ((err = resolveInit())) {
+                return err;
+        }
+        if (!(resolves = calloc(numTargets, sizeof(struct Resolve)))) {
+                err = errno;
+                fprintf(stderr, "%s: calloc(%u, ...): %s\n",
+                        argv0, numTargets, strerror(err));
+                return -err;
+        }
+        for (c = 0; c < numTargets; c++) {
+                if ((err = resolveTarget(&targets[c], &resolves[c]))) {
+                        return err;
+                }
+        }
+        return 0;
+}
+
+/**
+ * Resolve all targets and wait for them, dropping the ones that fail (in
+ * multi-target mode) and duplicates.
+ *
+ * return 0 on success, <0 (-errno) on error
+ */
+static int
+resolveTargets()
+{
+        struct Resolve *r;
+        unsigned int c;
+        unsigned int n = 0;
+        int err;
+
+        if ((err = resolveTargetsStart())) {
+                return err;
+        }
+        while ((r = resolveDone(1))) {
+                for (; r; r = r->next) {
+                        if ((err = targetResolved(r)) && !options.multi) {
+                                return err;
+                        }
+                }
+        }
+
+        for (c = 0; c < numTargets; c++) {
+                if (targets[c].resolved <= 0) {
+                        continue;
+                }
+                if (n != c) {
+                        targets[n] = targets[c];
+                }
+                n++;
+        }
+        numTargets = n;
+        if (!numTargets) {
+                fprintf(stderr, "%s: no usable targets\n", argv0);
+                return -EINVAL;
+        }
+
+        if (options.multi) {
+                return targetHashInit();
+        }
+        return 0;
+}
+
+/**
+ * Create socket for resolved target t, unless there already is one for
+ * its address family, and its in-flight ring.
+ *
+ * return 0 on success, <0 (-errno) on error
+ */
+static int
+openTarget(struct Target *t)
+{
+        unsigned int size = inflightSize();
+        struct addrinfo ai;
+        int *fdp;
+        int err;
+
+        memset(&ai, 0, sizeof(ai));
+        ai.ai_family = t->addr.ss_family;
+        ai.ai_socktype = SOCK_DGRAM;
+        ai.ai_protocol = IPPROTO_UDP;
+        ai.ai_addr = (struct sockaddr*)&t->addr;
+        ai.ai_addrlen = t->addrlen;
+
+        fdp = &sockets[ai.ai_family == AF_INET6];
+        if (0 > *fdp && 0 > (*fdp = setupSocket(&ai, options.source_port))) {
+                return *fdp;
+        }
+        t->fd = *fdp;
+
+        /* connect() */
+        if (!options.multi && connect(t->fd,
+                                      ai.ai_addr,
+                                      ai.ai_addrlen)) {
+                err = errno;
+                fprintf(stderr, "%s: connect(%d, ...): %s\n",
+                        argv0, t->fd, strerror(err));
+                return -err;
+        }
+
+        if (!(t->inflight = calloc(size, sizeof(struct InFlight)))) {
+                err = errno;
+                fprintf(stderr, "%s: calloc(%u, ...): %s\n",
+                        argv0, size, strerror(err));
+                return -err;
+        }
+        t->inflightSize = size;
+        return 0;
+}
+
+/**
+ * Create sockets for resolved targets, and their in-flight rings.
+ *
+ * return 0 on success, <0 (-errno) on error
+ */
+static int
+openSockets()
 {
-        struct GtpEchoV1 *gtp;
-        if (!(gtp = malloc(sizeof(struct GtpEchoV1)))) {
-                return -errno;
+        unsigned int c;
+        int err;
+
+        if (options.verbose > 1) {
+                fprintf(stderr, "%s: tracking %u pings in flight per "
+                        "target\n", argv0, inflightSize());
         }
 
-        *packet = gtp;
+        for (c = 0; c < numTargets; c++) {
+                if (targets[c].resolved > 0
+                    && (err = openTarget(&targets[c]))) {
+                        return err;
+                }
+        }
+
+        /* worker threads get their own table for their shard */
+        if (options.multi && !targetHash) {
+                return targetHashInit();
+        }
+        return 0;
+}
+
+/**
+ * Lookup of target r->data finished while pinging the others. Start
+ * pinging it too, unless it failed or is a duplicate.
+ *
+ * return 0 on success (even if the target is unusable), <0 (-errno) on
+ * error
+ */
+static int
+targetReady(const struct Resolve *r)
+{
+        struct Target *t = r->data;
+        int err;
+
+        if (targetResolved(r)) {
+                return 0;
+        }
+        if ((err = targetHashAdd(t))) {
+                t->resolved = err;
+                return 0;
+        }
+        if ((err = openTarget(t))) {
+                return err;
+        }
+        if (options.output == OUTPUT_TEXT) {
+                printf("GTPING %s (%s) packet version %d\n",
+                       t->name, t->ip, options.version);
+        }
+        return 0;
+}
 
+/**
+ * Build GTPv1 echo request template. Returns length.
+ */
+static size_t
+mkping_v1(struct GtpEchoV1 *gtp)
+{
         memset(gtp, 0, sizeof(struct GtpEchoV1));
         gtp->version = options.version;
         gtp->has_seq = 1;   /* turn on sequence numbers */
@@ -563,26 +999,20 @@ mkping_v1(int seq, void **packet)
         gtp->msg = GTPMSG_ECHO;
         gtp->len = htons(4);
         gtp->teid = htonl(options.teid);
-        gtp->seq = htons(seq);
+        gtp->seq = 0;
         gtp->npdu = 0x00;
         gtp->next = 0x00;
 
+        echoSeqOffset = offsetof(struct GtpEchoV1, seq);
         return sizeof(struct GtpEchoV1);
 }
 
 /**
- *
+ * Build GTPv2 echo request template. Returns length.
  */
 static size_t
-mkping_v2(int seq, void **packet)
+mkping_v2(struct GtpEchoV2 *gtp)
 {
-        struct GtpEchoV2 *gtp;
-        if (!(gtp = malloc(sizeof(struct GtpEchoV2)))) {
-                return -errno;
-        }
-
-        *packet = gtp;
-
         memset(gtp, 0, sizeof(struct GtpEchoV2));
         gtp->version = options.version;
         gtp->msg = GTPMSG_ECHO;
@@ -590,27 +1020,30 @@ mkping_v2(int seq, void **packet)
         if (options.has_teid) {
                 gtp->len = htons(4); /* FIXME; 6? */
                 gtp->u2.s.teid = htonl(options.teid);
-                gtp->u2.s.seq = htons(seq);
                 gtp->has_teid = 1;
+                echoSeqOffset = offsetof(struct GtpEchoV2, u2.s.seq);
                 return GTPECHOv2_LEN_WITHOUT_TEID + 4;
         } else {
                 gtp->len = 0; /* FIXME: 2? */
-                gtp->u2.seq = htons(seq);
+                echoSeqOffset = offsetof(struct GtpEchoV2, u2.seq);
                 return GTPECHOv2_LEN_WITHOUT_TEID;
         }
 }
 
 /**
- *
+ * Build the echo request template that all pings are copied from.
+ * Only the sequence number differs between pings.
  */
-static size_t
-mkping(int seq, void **packet)
+static void
+mkping()
 {
         switch (options.version) {
         case 1:
-                return mkping_v1(seq, packet);
+                echoLen = mkping_v1(&echoTemplate.v1);
+                return;
         case 2:
-                return mkping_v2(seq, packet);
+                echoLen = mkping_v2(&echoTemplate.v2);
+                return;
         }
         fprintf(stderr,
                 "%s: internal error, bad version %d\n",
@@ -619,50 +1052,244 @@ mkping(int seq, void **packet)
 }
 
 /**
- * return 0 on succes, <0 on fail (nothing sent), >0 on sent, but something
- * failed (do increment sent counter)
+ * Fill in ping packet with sequence number seq for t in caller-provided
+ * buffer, and record send time.
  */
-static int
-sendEcho(int fd, int seq)
+static void
+prepareEcho(struct Target *t, int seq, double now,
+            struct SendMsg *msg, union GtpEcho *packet)
 {
-	int err = 0;
-        void *packet = 0;
-        ssize_t packetlen;
-
-	if (options.verbose > 2) {
-		fprintf(stderr, "%s: sendEcho(%d, %d)\n", argv0, fd, seq);
-	}
-
-        if (0 > (packetlen = mkping(seq, &packet))) {
-                err = packetlen;
-                goto errout;
-        }
+        uint16_t nseq = htons(seq);
+        struct InFlight *fl;
 
 	if (options.verbose > 1) {
-		fprintf(stderr,	"%s: Sending GTP ping with seq=%d size %d\n",
-			argv0, curSeq, (int)packetlen);
+		fprintf(stderr,	"%s: Sending GTP ping to %s with seq=%d size %d\n",
+			argv0, t->ip, seq, (int)echoLen);
 	}
 
-        sendTimes[seq % TRACKPINGS_SIZE] = clock_get_dbl();
-        gotIt[seq % TRACKPINGS_SIZE] = 0;
+        *packet = echoTemplate;
+        memcpy((char*)packet + echoSeqOffset, &nseq, sizeof(nseq));
+
+        fl = &t->inflight[seq & (t->inflightSize - 1)];
+        fl->sendTime = now;
+        fl->sendHw = 0;
+        fl->seq = seq;
+        fl->replies = 0;
+
+        /* sendto() with no address is send() on connected socket */
+        msg->data = packet;
+        msg->len = echoLen;
+        msg->to = options.multi ? (struct sockaddr*)&t->addr : NULL;
+        msg->tolen = options.multi ? t->addrlen : 0;
+        msg->af = t->addr.ss_family;
+        msg->ttl = 0;
+}
 
-	if (packetlen != send(fd, packet, packetlen, 0)) {
-		err = errno;
-		if (err == ECONNREFUSED) {
-                        printf("Connection refused\n");
-                        connectionRefused++;
-                        goto errout;
-		}
-                fprintf(stderr, "%s: send(%d, ...): %s\n",
-                        argv0, fd, strerror(errno));
-                err = -err;
-                goto errout;
+/**
+ * Remember which ping the kernel will give the next TX timestamp ID
+ * on socket fd. IDs are counted per socket from 0, one per datagram sent.
+ */
+static void
+txIdRecord(int fd, const struct SendInfo *info, unsigned int n)
+{
+        unsigned int s = (fd == sockets[1]);
+        unsigned int c;
+
+        if (!options.kerneltime) {
+                return;
+        }
+        for (c = 0; c < n; c++) {
+                txIds[s][txIdNext[s]++ % TXID_RING_SIZE] = info[c];
+        }
+}
+
+/**
+ * Called from the error handler for an error caused by a packet sent to
+ * dst (NULL if not known). Charged to the target pinged at dst, which in
+ * multi-target mode has to be looked up since the socket is shared.
+ * refused is set for port unreachable.
+ */
+void
+targetError(const struct sockaddr *dst, int refused)
+{
+        struct Target *t;
+
+        if (!options.multi) {
+                t = targets;
+        } else if (!dst || !targetHash) {
+                return;
+        } else {
+                t = targetLookup(dst);
+        }
+        if (!t) {
+                return;
+        }
+        t->icmpErrors++;
+        if (refused) {
+                t->connectionRefused++;
+        }
+}
+
+/**
+ * Called from the error queue handler with the time the kernel (when,
+ * wall clock) or NIC (hw, NIC clock) sent the packet that got TX
+ * timestamp ID id on socket fd, 0 for the one not known. The kernel
+ * time replaces the userspace send time taken before send(). The NIC
+ * time is kept apart, for RTT only when the reply has one too.
+ */
+void
+txTimestamp(int fd, uint32_t id, double when, double hw)
+{
+        unsigned int s = (fd == sockets[1]);
+        const struct SendInfo *info;
+        struct InFlight *fl;
+        struct Target *t;
+
+        /* too old, slot has been reused */
+        if (txIdNext[s] - id > TXID_RING_SIZE) {
+                return;
+        }
+        info = &txIds[s][id % TXID_RING_SIZE];
+        if (!(t = info->t)) {
+                return;
+        }
+        fl = &t->inflight[info->seq & (t->inflightSize - 1)];
+        if (fl->seq != info->seq) {
+                return;
+        }
+        if (hw) {
+                fl->sendHw = hw;
+        }
+        if (!when) {
+                return;
+        }
+        when += clock_get_dbl() - clock_get_real_dbl();
+        if (options.verbose > 2) {
+                fprintf(stderr,
+                        "%s: TX timestamp for %s seq %u: %.2f us after send()\n",
+                        argv0, t->ip, info->seq,
+                        1000000 * (when - fl->sendTime));
+        }
+        fl->sendTime = when;
+}
+
+/**
+ * Hand n prepared pings to the kernel in as few syscalls as possible.
+ * info[n] is the target and seq of msgs[n].
+ */
+static void
+sendBatch(int fd, struct SendMsg *msgs, struct SendInfo *info, unsigned int n)
+{
+        unsigned int done = 0;
+        int ret;
+
+        while (done < n) {
+                uint64_t pt = PROF_START();
+                ret = doSendBatch(fd, msgs + done, n - done);
+                PROF_END(PROF_SEND, pt, ret > 0 ? ret : 0);
+                if (0 < ret) {
+                        txIdRecord(fd, info + done, ret);
+                        done += ret;
+                        continue;
+                }
+                /* msgs[done] failed. Report and go on with the rest */
+                if (errno == ECONNREFUSED) {
+                        if (options.output != OUTPUT_TEXT) {
+                                outputError(NULL, -1, -1, -1,
+                                            "Connection refused");
+                        } else {
+                                printf("Connection refused\n");
+                        }
+                        /* unconnected socket: the error is from any
+                         * earlier packet, not necessarily to this target */
+                        if (!options.multi) {
+                                info[done].t->connectionRefused++;
+                        }
+                } else {
+                        fprintf(stderr, "%s: send(%d, ...): %s\n",
+                                argv0, fd, strerror(errno));
+                }
+                done++;
+        }
+}
+
+/**
+ * Send one ping with TTL ttl (0 = socket default).
+ *
+ * return 0 on succes, <0 on fail (nothing sent), >0 on sent, but something
+ * failed (do increment sent counter)
+ */
+static int
+sendEcho(struct Target *t, int seq, int ttl)
+{
+        struct SendMsg msg;
+        struct SendInfo info;
+        union GtpEcho packet;
+
+	if (options.verbose > 2) {
+		fprintf(stderr, "%s: sendEcho(%s, %d)\n", argv0, t->ip, seq);
 	}
- errout:
-        free(packet);
+
+        prepareEcho(t, seq, clock_get_dbl(), &msg, &packet);
+        msg.ttl = ttl;
+        info.t = t;
+        info.seq = seq;
+        sendBatch(t->fd, &msg, &info, 1);
 	return 0;
 }
 
+/**
+ * Send options.batch pings to every target that has not yet reached
+ * its count. Pings are sent in batches per socket.
+ *
+ * return number of pings sent
+ */
+static unsigned int
+sendRound()
+{
+        static THREAD_LOCAL struct SendMsg msgs[2][MAX_SENDBATCH];
+        static THREAD_LOCAL struct SendInfo info[2][MAX_SENDBATCH];
+        static THREAD_LOCAL union GtpEcho packets[2][MAX_SENDBATCH];
+        unsigned int n[2] = { 0, 0 };
+        unsigned int sent = 0;
+        unsigned int c, b, s;
+        double now = clock_get_dbl();
+
+	if (options.verbose > 2) {
+		fprintf(stderr, "%s: sendRound()\n", argv0);
+	}
+
+        for (c = 0; c < numTargets; c++) {
+                struct Target *t = &targets[c];
+                if (t->resolved <= 0) {
+                        continue;
+                }
+                s = (t->fd == sockets[1]);
+                for (b = 0; b < options.batch; b++) {
+                        if (t->count && t->curSeq == t->count) {
+                                break;
+                        }
+                        prepareEcho(t, t->curSeq, now,
+                                    &msgs[s][n[s]], &packets[s][n[s]]);
+                        info[s][n[s]].t = t;
+                        info[s][n[s]++].seq = t->curSeq++;
+                        t->sent++;
+                        t->win.sent++;
+                        sent++;
+                        if (n[s] == MAX_SENDBATCH) {
+                                sendBatch(t->fd, msgs[s], info[s], n[s]);
+                                n[s] = 0;
+                        }
+                }
+        }
+        for (s = 0; s < 2; s++) {
+                if (n[s]) {
+                        sendBatch(sockets[s], msgs[s], info[s], n[s]);
+                }
+        }
+        return sent;
+}
+
 /**
  * For a given tos number, find the tos name.
  * Output is written to buffer of length buflen (incl null terminator).
@@ -712,6 +1339,17 @@ tos2String(int tos, char *buf, size_t buflen)
         return buf;
 }
 
+/**
+ * Malformed packets are only complained about per packet when pinging, or
+ * with -v. A responder is open to anyone and just counts them, or every
+ * bad packet sent to it would become a line on stderr.
+ */
+static int
+parseComplain(void)
+{
+        return !options.responder || options.verbose;
+}
+
 /**
  *
  */
@@ -724,8 +1362,11 @@ parseReply_v1(const void *packet, size_t packetlen)
         /* check packet size */
 
         if (packetlen < sizeof(struct GtpEchoV1)) {
-                fprintf(stderr, "%s: Short GTPv1 packet received: %d < 12\n",
-                        argv0, (int)packetlen);
+                if (parseComplain()) {
+                        fprintf(stderr,
+                                "%s: Short GTPv1 packet received: %d < 12\n",
+                                argv0, (int)packetlen);
+                }
                 return ret;
         }
 
@@ -770,9 +1411,11 @@ parseReply_v2(const void *packet, size_t packetlen)
 
         /* shortest possible GTPv2 packet is 8 bytes */
         if (packetlen < GTPECHOv2_LEN_WITHOUT_TEID) {
-                fprintf(stderr,
-                        "%s: Short GTPv2 packet received: %d < 8\n",
-                        argv0, (int)packetlen);
+                if (parseComplain()) {
+                        fprintf(stderr,
+                                "%s: Short GTPv2 packet received: %d < 8\n",
+                                argv0, (int)packetlen);
+                }
                 return ret;
         }
 
@@ -783,20 +1426,25 @@ parseReply_v2(const void *packet, size_t packetlen)
         }
 
         if (gtp->piggyback) {
-                fprintf(stderr,
-                        "%s: Get GTP packet with piggyback flag "
-                        "unexpectedly set. "
-                        "Not parsing piggybacked data.",
-                        argv0);
+                if (parseComplain()) {
+                        fprintf(stderr,
+                                "%s: Get GTP packet with piggyback flag "
+                                "unexpectedly set. "
+                                "Not parsing piggybacked data.",
+                                argv0);
+                }
                 if (packetlen > right_len) {
                         packetlen = right_len;
                 }
         }
 
         if (packetlen != right_len) {
-                fprintf(stderr,
-                        "%s: GTPv2 packet length error: %d should be %d\n",
-                        argv0, (int)packetlen, (int)right_len);
+                if (parseComplain()) {
+                        fprintf(stderr,
+                                "%s: GTPv2 packet length error: "
+                                "%d should be %d\n",
+                                argv0, (int)packetlen, (int)right_len);
+                }
                 if (packetlen < right_len) {
                         return ret;
                 }
@@ -843,141 +1491,194 @@ parseReply(const void *packet, size_t packetlen)
                 return parseReply_v2(packet, packetlen);
         }
 
-        fprintf(stderr,
-                "%s: Bad packet with version %d received\n",
-                argv0, gtp->version);
+        if (parseComplain()) {
+                fprintf(stderr,
+                        "%s: Bad packet with version %d received\n",
+                        argv0, gtp->version);
+        }
         return err;
 }
 
 
 
 /**
- * return 0 on success/got reply,
- *        <0 on fail. Errno returned.
- *        >0 on success, but no packet (EINTR or dup packet)
+ * Turn a 16bit sequence number from the wire into the full sequence
+ * number of the latest ping sent to t that it could be a reply to.
  */
-static int
-recvEchoReply(int fd)
+static uint32_t
+fullSeq(const struct Target *t, uint16_t seq)
 {
-	int err;
-        char packet[1024];
-        ssize_t packetlen;
-	double now;
-	char lag[128];
-        int isDup = 0;
-        int isReorder = 0;
-        int ttl;
-        int tos;
-        char tosString[128] = {0};
-        char ttlString[128] = {0};
-        struct GtpReply gtp;
-
-	if (options.verbose > 2) {
-		fprintf(stderr, "%s: recvEchoReply()\n", argv0);
-	}
-
-	now = clock_get_dbl();
-
-	memset(packet, 0, sizeof(packet));
-        if (0 > (packetlen = doRecv(fd,
-                                    (void*)packet,
-                                    sizeof(packet),
-                                    &ttl,
-                                    &tos))) {
-		switch(errno) {
-                case ECONNREFUSED:
-                        connectionRefused++;
-			handleRecvErr(fd, "Port closed", 0);
-                        return 1;
-		case EINTR:
-                        return 1;
-                case EHOSTUNREACH:
-			handleRecvErr(fd, "Host unreachable or TTL exceeded",
-                                      0);
-                        return 1;
-		default:
-			err = errno;
-			fprintf(stderr, "%s: recv(%d, ...): %s\n",
-				argv0, fd, strerror(errno));
-                        return err;
-		}
-	}
+        uint32_t last = t->curSeq - 1;
+        return last - (uint16_t)(last - seq);
+}
 
-        /* create ttl string */
-        if (0 <= ttl) {
-                snprintf(ttlString, sizeof(ttlString), "ttl=%d ", ttl);
-        }
+/**
+ * Find in-flight record of ping with full sequence number seq.
+ *
+ * return record, or NULL if it was never sent or has dropped off the ring.
+ */
+static struct InFlight*
+inflightFind(struct Target *t, uint32_t seq)
+{
+        struct InFlight *fl;
 
-        /* create tos string */
-        if (0 <= tos) {
-                char scratch[128];
-                snprintf(tosString, sizeof(tosString),
-                         "%s ", tos2String(tos,
-                                           scratch,
-                                           sizeof(scratch)));
+        if (!t->curSeq || t->curSeq - seq > t->inflightSize) {
+                return NULL;
         }
-
-        gtp = parseReply(packet, packetlen);
-        if (!gtp.ok) {
-                return 1;
+        fl = &t->inflight[seq & (t->inflightSize - 1)];
+        if (fl->seq != seq) {
+                return NULL;
         }
+        return fl;
+}
 
-	if (gtp.msg != GTPMSG_ECHOREPLY) {
-		fprintf(stderr,
-			"%s: Got non-EchoReply type of msg (type: %d)\n",
-			argv0, gtp.msg);
-                return 1;
-	}
-
-        if (curSeq - gtp.seq >= TRACKPINGS_SIZE) {
-		strcpy(lag, "Inf");
-	} else {
-                int pos = gtp.seq % TRACKPINGS_SIZE;
-                double lagf = now - sendTimes[pos];
-                if (gotIt[pos]) {
-                        isDup = 1;
+/**
+ * Update statistics of t with a reply to ping seq (full sequence number)
+ * received at now, and at hw by the NIC clock if known (else 0). *lagf is
+ * set to the RTT, or -1 if the ping is unknown. The RTT is by the NIC
+ * clock only if both request and reply were stamped by it.
+ */
+static void
+accountReply(struct Target *t, uint32_t seq, double now, double hw,
+             double *lagf, int *isDup, int *isReorder)
+{
+        struct InFlight *fl;
+
+        *lagf = -1;
+        *isDup = 0;
+        *isReorder = 0;
+        if ((fl = inflightFind(t, seq))) {
+                if (hw && fl->sendHw) {
+                        *lagf = hw - fl->sendHw;
+                } else {
+                        *lagf = now - fl->sendTime;
                 }
-                gotIt[pos]++;
-		snprintf(lag, sizeof(lag), "%.2f ms", 1000 * lagf);
-                if (!isDup) {
-                        totalTime += lagf;
-                        totalTimeSquared += lagf * lagf;
-                        totalTimeCount++;
-                        if ((0 > totalMin) || (lagf < totalMin)) {
-                                totalMin = lagf;
+                if (fl->replies) {
+                        *isDup = 1;
+                }
+                fl->replies++;
+                if (!*isDup) {
+                        t->totalTime += *lagf;
+                        t->totalTimeSquared += *lagf * *lagf;
+                        t->totalTimeCount++;
+                        if ((0 > t->totalMin) || (*lagf < t->totalMin)) {
+                                t->totalMin = *lagf;
                         }
-                        if ((0 > totalMax) || (lagf > totalMax)) {
-                                totalMax = lagf;
+                        if ((0 > t->totalMax) || (*lagf > t->totalMax)) {
+                                t->totalMax = *lagf;
                         }
+                        histAdd(&t->hist, *lagf);
+                        histAdd(&t->win.hist, *lagf);
                 }
                 if (options.autowait) {
-                        options.wait = 2 * (totalTime / totalTimeCount);
+                        waitTime = 2 * (t->totalTime / t->totalTimeCount);
                         if (options.verbose > 1) {
                                 fprintf(stderr,
                                         "%s: Adjusting waittime to %.6f\n",
-                                        argv0, options.wait);
+                                        argv0, waitTime);
                         }
                 }
 	}
 
         /* detect packet reordering */
-        if (!isDup) {
-                if (highestSeq > gtp.seq) {
-                        reorder++;
-                        isReorder = 1;
+        if (!*isDup) {
+                if (t->recvd && (int32_t)(t->highestSeq - seq) > 0) {
+                        t->reorder++;
+                        t->win.reorder++;
+                        *isReorder = 1;
                 } else {
-                        highestSeq = gtp.seq;
+                        t->highestSeq = seq;
+                }
+        }
+
+        if (*isDup) {
+                t->dups++;
+                t->win.dups++;
+        } else {
+                t->recvd++;
+                t->win.recvd++;
+                t->lastRecvTime = now;
+        }
+}
+
+/**
+ * Parse, account and print one received reply.
+ *
+ * return 0 on success/got reply,
+ *        >0 on success, but no packet (dup or bad packet)
+ */
+static int
+handleReply(struct RecvMsg *m, double now)
+{
+        struct Target *t = options.multi ? NULL : targets;
+        const char *packet = m->data;
+        ssize_t packetlen = m->len;
+        double lagf;
+        int isDup;
+        int isReorder;
+        struct GtpReply gtp;
+        uint32_t seq;
+        uint64_t pt;
+
+        if (!t && !(t = targetLookup((struct sockaddr*)&m->from))) {
+                if (options.verbose) {
+                        fprintf(stderr,
+                                "%s: Got packet from unknown source\n",
+                                argv0);
                 }
+                return 1;
+        }
+
+        pt = PROF_START();
+        gtp = parseReply(packet, packetlen);
+        PROF_END(PROF_PARSE, pt, 1);
+        if (!gtp.ok) {
+                return 1;
         }
 
-        if (options.flood) {
+	if (gtp.msg != GTPMSG_ECHOREPLY) {
+		fprintf(stderr,
+			"%s: Got non-EchoReply type of msg (type: %d)\n",
+			argv0, gtp.msg);
+                return 1;
+	}
+
+        pt = PROF_START();
+        seq = fullSeq(t, gtp.seq);
+        accountReply(t, seq, now, m->rxhw, &lagf, &isDup, &isReorder);
+        PROF_END(PROF_STATS, pt, 1);
+
+        pt = PROF_START();
+        if (options.output != OUTPUT_TEXT) {
+                outputReply(t, seq, lagf, m->ttl, m->tos, isDup, isReorder);
+        } else if (options.flood) {
                 if (!isDup) {
                         printf("\b \b");
                 }
         } else {
+                char lag[128];
+                char tosString[128] = {0};
+                char ttlString[128] = {0};
+
+                if (0 <= m->ttl) {
+                        snprintf(ttlString, sizeof(ttlString),
+                                 "ttl=%d ", m->ttl);
+                }
+                if (0 <= m->tos) {
+                        char scratch[128];
+                        snprintf(tosString, sizeof(tosString),
+                                 "%s ", tos2String(m->tos,
+                                                   scratch,
+                                                   sizeof(scratch)));
+                }
+                if (lagf < 0) {
+                        strcpy(lag, "Inf");
+                } else {
+                        snprintf(lag, sizeof(lag), "%.2f ms", 1000 * lagf);
+                }
                 printf("%u bytes from %s: ver=%d seq=%u %s%stime=%s%s%s\n",
                        (int)packetlen,
-                       options.targetip,
+                       t->ip,
                        gtp.version,
                        gtp.seq,
                        tosString[0] ? tosString : "",
@@ -986,12 +1687,92 @@ recvEchoReply(int fd)
                        isDup ? " (DUP)" : "",
                        isReorder ? " (out of order)" : "");
         }
-        if (isDup) {
-                dups++;
-        }
+        PROF_END(PROF_OUTPUT, pt, 1);
 	return isDup;
 }
 
+/**
+ * Drain up to max replies from fd, MAX_RECVBATCH per syscall.
+ *
+ * return number of replies received (excluding dups and errors)
+ */
+static int
+recvEchoReplies(int fd, unsigned int max, int *more)
+{
+        static THREAD_LOCAL struct RecvMsg msgs[MAX_RECVBATCH];
+        unsigned int done = 0;
+        int got = 0;
+        int n;
+        int c;
+
+	if (options.verbose > 2) {
+		fprintf(stderr, "%s: recvEchoReplies(%d, %u)\n",
+                        argv0, fd, max);
+	}
+
+        /* until we see the socket drained */
+        *more = 1;
+
+        while (done < max) {
+                double now = clock_get_dbl();
+                unsigned int want = max - done;
+                uint64_t pt;
+
+                if (want > MAX_RECVBATCH) {
+                        want = MAX_RECVBATCH;
+                }
+                pt = PROF_START();
+                n = doRecvBatch(fd, msgs, want);
+                PROF_END(PROF_RECV, pt, n > 0 ? n : 0);
+                if (0 > n) {
+                        *more = 0;
+                        switch(errno) {
+                        case ECONNREFUSED:
+                                handleRecvErr(fd, "Port closed", 0);
+                                break;
+                        case EAGAIN:
+                        case EINTR:
+                                break;
+                        case EHOSTUNREACH:
+                                handleRecvErr(fd,
+                                              "Host unreachable or "
+                                              "TTL exceeded",
+                                              0);
+                                break;
+                        default:
+                                fprintf(stderr, "%s: recv(%d, ...): %s\n",
+                                        argv0, fd, strerror(errno));
+                        }
+                        break;
+                }
+                if (options.kerneltime) {
+                        /* move kernel timestamps from wall clock to
+                         * the monotonic clock that send times use */
+                        double mono = clock_get_dbl();
+                        double real = clock_get_real_dbl();
+                        for (c = 0; c < n; c++) {
+                                if (msgs[c].rxtime) {
+                                        msgs[c].rxtime += mono - real;
+                                }
+                        }
+                }
+                for (c = 0; c < n; c++) {
+                        if (!handleReply(&msgs[c],
+                                         msgs[c].rxtime
+                                         ? msgs[c].rxtime : now)) {
+                                got++;
+                        }
+                }
+                done += n;
+                if ((unsigned int)n < want) {
+                        /* socket drained */
+                        *more = 0;
+                        break;
+                }
+        }
+        return got;
+}
+
 /**
  * FIXME: this function needs a cleanup, and probably some merging
  * with pingMainloop()
@@ -1008,19 +1789,19 @@ tracerouteMainloop(int fd)
         int endOfTraceroute = 0;
         int printStar = 0;
         double timewait;
+        struct Event ev;
 
 	printf("GTPING traceroute to %s (%s) packet version %d.\n",
-	       options.target,
-	       options.targetip,
+	       targets->name,
+	       targets->ip,
 	       (int)options.version);
 
+        if (evAdd(fd)) {
+                return 2;
+        }
 
 	while (!sigintReceived) {
-		struct pollfd fds;
-
-		fds.fd = fd;
-		fds.events = POLLIN;
-		fds.revents = 0;
+                int more = 0;
 
                 /* time to send yet? */
 		curPingTime = clock_get_dbl();
@@ -1041,235 +1822,2096 @@ tracerouteMainloop(int fd)
                                 printf("%4d ", ttl);
                                 fflush(stdout);
                         }
-                        if (setsockopt(fd,
-                                       SOL_IP,
-                                       IP_TTL,
-                                       &ttl,
-                                       sizeof(ttl))) {
-                                fprintf(stderr,
-                                        "%s: setsockopt(%d, SOL_IP, IP_TTL, "
-                                        "%d): %s\n", argv0, fd, ttl,
-                                        strerror(errno));
+                        if (0 <= sendEcho(targets, targets->curSeq++, ttl)) {
+                                lastPingTime = curPingTime;
+                                printStar = 1;
+                        }
+                }
+
+                /* max waittime: until it's time to send the next one */
+		timewait = lastPingTime+options.interval - clock_get_dbl();
+		if (timewait < 0) {
+			timewait = 0;
+		}
+
+                if (!evWait(&ev, 1, timewait)) {
+                        continue;
+                }
+                printStar = 0;
+                if (ev.events & EV_ERR) {
+                        int e;
+                        e = handleRecvErr(fd, NULL, lastPingTime);
+                        if (e) {
+                                lastRecvTime = clock_get_dbl();
+                        }
+                        if (e > 1) {
+                                endOfTraceroute = 1;
+                        }
+                        more = 1;
+                }
+                if (ev.events & EV_IN) {
+                        n = recvEchoReplies(fd, 1, &more);
+                        endOfTraceroute = 1;
+                        if (n) {
+                                lastRecvTime = clock_get_dbl();
+                        } else {
+                                /* still ok, but no reply */
+                                printStar = 1;
+                        }
+                }
+                if (more) {
+                        evRearm(fd);
+                }
+        }
+        return 0;
+}
+
+/**
+ * One probe of the parallel traceroute (-R).
+ */
+struct TraceProbe {
+        int done;            /* answered */
+        int final;           /* by the target, or an error other than
+                              * TTL exceeded */
+        double rtt;
+        char from[64];       /* who answered */
+        char what[64];       /* error, or "Echo reply" */
+        char line[256];      /* the answer, as printed with one flow */
+};
+
+/**
+ * State of the parallel traceroute (-R). Probe n has TTL n % maxttl + 1
+ * and is sent by flow n / maxttl % flows. All first tries of all flows
+ * go out before any second try, so ICMP rate limiting hits the extra
+ * tries.
+ */
+struct Trace {
+        struct TraceProbe *probes;
+        unsigned int numProbes;
+        unsigned int flows;
+        int fds[MAX_TRACEFLOWS];             /* one socket per flow */
+        unsigned int ports[MAX_TRACEFLOWS];  /* their source ports */
+        int flowEnd[MAX_TRACEFLOWS];         /* last hop of each flow */
+};
+
+/**
+ * Answers at one hop of a multipath traceroute, grouped by who answered
+ * and what they said.
+ */
+struct TraceGroup {
+        const struct TraceProbe *p;  /* first one */
+        uint64_t flows;              /* bit per flow that got it */
+        unsigned int count;
+        double min;
+        double max;
+        double sum;
+};
+
+/**
+ *
+ */
+static int
+traceProbeTTL(unsigned int n)
+{
+        return n % options.traceroutemaxttl + 1;
+}
+
+/**
+ *
+ */
+static unsigned int
+traceProbeFlow(const struct Trace *tr, unsigned int n)
+{
+        return n / options.traceroutemaxttl % tr->flows;
+}
+
+/**
+ * Probe number of try number try by flow flow to hop hop.
+ */
+static unsigned int
+traceProbe(const struct Trace *tr, unsigned int flow, int hop, int try)
+{
+        return (try * tr->flows + flow) * options.traceroutemaxttl + hop - 1;
+}
+
+/**
+ * Find which probe a packet with 16bit sequence number wireSeq was, and
+ * how long ago it was sent.
+ *
+ * return probe number, or -1 if it's not one of ours or already answered
+ */
+static int
+traceProbeFind(const struct Trace *tr, uint16_t wireSeq, double now,
+               double *rtt)
+{
+        uint32_t seq = fullSeq(targets, wireSeq);
+        struct InFlight *fl;
+
+        if (seq >= tr->numProbes
+            || tr->probes[seq].done
+            || !(fl = inflightFind(targets, seq))) {
+                return -1;
+        }
+        *rtt = now - fl->sendTime;
+        return seq;
+}
+
+/**
+ * Record answer to probe n.
+ */
+static void
+traceAnswer(struct Trace *tr, unsigned int n, const char *from,
+            const char *what, double rtt, int final)
+{
+        struct TraceProbe *p = &tr->probes[n];
+        unsigned int flow = traceProbeFlow(tr, n);
+
+        p->done = 1;
+        p->final = final;
+        p->rtt = rtt;
+        snprintf(p->from, sizeof(p->from), "%s", from);
+        snprintf(p->what, sizeof(p->what), "%s", what);
+        if (final && traceProbeTTL(n) < tr->flowEnd[flow]) {
+                tr->flowEnd[flow] = traceProbeTTL(n);
+        }
+}
+
+/**
+ * Match errors from the error queue to probes.
+ */
+static void
+traceErrors(struct Trace *tr, int fd, int *more)
+{
+        unsigned int c;
+
+        *more = 1;
+        for (c = 0; c < RECV_DRAINMAX; c++) {
+                struct RecvErr re;
+                char ttlString[16];
+                uint16_t wireSeq;
+                double rtt;
+                int empty;
+                int e;
+                int n;
+
+                e = recvErrDetail(fd, &re, &empty);
+                if (empty) {
+                        *more = 0;
+                        break;
+                }
+                /* routers that only quote 8 bytes of payload cut off
+                 * the GTPv1 sequence number */
+                if (!e || re.len < echoSeqOffset + sizeof(wireSeq)) {
+                        continue;
+                }
+                memcpy(&wireSeq, re.data + echoSeqOffset, sizeof(wireSeq));
+                n = traceProbeFind(tr, ntohs(wireSeq), clock_get_dbl(),
+                                   &rtt);
+                if (n < 0) {
+                        continue;
+                }
+                traceAnswer(tr, n, re.from[0] ? re.from : "<unknown>",
+                            re.error, rtt, e > 1);
+                ttlString[0] = 0;
+                if (re.ttl > 0) {
+                        snprintf(ttlString, sizeof(ttlString),
+                                 " ttl=%d", re.ttl);
+                }
+                snprintf(tr->probes[n].line, sizeof(tr->probes[n].line),
+                         "%s%s%s%s time=%.2f ms: %s",
+                         tr->probes[n].from,
+                         re.tos[0] ? " " : "", re.tos,
+                         ttlString, 1000 * rtt, re.error);
+        }
+}
+
+/**
+ * Match echo replies to probes.
+ */
+static void
+traceReplies(struct Trace *tr, int fd, int *more)
+{
+        static struct RecvMsg msgs[MAX_RECVBATCH];
+        int got;
+        int c;
+
+        *more = 0;
+        if (0 > (got = doRecvBatch(fd, msgs, MAX_RECVBATCH))) {
+                if (errno != EAGAIN && errno != EINTR
+                    && errno != ECONNREFUSED && errno != EHOSTUNREACH) {
+                        fprintf(stderr, "%s: recv(%d, ...): %s\n",
+                                argv0, fd, strerror(errno));
+                }
+                return;
+        }
+        *more = (got == MAX_RECVBATCH);
+        for (c = 0; c < got; c++) {
+                struct RecvMsg *m = &msgs[c];
+                struct GtpReply gtp;
+                char tosString[128];
+                char ttlString[16];
+                double rtt;
+                int n;
+
+                gtp = parseReply(m->data, m->len);
+                if (!gtp.ok || gtp.msg != GTPMSG_ECHOREPLY) {
+                        continue;
+                }
+                n = traceProbeFind(tr, gtp.seq, clock_get_dbl(), &rtt);
+                if (n < 0) {
+                        continue;
+                }
+                traceAnswer(tr, n, targets->ip, "Echo reply", rtt, 1);
+                ttlString[0] = 0;
+                tosString[0] = 0;
+                if (m->ttl >= 0) {
+                        snprintf(ttlString, sizeof(ttlString),
+                                 "ttl=%d ", m->ttl);
+                }
+                if (m->tos >= 0) {
+                        char scratch[128];
+                        snprintf(tosString, sizeof(tosString), "%s ",
+                                 tos2String(m->tos, scratch,
+                                            sizeof(scratch)));
+                }
+                snprintf(tr->probes[n].line, sizeof(tr->probes[n].line),
+                         "%u bytes from %s: ver=%d seq=%u %s%stime=%.2f ms",
+                         (unsigned int)m->len, tr->probes[n].from,
+                         gtp.version, gtp.seq, tosString, ttlString,
+                         1000 * rtt);
+        }
+}
+
+/**
+ * Send the next n probes, each with its own TTL, in as few syscalls as
+ * possible. An ICMP error for an earlier probe is pending on the
+ * connected socket and fails a send without sending anything, so a
+ * failed probe is tried again once.
+ */
+static void
+traceSend(int fd, unsigned int n)
+{
+        static struct SendMsg msgs[MAX_SENDBATCH];
+        static struct SendInfo info[MAX_SENDBATCH];
+        static union GtpEcho packets[MAX_SENDBATCH];
+
+        while (n) {
+                unsigned int batch = n < MAX_SENDBATCH ? n : MAX_SENDBATCH;
+                unsigned int done = 0;
+                unsigned int c;
+                int retried = 0;
+                int ret;
+
+                for (c = 0; c < batch; c++) {
+                        info[c].t = targets;
+                        info[c].seq = targets->curSeq++;
+                        prepareEcho(targets, info[c].seq, clock_get_dbl(),
+                                    &msgs[c], &packets[c]);
+                        msgs[c].ttl = traceProbeTTL(info[c].seq);
+                }
+                while (done < batch) {
+                        if (0 < (ret = doSendBatch(fd, msgs + done,
+                                                   batch - done))) {
+                                txIdRecord(fd, info + done, ret);
+                                done += ret;
+                                retried = 0;
+                                continue;
+                        }
+                        if (!retried) {
+                                retried = 1;
+                                continue;
+                        }
+                        fprintf(stderr, "%s: send(%d, ...): %s\n",
+                                argv0, fd, strerror(errno));
+                        done++;
+                        retried = 0;
+                }
+                n -= batch;
+        }
+}
+
+/**
+ * Open one socket per flow (-M), each with its own source port. Flow 0
+ * uses the target's socket. With -P, flow n uses port -P + n.
+ *
+ * return 0 on success, <0 (-errno) on error
+ */
+static int
+traceFlowsOpen(struct Trace *tr)
+{
+        unsigned long basePort;
+        struct addrinfo ai;
+        unsigned int f;
+        int err;
+
+        /* checked to be numeric in main() */
+        basePort = strtoul(options.source_port, NULL, 10);
+
+        memset(&ai, 0, sizeof(ai));
+        ai.ai_family = targets->addr.ss_family;
+        ai.ai_socktype = SOCK_DGRAM;
+        ai.ai_protocol = IPPROTO_UDP;
+        ai.ai_addr = (struct sockaddr*)&targets->addr;
+        ai.ai_addrlen = targets->addrlen;
+
+        tr->fds[0] = targets->fd;
+        for (f = 0; f < tr->flows; f++) {
+                struct sockaddr_storage sa;
+                socklen_t salen = sizeof(sa);
+
+                if (f) {
+                        char port[16];
+                        snprintf(port, sizeof(port), "%lu",
+                                 basePort ? basePort + f : 0);
+                        if (0 > (tr->fds[f] = setupSocket(&ai, port))) {
+                                return tr->fds[f];
+                        }
+                        if (connect(tr->fds[f], ai.ai_addr, ai.ai_addrlen)) {
+                                err = errno;
+                                fprintf(stderr, "%s: connect(%d, ...): %s\n",
+                                        argv0, tr->fds[f], strerror(err));
+                                return -err;
+                        }
+                }
+                if (getsockname(tr->fds[f], (struct sockaddr*)&sa, &salen)) {
+                        err = errno;
+                        fprintf(stderr, "%s: getsockname(%d): %s\n",
+                                argv0, tr->fds[f], strerror(err));
+                        return -err;
+                }
+                if (sa.ss_family == AF_INET6) {
+                        tr->ports[f] = ntohs(((struct sockaddr_in6*)&sa)
+                                             ->sin6_port);
+                } else {
+                        tr->ports[f] = ntohs(((struct sockaddr_in*)&sa)
+                                             ->sin_port);
+                }
+                tr->flowEnd[f] = options.traceroutemaxttl;
+                if (evAdd(tr->fds[f])) {
+                        return -EINVAL;
+                }
+        }
+        return 0;
+}
+
+/**
+ * Print set of flows as e.g. "0-3,5".
+ */
+static void
+printFlowSet(uint64_t flows)
+{
+        const char *sep = "";
+        int f;
+
+        for (f = 0; f < 64; f++) {
+                int last = f;
+                if (!(flows & ((uint64_t)1 << f))) {
+                        continue;
+                }
+                while (last < 63 && (flows & ((uint64_t)1 << (last + 1)))) {
+                        last++;
+                }
+                if (last > f) {
+                        printf("%s%d-%d", sep, f, last);
+                } else {
+                        printf("%s%d", sep, f);
+                }
+                sep = ",";
+                f = last;
+        }
+}
+
+/**
+ * Print hop of a multipath traceroute (-M): one line per distinct
+ * answer, with the flows that got it and their RTTs.
+ */
+static void
+traceHopPrint(const struct Trace *tr, int hop, struct TraceGroup *groups)
+{
+        unsigned int numGroups = 0;
+        uint64_t silent = 0;
+        unsigned int f, g;
+        int try;
+
+        for (f = 0; f < tr->flows; f++) {
+                int answered = 0;
+                if (tr->flowEnd[f] < hop) {
+                        continue;
+                }
+                for (try = 0; try < options.traceroutehops; try++) {
+                        const struct TraceProbe *p;
+                        p = &tr->probes[traceProbe(tr, f, hop, try)];
+                        if (!p->done) {
+                                continue;
+                        }
+                        answered = 1;
+                        for (g = 0; g < numGroups; g++) {
+                                if (!strcmp(groups[g].p->from, p->from)
+                                    && !strcmp(groups[g].p->what, p->what)) {
+                                        break;
+                                }
+                        }
+                        if (g == numGroups) {
+                                memset(&groups[g], 0, sizeof(groups[g]));
+                                groups[g].p = p;
+                                groups[g].min = groups[g].max = p->rtt;
+                                numGroups++;
+                        }
+                        groups[g].flows |= (uint64_t)1 << f;
+                        groups[g].count++;
+                        groups[g].sum += p->rtt;
+                        if (p->rtt < groups[g].min) {
+                                groups[g].min = p->rtt;
+                        }
+                        if (p->rtt > groups[g].max) {
+                                groups[g].max = p->rtt;
+                        }
+                }
+                if (!answered) {
+                        silent |= (uint64_t)1 << f;
+                }
+        }
+        for (g = 0; g < numGroups; g++) {
+                printf(g ? "     " : "%4d ", hop);
+                printf("%s flows ", groups[g].p->from);
+                printFlowSet(groups[g].flows);
+                printf(" rtt min/avg/max = %.2f/%.2f/%.2f ms: %s\n",
+                       1000 * groups[g].min,
+                       1000 * groups[g].sum / groups[g].count,
+                       1000 * groups[g].max,
+                       groups[g].p->what);
+        }
+        if (silent) {
+                printf(numGroups ? "     " : "%4d ", hop);
+                printf("* flows ");
+                printFlowSet(silent);
+                printf("\n");
+        }
+}
+
+/**
+ * Print the distinct paths of a multipath traceroute (-M), with the
+ * flows that took them and their RTT to the end of the path. A hop
+ * that didn't answer a flow (ICMP rate limiting, usually) matches any
+ * router, so it doesn't make a path of its own.
+ */
+static void
+tracePathsPrint(const struct Trace *tr)
+{
+        const int maxttl = options.traceroutemaxttl;
+        const char **hops;      /* [flow * maxttl + hop - 1], NULL if * */
+        int grouped[MAX_TRACEFLOWS];
+        unsigned int f, f2;
+        int hop, try;
+
+        if (!(hops = calloc(tr->flows * maxttl, sizeof(const char*)))) {
+                fprintf(stderr, "%s: calloc(%u, %d): %s\n", argv0,
+                        tr->flows * maxttl, (int)sizeof(const char*),
+                        strerror(errno));
+                return;
+        }
+        /* path of a flow is the first answer at each hop */
+        for (f = 0; f < tr->flows; f++) {
+                grouped[f] = 0;
+                for (hop = 1; hop <= tr->flowEnd[f]; hop++) {
+                        for (try = 0; try < options.traceroutehops; try++) {
+                                const struct TraceProbe *p;
+                                p = &tr->probes[traceProbe(tr, f, hop, try)];
+                                if (p->done) {
+                                        hops[f * maxttl + hop - 1] = p->from;
+                                        break;
+                                }
+                        }
+                }
+        }
+
+        printf("\n--- %s GTP traceroute paths ---\n", targets->name);
+        for (f = 0; f < tr->flows; f++) {
+                const char **path = &hops[f * maxttl];
+                const char *sep = "";
+                uint64_t flows = 0;
+                unsigned int count = 0;
+                double sum = 0;
+
+                if (grouped[f]) {
+                        continue;
+                }
+                for (f2 = f; f2 < tr->flows; f2++) {
+                        const char **path2 = &hops[f2 * maxttl];
+                        if (grouped[f2] || tr->flowEnd[f2] != tr->flowEnd[f]) {
+                                continue;
+                        }
+                        for (hop = 0; hop < tr->flowEnd[f]; hop++) {
+                                if (path[hop] && path2[hop]
+                                    && strcmp(path[hop], path2[hop])) {
+                                        break;
+                                }
+                        }
+                        if (hop < tr->flowEnd[f]) {
+                                continue;
+                        }
+                        for (hop = 0; hop < tr->flowEnd[f]; hop++) {
+                                if (!path[hop]) {
+                                        path[hop] = path2[hop];
+                                }
+                        }
+                        grouped[f2] = 1;
+                        flows |= (uint64_t)1 << f2;
+                        for (try = 0; try < options.traceroutehops; try++) {
+                                const struct TraceProbe *p;
+                                p = &tr->probes[traceProbe(tr, f2,
+                                                           tr->flowEnd[f2],
+                                                           try)];
+                                if (p->done && p->final) {
+                                        sum += p->rtt;
+                                        count++;
+                                }
+                        }
+                }
+                printf("flows ");
+                printFlowSet(flows);
+                printf(" (source ports ");
+                for (f2 = f; f2 < tr->flows; f2++) {
+                        if (flows & ((uint64_t)1 << f2)) {
+                                printf("%s%u", sep, tr->ports[f2]);
+                                sep = ",";
+                        }
+                }
+                printf("):");
+                for (hop = 0; hop < tr->flowEnd[f]; hop++) {
+                        printf(" %s", path[hop] ? path[hop] : "*");
+                }
+                if (count) {
+                        printf(", rtt %.2f ms\n", 1000 * sum / count);
+                } else {
+                        printf(", end not reached\n");
+                }
+        }
+        free(hops);
+}
+
+/**
+ * Parallel traceroute (-R). Probes for every TTL and every try are sent
+ * up front, and answers are matched to their probe by sequence number.
+ * Hops are printed in order, each as soon as all its probes are answered
+ * or the interval has passed.
+ *
+ * With more than one flow (-M) each flow sends from its own source port,
+ * so that ECMP hashing spreads them over the parallel paths. Each hop
+ * then lists the distinct routers that answered, and the distinct paths
+ * are listed at the end.
+ */
+static int
+tracerouteParallel()
+{
+        struct Trace tr;
+        struct TraceGroup *groups = NULL;
+        struct Event evs[MAX_EVENTS];
+        int printed = 0;                       /* hops printed so far */
+        double deadline;
+        unsigned int f;
+        int try;
+        int ret = 0;
+
+        memset(&tr, 0, sizeof(tr));
+        tr.flows = options.traceflows;
+        tr.numProbes = tr.flows * options.traceroutemaxttl
+                * options.traceroutehops;
+        if (!(tr.probes = calloc(tr.numProbes, sizeof(struct TraceProbe)))
+            || !(groups = calloc(tr.flows * options.traceroutehops,
+                                 sizeof(struct TraceGroup)))) {
+                fprintf(stderr, "%s: calloc(%u, %d): %s\n", argv0,
+                        tr.numProbes, (int)sizeof(struct TraceProbe),
+                        strerror(errno));
+                ret = 1;
+                goto out;
+        }
+
+	printf("GTPING %s traceroute to %s (%s) packet version %d, "
+               "%d hops max",
+               tr.flows > 1 ? "multipath" : "parallel",
+	       targets->name,
+	       targets->ip,
+	       (int)options.version,
+               options.traceroutemaxttl);
+        if (tr.flows > 1) {
+                printf(", %u flows", tr.flows);
+        }
+        printf(".\n");
+
+        if (traceFlowsOpen(&tr)) {
+                ret = 2;
+                goto out;
+        }
+
+        for (try = 0; try < options.traceroutehops; try++) {
+                for (f = 0; f < tr.flows; f++) {
+                        traceSend(tr.fds[f], options.traceroutemaxttl);
+                }
+        }
+        deadline = clock_get_dbl() + options.interval;
+
+	while (!sigintReceived) {
+                double timewait;
+                int endHop = 0;
+                int n, i;
+
+                /* last hop to print is the end of the longest flow */
+                for (f = 0; f < tr.flows; f++) {
+                        if (tr.flowEnd[f] > endHop) {
+                                endHop = tr.flowEnd[f];
+                        }
+                }
+
+                /* print hops that are done */
+                while (printed < endHop) {
+                        int hop = printed + 1;
+                        int waiting = 0;
+
+                        for (f = 0; f < tr.flows; f++) {
+                                if (tr.flowEnd[f] < hop) {
+                                        continue;
+                                }
+                                for (try = 0;
+                                     try < options.traceroutehops; try++) {
+                                        if (!tr.probes[traceProbe(&tr, f, hop,
+                                                                  try)].done) {
+                                                waiting = 1;
+                                        }
+                                }
+                        }
+                        if (waiting && clock_get_dbl() < deadline) {
+                                break;
+                        }
+                        if (tr.flows > 1) {
+                                traceHopPrint(&tr, hop, groups);
+                        } else {
+                                for (try = 0;
+                                     try < options.traceroutehops; try++) {
+                                        const struct TraceProbe *p;
+                                        p = &tr.probes[traceProbe(&tr, 0,
+                                                                  hop, try)];
+                                        if (try) {
+                                                printf("     ");
+                                        } else {
+                                                printf("%4d ", hop);
+                                        }
+                                        printf("%s\n",
+                                               p->done ? p->line : "*");
+                                }
+                        }
+                        fflush(stdout);
+                        printed++;
+                }
+                if (printed == endHop) {
+                        break;
+                }
+
+		timewait = deadline - clock_get_dbl();
+		if (timewait < 0) {
+			timewait = 0;
+		}
+                n = evWait(evs, MAX_EVENTS, timewait);
+                for (i = 0; i < n; i++) {
+                        int more = 0;
+                        int moreErr = 0;
+
+                        if (evs[i].events & EV_ERR) {
+                                traceErrors(&tr, evs[i].fd, &moreErr);
+                        }
+                        if (evs[i].events & EV_IN) {
+                                traceReplies(&tr, evs[i].fd, &more);
+                        }
+                        if (more || moreErr) {
+                                evRearm(evs[i].fd);
+                        }
+                }
+        }
+        if (tr.flows > 1 && !sigintReceived) {
+                tracePathsPrint(&tr);
+        }
+ out:
+        for (f = 1; f < tr.flows; f++) {
+                if (tr.fds[f] > 0) {
+                        close(tr.fds[f]);
+                }
+        }
+        free(groups);
+        free(tr.probes);
+        return ret;
+}
+
+/**
+ * Print "rtt p50/p90 = 1.000/2.000 ms" for the -l percentiles.
+ */
+static void
+printPercentiles(const struct Histogram *h)
+{
+        unsigned int c;
+
+        printf("rtt ");
+        for (c = 0; c < options.numPercentiles; c++) {
+                printf("%sp%g", c ? "/" : "", options.percentiles[c]);
+        }
+        printf(" =");
+        for (c = 0; c < options.numPercentiles; c++) {
+                printf("%s%.3f", c ? "/" : " ",
+                       1000 * histPercentile(h, options.percentiles[c]));
+        }
+        printf(" ms");
+}
+
+/**
+ * Print statistics for one target.
+ */
+static void
+printTargetSummary(const struct Target *t)
+{
+        if (options.output != OUTPUT_TEXT) {
+                outputSummary(t, clock_get_dbl() - startTime);
+                return;
+        }
+	printf("\n--- %s GTP ping statistics ---\n"
+               "%u packets transmitted, %u received, "
+               "%d%% packet loss, "
+               "time %dms\n"
+               "%u out of order, %u dups, "
+               "%u connection refused",
+	       t->name,
+               t->sent, t->recvd,
+	       (int)((100.0*(t->sent-t->recvd))/(t->sent?t->sent:1)),
+               (int)(1000*(clock_get_dbl()-startTime)),
+               t->reorder, t->dups,
+               t->connectionRefused);
+        /* the error count is for all targets, printed once if many */
+        if (!options.multi) {
+                errInspectionPrintSummary();
+        }
+        printf("\n");
+	if (t->totalTimeCount) {
+		printf("rtt min/avg/max/mdev = %.3f/%.3f/%.3f/%.3f ms",
+		       1000*t->totalMin,
+		       1000*(t->totalTime / t->totalTimeCount),
+		       1000*t->totalMax,
+		       1000*sqrt((t->totalTimeSquared -
+				  (t->totalTime * t->totalTime)
+				  /t->totalTimeCount)/t->totalTimeCount));
+                printf("\n");
+                printPercentiles(&t->hist);
+	}
+	printf("\n");
+}
+
+/**
+ * Print stats since last call for all targets, and start a new window.
+ */
+static void
+printIntervalReport(double elapsed)
+{
+        unsigned int c;
+
+        for (c = 0; c < numTargets; c++) {
+                struct Target *t = &targets[c];
+                struct Window *w = &t->win;
+
+                if (t->resolved <= 0) {
+                        continue;
+                }
+                if (options.output != OUTPUT_TEXT) {
+                        outputInterval(t, elapsed);
+                        memset(w, 0, sizeof(*w));
+                        continue;
+                }
+                printf("%s%s: %.1fs %u/%u packets, %d%% loss, "
+                       "%u dups, %u out of order",
+                       options.flood ? "\n" : "",
+                       t->name,
+                       elapsed,
+                       w->recvd, w->sent,
+                       (w->sent > w->recvd)
+                       ? (int)((100.0*(w->sent-w->recvd))/w->sent) : 0,
+                       w->dups,
+                       w->reorder);
+                if (w->hist.count) {
+                        printf(", ");
+                        printPercentiles(&w->hist);
+                }
+                printf("\n");
+                memset(w, 0, sizeof(*w));
+        }
+        errInspectionReport(1);
+        fflush(stdout);
+}
+
+/**
+ * Print requested vs achieved send rate.
+ */
+static void
+printPacing(const struct Pacer *p, unsigned int sent)
+{
+        double requested = 0;
+        double achieved = 0;
+        unsigned int usable = 0;
+        unsigned int c;
+
+        for (c = 0; c < numTargets; c++) {
+                usable += targets[c].resolved > 0;
+        }
+        if (p->interval > 0) {
+                requested = usable * options.batch / p->interval;
+        }
+        if (p->rounds) {
+                double t = p->lastSend - p->firstSend + p->interval;
+                if (t > 0) {
+                        achieved = sent / t;
+                }
+        }
+        if (options.output != OUTPUT_TEXT) {
+                outputPacing(p->rounds, requested, achieved,
+                             p->late, p->skipped);
+                return;
+        }
+        printf("\n--- pacing ---\n%u rounds, ", p->rounds);
+        if (requested) {
+                printf("requested %.1f pps, ", requested);
+        } else {
+                printf("requested unlimited, ");
+        }
+        printf("achieved %.1f pps, %u late, %u skipped\n",
+               achieved, p->late, p->skipped);
+}
+
+/**
+ * Schedule the round after the one just sent at 'now'. Deadlines are
+ * absolute, so scheduling delays don't add up. If we fall far behind,
+ * skip rounds instead of bursting to catch up.
+ */
+static void
+pacerNext(struct Pacer *p, double now)
+{
+        if (!p->rounds) {
+                p->firstSend = now;
+        }
+        p->rounds++;
+        p->lastSend = now;
+        if (now >= p->nextSend + p->interval) {
+                p->late++;
+        }
+        p->nextSend += p->interval;
+        if (now - p->nextSend > PACER_MAXBURST * p->interval) {
+                unsigned int skip = (now - p->nextSend) / p->interval;
+                p->skipped += skip;
+                p->nextSend += skip * p->interval;
+        }
+}
+
+/**
+ * Add window src to dst.
+ */
+static void
+windowMerge(struct Window *dst, const struct Window *src)
+{
+        dst->sent += src->sent;
+        dst->recvd += src->recvd;
+        dst->dups += src->dups;
+        dst->reorder += src->reorder;
+        histMerge(&dst->hist, &src->hist);
+}
+
+/**
+ * Worker thread: hand the current window of all targets over to the
+ * main thread, which asked for it with w->reportWant.
+ */
+static void
+windowHandover(struct Worker *w)
+{
+        unsigned int c;
+
+        for (c = 0; c < numTargets; c++) {
+                windowMerge(&targets[c].winDone, &targets[c].win);
+                memset(&targets[c].win, 0, sizeof(targets[c].win));
+        }
+#ifdef HAVE_THREADS
+        __sync_synchronize();
+#endif
+        w->reportDone = w->reportWant;
+        if (1 != write(w->notifyfd, "r", 1)) {
+                /* pipe full, main thread is awake anyway */
+        }
+}
+
+/**
+ * Worker thread: hand a snapshot of what the exporter (-e) shows over to
+ * the main thread, which asked for it with w->metricsWant.
+ */
+static void
+metricsHandover(struct Worker *w)
+{
+        unsigned int c;
+
+        for (c = 0; c < numTargets; c++) {
+                metricsSnapshot(&targets[c], &w->metrics[c]);
+        }
+#ifdef HAVE_THREADS
+        __sync_synchronize();
+#endif
+        w->metricsDone = w->metricsWant;
+        if (1 != write(w->notifyfd, "m", 1)) {
+                /* pipe full, main thread is awake anyway */
+        }
+}
+
+/**
+ * Add sockets[] not already in the event loop.
+ *
+ * return 0 on success, <0 (-errno) on error
+ */
+static int
+watchSockets(int *watched)
+{
+        unsigned int c;
+        int err;
+
+        for (c = 0; c < sizeof(sockets)/sizeof(sockets[0]); c++) {
+                if (sockets[c] >= 0 && !watched[c]) {
+                        if ((err = evAdd(sockets[c]))) {
+                                return err;
+                        }
+                        watched[c] = 1;
+                }
+        }
+        return 0;
+}
+
+/**
+ * Ping the targets of this thread until done or interrupted. Either
+ * called directly by pingMainloop(), or as a worker thread (-j).
+ *
+ * return 0 on success, or exit code on error
+ */
+static int
+pingLoop(struct Worker *w)
+{
+	double now;
+        double lastRecvTime;     /* last time we got a reply */
+        double lastReportTime;   /* last time interval stats were printed */
+        int recvErrors = 0;
+        struct Event evs[MAX_EVENTS];
+        unsigned int c;
+        struct Pacer *pacer = &w->pacer;
+        unsigned long total = 0; /* pings to send, 0 = infinite */
+        int timerfd = -1;
+        double timerArmed = -1;  /* deadline timerfd is set to */
+        int threaded = w->notifyfd >= 0;
+        int watched[2] = { 0, 0 };  /* sockets[] added to event loop */
+        unsigned int usable = 0;    /* targets resolved and not dups */
+        unsigned int pending = 0;   /* targets still being looked up */
+        int resolvefd = -1;
+
+	if (options.verbose > 2) {
+		fprintf(stderr, "%s: mainloop(%u)\n", argv0, w->id);
+	}
+        profile = &w->profile;
+
+        for (c = 0; c < numTargets; c++) {
+                if (targets[c].resolved > 0) {
+                        usable++;
+                } else if (!targets[c].resolved) {
+                        pending++;
+                }
+        }
+        if (pending && evAdd(resolvefd = resolveFd())) {
+                return 2;
+        }
+        if (watchSockets(watched)) {
+                return 2;
+        }
+        if (w->wakefd[0] >= 0 && evAdd(w->wakefd[0])) {
+                return 2;
+        }
+
+        /* interval 0 means as fast as possible, no need for timer */
+        if (w->interval > 0 && 0 <= (timerfd = timerCreate())) {
+                if (evAdd(timerfd)) {
+                        return 2;
+                }
+        }
+
+        memset(pacer, 0, sizeof(*pacer));
+        pacer->interval = w->interval;
+        pacer->nextSend = w->start;
+
+        for (c = 0; c < numTargets; c++) {
+                if (targets[c].resolved < 0) {
+                        continue;
+                }
+                if (!targets[c].count) {
+                        total = 0;
+                        break;
+                }
+                total += targets[c].count;
+        }
+
+        lastRecvTime = w->start;
+        lastReportTime = w->start;
+	while (!sigintReceived) {
+                /* max time to wait for replies before it's time to send
+                 * another ping */
+		double timewait;
+		int n;
+                int i;
+
+                /* all lookups failed */
+                if (!usable && !pending) {
+                        break;
+                }
+
+                /* sent all we are going to send, and got all replies
+                 * (either errors or good replies)
+                 */
+                if (total
+                    && (w->sent == total)
+                    && (w->sent == (w->recvd + recvErrors))) {
+                        break;
+                }
+
+		now = clock_get_dbl();
+
+                /* if clock is not monotonic and time set backwards
+                 * since last ping, start a new ping cycle */
+                if (now < pacer->nextSend - pacer->interval) {
+                        pacer->nextSend = now;
+                }
+
+                if (threaded) {
+                        /* main thread prints the interval reports */
+                        if (w->reportWant != w->reportDone) {
+                                windowHandover(w);
+                        }
+                        if (w->metricsWant != w->metricsDone) {
+                                metricsHandover(w);
+                        }
+                } else if (sigquitReceived
+                           || (options.report
+                               && now >= lastReportTime + options.report)) {
+                        int quit = sigquitReceived;
+                        sigquitReceived = 0;
+                        printIntervalReport(now - lastReportTime);
+                        lastReportTime = now;
+                        if (quit) {
+                                profileReport();
+                        }
+                }
+
+                /* time to send yet? */
+                if (!usable) {
+                        /* nothing to send until a lookup finishes */
+                        pacer->nextSend = now;
+                } else if (now >= pacer->nextSend) {
+			if (total && (w->sent == total)) {
+				if (lastRecvTime + waitTime < now) {
+                                        break;
+                                }
+                                pacer->nextSend = now + pacer->interval;
+			} else {
+                                n = sendRound();
+                                w->sent += n;
+                                pacerNext(pacer, now);
+                                if (options.flood
+                                    && options.output == OUTPUT_TEXT) {
+                                        uint64_t pt = PROF_START();
+                                        int dots = n;
+                                        while (n--) {
+                                                putchar('.');
+                                        }
+                                        fflush(stdout);
+                                        PROF_END(PROF_OUTPUT, pt, dots);
+                                }
+			}
+		}
+
+                /* max waittime: until it's time to send the next one */
+                now = clock_get_dbl();
+                timewait = pacer->nextSend - now;
+
+                /* never wait more than an interval. this can happen if
+                 * clock is not monotonic */
+                if (timewait > pacer->interval) {
+                        timewait = pacer->interval;
+                }
+		if (timewait < 0) {
+			timewait = 0;
+		}
+                if (!usable) {
+                        timewait = 1.0;
+                }
+
+                if (usable && timerfd >= 0 && timewait > 0) {
+                        /* timerfd wakes us up on time. The timeout is
+                         * only a backstop. */
+                        if (timerArmed != pacer->nextSend) {
+                                if (timerSet(timerfd, pacer->nextSend)) {
+                                        exit(2);
+                                }
+                                timerArmed = pacer->nextSend;
+                        }
+                        timewait += 0.001;
+                }
+
+                /* wake up in time for the next interval report */
+                if (!threaded
+                    && options.report
+                    && (lastReportTime + options.report - now < timewait)) {
+                        timewait = lastReportTime + options.report - now;
+                        if (timewait < 0) {
+                                timewait = 0;
+                        }
+                }
+
+                outputFlush(now);
+                if (!threaded && options.metrics) {
+                        metricsFlush();
+                        if (metricsBusy() && timewait > METRICS_WAIT) {
+                                timewait = METRICS_WAIT;
+                        }
+                }
+
+                {
+                        uint64_t pt = PROF_START();
+                        n = evWait(evs, MAX_EVENTS, timewait);
+                        PROF_END(PROF_WAIT, pt, n > 0 ? n : 0);
+                }
+                for (i = 0; i < n; i++) {
+                        int fd = evs[i].fd;
+                        int more = 0;
+                        int moreErr = 0;
+
+                        if (fd == timerfd) {
+                                timerAck(timerfd);
+                                timerArmed = -1;
+                                continue;
+                        }
+                        if (!threaded && metricsOwns(fd)) {
+                                if (metricsRead(fd)) {
+                                        metricsRespond(targets, NULL,
+                                                       numTargets,
+                                                       clock_get_dbl()
+                                                       - startTime);
+                                }
+                                continue;
+                        }
+                        if (fd == resolvefd) {
+                                const struct Resolve *r;
+                                for (r = resolveDone(0); r; r = r->next) {
+                                        struct Target *t = r->data;
+                                        if (targetReady(r)) {
+                                                return 2;
+                                        }
+                                        pending--;
+                                        if (t->resolved > 0) {
+                                                usable++;
+                                        } else if (total) {
+                                                total -= t->count;
+                                        }
+                                }
+                                if (watchSockets(watched)) {
+                                        return 2;
+                                }
+                                continue;
+                        }
+                        if (fd == w->wakefd[0]) {
+                                char buf[64];
+                                /* just a wakeup, state is checked above */
+                                while (0 < read(fd, buf, sizeof(buf)));
+                                continue;
+                        }
+                        if (evs[i].events & EV_ERR) {
+                                recvErrors += handleRecvErrs(fd,
+                                                             RECV_DRAINMAX,
+                                                             &moreErr);
+                        }
+                        if (evs[i].events & EV_IN) {
+                                int got;
+                                got = recvEchoReplies(fd, RECV_DRAINMAX,
+                                                      &more);
+                                if (got) {
+                                        w->recvd += got;
+                                        lastRecvTime = clock_get_dbl();
+                                }
+                        }
+                        if (more || moreErr) {
+                                evRearm(fd);
+                        }
+                }
+	}
+        if (timerfd >= 0) {
+                evDel(timerfd);
+                close(timerfd);
+        }
+        return 0;
+}
+
+#ifdef HAVE_THREADS
+/**
+ * Worker thread (-j) main function.
+ */
+static void*
+workerMain(void *arg)
+{
+        struct Worker *w = arg;
+
+        targets = w->targets;
+        numTargets = w->numTargets;
+        waitTime = options.wait;
+
+        if (evInit() || openSockets() || pingLoop(w)) {
+                w->failed = 1;
+                sigintReceived = 1;
+        }
+        __sync_synchronize();
+        w->finished = 1;
+        if (1 != write(w->notifyfd, "d", 1)) {
+                /* pipe full, main thread is awake anyway */
+        }
+        return NULL;
+}
+
+/**
+ * Set both ends of pipe p to non-blocking.
+ *
+ * return 0 on success, <0 (-errno) on error
+ */
+static int
+pipeNonblock(int p[2])
+{
+        int c;
+
+        for (c = 0; c < 2; c++) {
+                if (fcntl(p[c], F_SETFL, fcntl(p[c], F_GETFL) | O_NONBLOCK)) {
+                        int err = errno;
+                        fprintf(stderr, "%s: fcntl(%d, F_SETFL): %s\n",
+                                argv0, p[c], strerror(err));
+                        return -err;
+                }
+        }
+        return 0;
+}
+
+/**
+ * Wake up worker w, if it's still running.
+ */
+static void
+workerWake(struct Worker *w)
+{
+        if (!w->finished && 1 != write(w->wakefd[1], "w", 1)) {
+                /* pipe full, worker will wake up anyway */
+        }
+}
+
+/**
+ * Collect windows handed over by the workers into the main thread's
+ * targets, and print the interval report.
+ */
+static void
+workersReport(struct Worker *workers, unsigned int n, double elapsed)
+{
+        unsigned int c, i;
+
+        __sync_synchronize();
+        for (c = 0; c < n; c++) {
+                struct Worker *w = &workers[c];
+                for (i = 0; i < w->numTargets; i++) {
+                        struct Target *t = &w->targets[i];
+                        windowMerge(&targets[t->origin].win, &t->winDone);
+                        memset(&t->winDone, 0, sizeof(t->winDone));
+                        if (w->finished) {
+                                windowMerge(&targets[t->origin].win, &t->win);
+                                memset(&t->win, 0, sizeof(t->win));
+                        }
+                }
+        }
+        printIntervalReport(elapsed);
+}
+
+/**
+ * Add final stats of src (a worker's copy of a target) to dst.
+ */
+static void
+targetMerge(struct Target *dst, const struct Target *src)
+{
+        dst->sent += src->sent;
+        dst->recvd += src->recvd;
+        dst->dups += src->dups;
+        dst->reorder += src->reorder;
+        dst->connectionRefused += src->connectionRefused;
+        dst->icmpErrors += src->icmpErrors;
+        dst->totalTimeCount += src->totalTimeCount;
+        dst->totalTime += src->totalTime;
+        dst->totalTimeSquared += src->totalTimeSquared;
+        if (src->totalMin >= 0
+            && (dst->totalMin < 0 || src->totalMin < dst->totalMin)) {
+                dst->totalMin = src->totalMin;
+        }
+        if (src->totalMax > dst->totalMax) {
+                dst->totalMax = src->totalMax;
+        }
+        histMerge(&dst->hist, &src->hist);
+}
+
+/**
+ * Split targets over n workers.
+ *
+ * With at least as many targets as workers, each worker gets every
+ * n:th target. Otherwise each worker gets its own copy of every
+ * target, starts a fraction of an interval after the previous one, and
+ * sends every n:th round.
+ *
+ * return 0 on success, <0 (-errno) on error
+ */
+static int
+shardTargets(struct Worker *workers, unsigned int n)
+{
+        unsigned int c, i;
+        int copies = numTargets < n;
+
+        for (c = 0; c < n; c++) {
+                struct Worker *w = &workers[c];
+                size_t num;
+
+                memset(w, 0, sizeof(*w));
+                w->id = c;
+                w->wakefd[0] = w->wakefd[1] = -1;
+                w->notifyfd = -1;
+                if (copies) {
+                        num = numTargets;
+                        w->interval = options.interval * n;
+                        w->start = startTime + c * options.interval;
+                } else {
+                        num = numTargets / n + (c < numTargets % n);
+                        w->interval = options.interval;
+                        w->start = startTime + c * options.interval / n;
+                }
+                if (!(w->targets = calloc(num, sizeof(struct Target)))) {
+                        int err = errno;
+                        fprintf(stderr, "%s: calloc(%u targets): %s\n",
+                                argv0, (unsigned int)num, strerror(err));
+                        return -err;
+                }
+                w->numTargets = num;
+                for (i = 0; i < num; i++) {
+                        struct Target *t = &w->targets[i];
+                        unsigned int origin = copies ? i : c + i * n;
+
+                        *t = targets[origin];
+                        t->origin = origin;
+                        if (copies && t->count) {
+                                t->count = t->count / n
+                                        + (c < t->count % n);
+                        }
+                }
+        }
+        return 0;
+}
+
+/**
+ * Answer metrics scrapes (-e) with the snapshots the workers handed
+ * over, and the final stats of those that are done.
+ */
+static void
+metricsWorkers(const struct Worker *workers, unsigned int n)
+{
+        struct MetricsTarget *snap;
+        struct MetricsTarget final;
+        unsigned int c, i;
+
+        if (!(snap = calloc(numTargets, sizeof(struct MetricsTarget)))) {
+                fprintf(stderr, "%s: calloc(metrics snapshot): %s\n",
+                        argv0, strerror(errno));
+                return;
+        }
+        __sync_synchronize();
+        for (c = 0; c < n; c++) {
+                const struct Worker *w = &workers[c];
+                for (i = 0; i < w->numTargets; i++) {
+                        const struct Target *t = &w->targets[i];
+                        if (w->finished) {
+                                metricsSnapshot(t, &final);
+                                metricsMerge(&snap[t->origin], &final);
+                        } else {
+                                metricsMerge(&snap[t->origin],
+                                             &w->metrics[i]);
+                        }
+                }
+        }
+        metricsRespond(targets, snap, numTargets,
+                       clock_get_dbl() - startTime);
+        free(snap);
+}
+
+/**
+ * Start worker threads, print interval reports when asked to, and wait
+ * for them to finish. Then merge their stats into the main thread's
+ * targets.
+ *
+ * return 0 on success, or exit code on error
+ */
+static int
+runWorkers(struct Worker *workers, unsigned int n)
+{
+        struct Event evs[MAX_EVENTS];
+        int notify[2];
+        unsigned int c, i;
+        unsigned int running;
+        unsigned int reportGen = 0;
+        int reporting = 0;
+        unsigned int metricsGen = 0;
+        int scraping = 0;            /* waiting for metrics handovers */
+        unsigned int scrapeWait;
+        int woken = 0;
+        double lastReportTime = startTime;
+        int ret = 0;
+        int k, e;
+
+        if (pipe(notify) || pipeNonblock(notify) || evAdd(notify[0])) {
+                fprintf(stderr, "%s: notify pipe: %s\n",
+                        argv0, strerror(errno));
+                return 2;
+        }
+        for (c = 0; c < n; c++) {
+                struct Worker *w = &workers[c];
+                w->notifyfd = notify[1];
+                if (pipe(w->wakefd) || pipeNonblock(w->wakefd)) {
+                        fprintf(stderr, "%s: wake pipe: %s\n",
+                                argv0, strerror(errno));
+                        return 2;
+                }
+                if (options.metrics
+                    && !(w->metrics = calloc(w->numTargets,
+                                             sizeof(struct MetricsTarget)))) {
+                        fprintf(stderr, "%s: calloc(metrics): %s\n",
+                                argv0, strerror(errno));
+                        return 2;
+                }
+                if (threadStart(w, workerMain)) {
+                        return 2;
+                }
+        }
+
+        for (running = n; running; ) {
+                double now = clock_get_dbl();
+                double timewait = 1.0;   /* backstop */
+                char buf[64];
+
+                if (sigintReceived && !woken) {
+                        for (c = 0; c < n; c++) {
+                                workerWake(&workers[c]);
+                        }
+                        woken = 1;
+                }
+
+                /* ask workers for their windows */
+                if (!reporting
+                    && (sigquitReceived
+                        || (options.report
+                            && now >= lastReportTime + options.report))) {
+                        if (sigquitReceived) {
+                                profileReport();
+                        }
+                        sigquitReceived = 0;
+                        reportGen++;
+                        for (c = 0; c < n; c++) {
+                                workers[c].reportWant = reportGen;
+                                workerWake(&workers[c]);
+                        }
+                        reporting = 1;
+                }
+
+                running = 0;
+                i = 0;
+                scrapeWait = 0;
+                for (c = 0; c < n; c++) {
+                        if (!workers[c].finished) {
+                                running++;
+                                if (workers[c].reportDone != reportGen) {
+                                        i++;
+                                }
+                                if (workers[c].metricsDone != metricsGen) {
+                                        scrapeWait++;
+                                }
+                        }
+                }
+                if (reporting && !i) {
+                        workersReport(workers, n, now - lastReportTime);
+                        lastReportTime = now;
+                        reporting = 0;
+                }
+                if (scraping && !scrapeWait) {
+                        metricsWorkers(workers, n);
+                        scraping = 0;
+                }
+                if (!running) {
+                        break;
+                }
+
+                if (options.report && !reporting
+                    && lastReportTime + options.report - now < timewait) {
+                        timewait = lastReportTime + options.report - now;
+                        if (timewait < 0) {
+                                timewait = 0;
+                        }
+                }
+                outputFlush(now);
+                if (options.metrics) {
+                        metricsFlush();
+                        if (metricsBusy() && timewait > METRICS_WAIT) {
+                                timewait = METRICS_WAIT;
+                        }
+                }
+                k = evWait(evs, MAX_EVENTS, timewait);
+                for (e = 0; e < k; e++) {
+                        if (evs[e].fd == notify[0]) {
+                                while (0 < read(notify[0], buf, sizeof(buf)));
+                        } else if (metricsOwns(evs[e].fd)
+                                   && metricsRead(evs[e].fd)
+                                   && !scraping) {
+                                /* ask workers for snapshots */
+                                metricsGen++;
+                                for (c = 0; c < n; c++) {
+                                        workers[c].metricsWant = metricsGen;
+                                        workerWake(&workers[c]);
+                                }
+                                scraping = 1;
+                        }
+                }
+        }
+
+        for (c = 0; c < n; c++) {
+                struct Worker *w = &workers[c];
+
+                threadJoin(w);
+                close(w->wakefd[0]);
+                close(w->wakefd[1]);
+                free(w->metrics);
+                if (w->failed) {
+                        ret = 2;
+                }
+                for (i = 0; i < w->numTargets; i++) {
+                        struct Target *t = &w->targets[i];
+                        targetMerge(&targets[t->origin], t);
+                }
+        }
+        evDel(notify[0]);
+        close(notify[0]);
+        close(notify[1]);
+        return ret;
+}
+#endif
+
+/**
+ * return value is sent directly to return value of main()
+ */
+static int
+pingMainloop()
+{
+        struct Worker *workers;
+        unsigned int n = options.threads;
+        unsigned int c;
+        int ret;
+
+        if (n > 1 && numTargets < n && options.count
+            && options.count < n) {
+                /* no point in threads with nothing to send */
+                n = options.count;
+        }
+        if (!(workers = calloc(n, sizeof(struct Worker)))) {
+                int err = errno;
+                fprintf(stderr, "%s: calloc(%u workers): %s\n",
+                        argv0, n, strerror(err));
+                return 2;
+        }
+
+	startTime = clock_get_dbl();
+        for (c = 0; options.output == OUTPUT_TEXT && c < numTargets; c++) {
+                if (targets[c].resolved <= 0) {
+                        continue;
+                }
+                printf("GTPING %s (%s) packet version %d\n",
+                       targets[c].name,
+                       targets[c].ip,
+                       options.version);
+        }
+
+        if (n < 2) {
+                profileAdd(&workers->profile);
+                workers->wakefd[0] = workers->wakefd[1] = -1;
+                workers->notifyfd = -1;
+                workers->targets = targets;
+                workers->numTargets = numTargets;
+                workers->interval = options.interval;
+                workers->start = startTime;
+                if ((ret = openSockets() ? 2 : pingLoop(workers))) {
+                        return ret;
+                }
+        } else {
+#ifdef HAVE_THREADS
+                if (shardTargets(workers, n)) {
+                        return 2;
+                }
+                for (c = 0; c < n; c++) {
+                        profileAdd(&workers[c].profile);
+                }
+                if ((ret = runWorkers(workers, n))) {
+                        return ret;
+                }
+                for (c = 1; c < n; c++) {
+                        struct Pacer *p = &workers->pacer;
+                        const struct Pacer *o = &workers[c].pacer;
+                        workers->sent += workers[c].sent;
+                        workers->recvd += workers[c].recvd;
+                        if (!o->rounds) {
+                                continue;
+                        }
+                        if (!p->rounds || o->firstSend < p->firstSend) {
+                                p->firstSend = o->firstSend;
+                        }
+                        if (o->lastSend > p->lastSend) {
+                                p->lastSend = o->lastSend;
+                        }
+                        /* copies take turns, shards send in parallel */
+                        if (numTargets < n) {
+                                p->rounds += o->rounds;
+                        } else if (o->rounds > p->rounds) {
+                                p->rounds = o->rounds;
+                        }
+                        p->late += o->late;
+                        p->skipped += o->skipped;
+                }
+                workers->pacer.interval = options.interval;
+#endif
+        }
+
+        n = 0;
+        for (c = 0; c < numTargets; c++) {
+                if (targets[c].resolved > 0) {
+                        printTargetSummary(&targets[c]);
+                        n++;
+                }
+        }
+        if (!n) {
+                fprintf(stderr, "%s: no usable targets\n", argv0);
+                return 1;
+        }
+        if (options.multi && options.output == OUTPUT_TEXT
+            && errInspectionCount()) {
+                printf("%u ICMP errors for all targets\n",
+                       errInspectionCount());
+        }
+        errInspectionReport(0);
+        printPacing(&workers->pacer, workers->sent);
+        profileReport();
+	return workers->recvd == 0;
+}
+
+/**
+ * Open a socket for the responder (-L), bound to -p on -s (default any).
+ * With worker threads each has its own socket on the same port, and
+ * SO_REUSEPORT spreads clients over them.
+ *
+ * return fd, or <0 (-errno) on error
+ */
+static int
+responderSocket()
+{
+        const int families[] = { AF_INET6, AF_INET };
+        const struct addrinfo *ai;
+        struct Resolve r;
+        int bufsize = RESPONDER_SOCKBUF;
+        int on = 1;
+        int off = 0;
+        int fd = -1;
+        int err = 0;
+        unsigned int c;
+
+        for (c = 0; c < sizeof(families) / sizeof(families[0]); c++) {
+                memset(&r, 0, sizeof(r));
+                r.name = options.source;
+                r.service = options.port;
+                r.hints.ai_flags = AI_PASSIVE;
+                r.hints.ai_family = options.af;
+                r.hints.ai_socktype = SOCK_DGRAM;
+                r.hints.ai_protocol = IPPROTO_UDP;
+                /* IPv6 socket takes IPv4 too, if there is IPv6 */
+                if (!options.source && options.af == AF_UNSPEC) {
+                        r.hints.ai_family = families[c];
+                }
+                if ((err = resolveSync(&r))) {
+                        fprintf(stderr, "%s: getaddrinfo(%s, %s): %s\n",
+                                argv0,
+                                options.source ? options.source : "any",
+                                options.port, gai_strerror(err));
+                        return -EINVAL;
+                }
+                for (ai = r.addrs; ai; ai = ai->ai_next) {
+                        if (0 > (fd = socket(ai->ai_family, ai->ai_socktype,
+                                             ai->ai_protocol))) {
+                                err = errno;
+                                continue;
+                        }
+                        if (ai->ai_family == AF_INET6) {
+                                setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY,
+                                           &off, sizeof(off));
+                        }
+#ifdef SO_REUSEPORT
+                        if (options.threads > 1
+                            && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT,
+                                          &on, sizeof(on))) {
+                                fprintf(stderr, "%s: setsockopt(%d, "
+                                        "SOL_SOCKET, SO_REUSEPORT): %s\n",
+                                        argv0, fd, strerror(errno));
+                        }
+#endif
+                        /* best effort, bursts from flood mode are big */
+                        setsockopt(fd, SOL_SOCKET, SO_RCVBUF,
+                                   &bufsize, sizeof(bufsize));
+                        setsockopt(fd, SOL_SOCKET, SO_SNDBUF,
+                                   &bufsize, sizeof(bufsize));
+                        if (!bind(fd, ai->ai_addr, ai->ai_addrlen)) {
+                                return fd;
+                        }
+                        err = errno;
+                        close(fd);
+                        fd = -1;
+                }
+                if (options.source || options.af != AF_UNSPEC) {
+                        break;
+                }
+        }
+        fprintf(stderr, "%s: bind(%s, %s): %s\n", argv0,
+                options.source ? options.source : "any", options.port,
+                strerror(err));
+        return err ? -err : -EINVAL;
+}
+
+/**
+ * Turn echo request m into an echo response, in place. Everything but
+ * the message type is echoed back.
+ *
+ * return 1 if m is an echo request and should be sent back, else 0
+ */
+static int
+responderReply(struct RecvMsg *m)
+{
+        struct GtpReply gtp;
+
+        if (m->len < 2) {
+                return 0;
+        }
+        gtp = parseReply(m->data, m->len);
+        if (!gtp.ok || gtp.msg != GTPMSG_ECHO) {
+                return 0;
+        }
+        /* msg type is the second byte in both v1 and v2 */
+        m->data[1] = GTPMSG_ECHOREPLY;
+        return 1;
+}
+
+/**
+ * Answer up to max echo requests from fd, MAX_RECVBATCH per syscall
+ * each way. *more is set if fd may not be drained.
+ */
+static void
+responderDrain(struct Worker *w, int fd, unsigned int max, int *more)
+{
+        static THREAD_LOCAL struct RecvMsg msgs[MAX_RECVBATCH];
+        static THREAD_LOCAL struct SendMsg replies[MAX_RECVBATCH];
+        unsigned int done = 0;
+
+        *more = 1;
+        while (done < max) {
+                unsigned int n = 0;
+                unsigned int sent = 0;
+                int got;
+                int c;
+
+                if (0 > (got = doRecvBatch(fd, msgs, MAX_RECVBATCH))) {
+                        *more = 0;
+                        if (errno != EAGAIN && errno != EINTR) {
+                                fprintf(stderr, "%s: recv(%d, ...): %s\n",
+                                        argv0, fd, strerror(errno));
+                        }
+                        break;
+                }
+                for (c = 0; c < got; c++) {
+                        if (!responderReply(&msgs[c])) {
+                                w->bad++;
+                                continue;
+                        }
+                        memset(&replies[n], 0, sizeof(replies[n]));
+                        replies[n].data = msgs[c].data;
+                        replies[n].len = msgs[c].len;
+                        replies[n].to = (struct sockaddr*)&msgs[c].from;
+                        replies[n].tolen = msgs[c].fromlen;
+                        n++;
+                }
+                w->recvd += got;
+                while (sent < n) {
+                        int ret = doSendBatch(fd, replies + sent, n - sent);
+                        if (ret > 0) {
+                                sent += ret;
+                                continue;
+                        }
+                        /* client gone or buffer full, drop that one */
+                        if (options.verbose) {
+                                fprintf(stderr, "%s: send(%d, ...): %s\n",
+                                        argv0, fd, strerror(errno));
+                        }
+                        sent++;
+                        w->bad++;
+                }
+                w->sent += n;
+                done += got;
+                if (got < MAX_RECVBATCH) {
+                        *more = 0;
+                        break;
+                }
+        }
+}
+
+/**
+ * Print requests and replies of all responder threads since last time,
+ * or in total.
+ */
+static void
+responderReport(const struct Worker *workers, unsigned int n,
+                double elapsed, int total)
+{
+        static unsigned int lastRecvd = 0;
+        static unsigned int lastSent = 0;
+        unsigned int recvd = 0;
+        unsigned int sent = 0;
+        unsigned int bad = 0;
+        unsigned int c;
+
+        for (c = 0; c < n; c++) {
+                recvd += workers[c].recvd;
+                sent += workers[c].sent;
+                bad += workers[c].bad;
+        }
+        if (total) {
+                printf("\n--- GTP responder statistics ---\n"
+                       "%u packets received, %u replies sent, "
+                       "%u bad or dropped, time %dms\n"
+                       "%.1f replies/s\n",
+                       recvd, sent, bad, (int)(1000 * elapsed),
+                       elapsed > 0 ? sent / elapsed : 0);
+        } else {
+                printf("--- interval: %u received, %u replies in %.3fs, "
+                       "%.1f replies/s ---\n",
+                       recvd - lastRecvd, sent - lastSent, elapsed,
+                       elapsed > 0 ? (sent - lastSent) / elapsed : 0);
+        }
+        fflush(stdout);
+        lastRecvd = recvd;
+        lastSent = sent;
+}
+
+/**
+ * Responder event loop for one thread. If report is set this thread
+ * also prints the interval reports.
+ *
+ * return 0 on success, else exit code
+ */
+static int
+responderLoop(struct Worker *w, int report)
+{
+        struct Event evs[MAX_EVENTS];
+        double lastReportTime = startTime;
+        int fd;
+
+        if (0 > (fd = responderSocket()) || evAdd(fd)) {
+                return 2;
+        }
+        if (w->wakefd[0] >= 0 && evAdd(w->wakefd[0])) {
+                return 2;
+        }
+        while (!sigintReceived) {
+                double timewait = 1.0;
+                double now = clock_get_dbl();
+                int n, i;
+
+                if (report && (sigquitReceived
+                               || (options.report
+                                   && now >= lastReportTime
+                                   + options.report))) {
+                        sigquitReceived = 0;
+                        responderReport(w, 1, now - lastReportTime, 0);
+                        lastReportTime = now;
+                }
+                if (report && options.report) {
+                        timewait = lastReportTime + options.report - now;
+                        if (timewait < 0) {
+                                timewait = 0;
+                        }
+                }
+                n = evWait(evs, MAX_EVENTS, timewait);
+                for (i = 0; i < n; i++) {
+                        int more = 0;
+                        if (evs[i].fd == w->wakefd[0]) {
+                                char buf[64];
+                                while (0 < read(evs[i].fd, buf, sizeof(buf)));
+                                continue;
                         }
-
-                        if (0 <= sendEcho(fd, curSeq++)) {
-                                lastPingTime = curPingTime;
-                                printStar = 1;
+                        responderDrain(w, fd, RECV_DRAINMAX, &more);
+                        if (more) {
+                                evRearm(fd);
                         }
                 }
-
-                /* max waittime: until it's time to send the next one */
-		timewait = lastPingTime+options.interval - clock_get_dbl();
-		if (timewait < 0) {
-			timewait = 0;
-		}
-                timewait *= 0.5; /* leave room for overhead */
-
-		switch ((n = poll(&fds, 1, (int)(timewait * 1000)))) {
-		case 1: /* read ready */
-                        printStar = 0;
-			if (fds.revents & POLLERR) {
-                                int e;
-				e = handleRecvErr(fd, NULL, lastPingTime);
-                                if (e) {
-                                        lastRecvTime = clock_get_dbl();
-                                }
-                                if (e > 1) {
-                                        endOfTraceroute = 1;
-                                }
-			}
-			if (fds.revents & POLLIN) {
-				n = recvEchoReply(fd);
-                                endOfTraceroute = 1;
-                                if (!n) {
-                                        lastRecvTime = clock_get_dbl();
-                                } else if (n > 0) {
-                                        /* still ok, but no reply */
-                                        printStar = 1;
-                                } else {
-                                        return 1;
-                                }
-			}
-			break;
-		case 0: /* timeout */
-			break;
-		case -1: /* error */
-			switch (errno) {
-			case EINTR:
-			case EAGAIN:
-				break;
-			default:
-				fprintf(stderr, "%s: poll([%d], 1, %d): %s\n",
-					argv0,
-					fd,
-					(int)(timewait*1000),
-					strerror(errno));
-				exit(2);
-			}
-			break;
-		default: /* can't happen */
-			fprintf(stderr, "%s: poll() returned %d!\n", argv0, n);
-			exit(2);
-			break;
-		}
         }
+        evDel(fd);
+        close(fd);
         return 0;
 }
 
+#ifdef HAVE_THREADS
 /**
- * return value is sent directly to return value of main()
+ * Responder worker thread (-L -j).
  */
-static int
-pingMainloop(int fd)
+static void*
+responderWorker(void *arg)
 {
-	unsigned sent = 0;
-	unsigned recvd = 0;
-	double lastpingTime = 0; /* last time we sent out a ping */
-	double curPingTime;   /* if we ping now, this is the timestamp of it */
-        double lastRecvTime = 0; /* last time we got a reply */
-        int recvErrors = 0;
-
-	if (options.verbose > 2) {
-		fprintf(stderr, "%s: mainloop(%d)\n", argv0, fd);
-	}
-
-	startTime = clock_get_dbl();
+        struct Worker *w = arg;
 
-	printf("GTPING %s (%s) packet version %d\n",
-	       options.target,
-	       options.targetip,
-	       options.version);
-
-        lastRecvTime = startTime;
-	while (!sigintReceived) {
-                /* max time to wait for replies before checking if it's time
-                 * to send another ping */
-		double timewait;
-		int n;
-		struct pollfd fds;
+        if (evInit() || responderLoop(w, 0)) {
+                w->failed = 1;
+                sigintReceived = 1;
+        }
+        __sync_synchronize();
+        w->finished = 1;
+        if (1 != write(w->notifyfd, "d", 1)) {
+                /* pipe full, main thread is awake anyway */
+        }
+        return NULL;
+}
 
-                /* sent all we are going to send, and got all replies
-                 * (either errors or good replies)
-                 */
-                if (options.count
-                    && (sent == options.count)
-                    && (sent == (recvd + recvErrors))) {
-                        break;
+/**
+ * Run n responder threads, and do interval reports, until SIGINT.
+ *
+ * return 0 on success, else exit code
+ */
+static int
+responderThreads(struct Worker *workers, unsigned int n)
+{
+        struct Event evs[MAX_EVENTS];
+        double lastReportTime = startTime;
+        unsigned int c;
+        unsigned int running;
+        int notify[2];
+        int woken = 0;
+        int ret = 0;
+
+        if (pipe(notify) || pipeNonblock(notify) || evAdd(notify[0])) {
+                fprintf(stderr, "%s: notify pipe: %s\n",
+                        argv0, strerror(errno));
+                return 2;
+        }
+        for (c = 0; c < n; c++) {
+                struct Worker *w = &workers[c];
+                w->id = c;
+                w->notifyfd = notify[1];
+                if (pipe(w->wakefd) || pipeNonblock(w->wakefd)) {
+                        fprintf(stderr, "%s: wake pipe: %s\n",
+                                argv0, strerror(errno));
+                        return 2;
                 }
-
-                /* time to send yet? */
-		curPingTime = clock_get_dbl();
-
-                /* if clock is not monotonic and time set backwards
-                 * since last ping, start a new ping cycle */
-                if (curPingTime < lastpingTime) {
-                        lastpingTime = curPingTime - options.interval - 0.001;
+                if (threadStart(w, responderWorker)) {
+                        return 2;
                 }
-
-		if (curPingTime > lastpingTime + options.interval) {
-			if (options.count && (curSeq == options.count)) {
-				if (lastRecvTime+options.wait < curPingTime) {
-                                        break;
-                                }
-			} else if (0 <= sendEcho(fd, curSeq++)) {
-                                sent++;
-                                lastpingTime = curPingTime;
-                                if (options.flood) {
-                                        printf(".");
-                                        fflush(stdout);
-                                }
-			}
-		}
-
-		fds.fd = fd;
-		fds.events = POLLIN;
-		fds.revents = 0;
-
-                /* max waittime: until it's time to send the next one */
-                timewait = lastpingTime+options.interval - clock_get_dbl();
-
-                /* never wait more than an interval. this can happen if
-                 * clock is not monotonic */
-                if (timewait > options.interval) {
-                        timewait = options.interval;
+        }
+        for (running = n; running; ) {
+                double now = clock_get_dbl();
+                double timewait = 1.0;
+                char buf[64];
+
+                if (sigintReceived && !woken) {
+                        for (c = 0; c < n; c++) {
+                                workerWake(&workers[c]);
+                        }
+                        woken = 1;
                 }
+                if (sigquitReceived
+                    || (options.report
+                        && now >= lastReportTime + options.report)) {
+                        sigquitReceived = 0;
+                        responderReport(workers, n, now - lastReportTime, 0);
+                        lastReportTime = now;
+                }
+                if (options.report) {
+                        timewait = lastReportTime + options.report - now;
+                        if (timewait < 0) {
+                                timewait = 0;
+                        }
+                }
+                running = 0;
+                for (c = 0; c < n; c++) {
+                        running += !workers[c].finished;
+                }
+                if (running && 0 < evWait(evs, MAX_EVENTS, timewait)) {
+                        while (0 < read(notify[0], buf, sizeof(buf)));
+                }
+        }
+        for (c = 0; c < n; c++) {
+                threadJoin(&workers[c]);
+                close(workers[c].wakefd[0]);
+                close(workers[c].wakefd[1]);
+                if (workers[c].failed) {
+                        ret = 2;
+                }
+        }
+        evDel(notify[0]);
+        close(notify[0]);
+        close(notify[1]);
+        return ret;
+}
+#endif
 
-                /* this should never happen, should have been taken care of
-                 * above. */
-		if (timewait < 0) {
-			timewait = 0;
-		}
-
-                /* leave room for overhead */
-                timewait *= 0.5;
+/**
+ * Responder mode (-L): answer echo requests instead of sending them, with
+ * -j threads.
+ *
+ * return exit code
+ */
+static int
+responderMainloop()
+{
+        struct Worker *workers;
+        unsigned int n = options.threads;
+        int ret;
 
-		switch ((n = poll(&fds, 1, (int)(timewait * 1000)))) {
-		case 1: /* read ready */
-			if (fds.revents & POLLERR) {
-                                if (handleRecvErr(fd, NULL, 0)) {
-                                        recvErrors++;
-                                }
-			}
-			if (fds.revents & POLLIN) {
-				n = recvEchoReply(fd);
-                                if (!n) {
-                                        recvd++;
-                                        lastRecvTime = clock_get_dbl();
-                                } else if (n > 0) {
-                                        /* still ok, but no reply */
-                                } else { /* n < 0 */
-                                        return 1;
-                                }
-			}
-			break;
-		case 0: /* timeout */
-			break;
-		case -1: /* error */
-			switch (errno) {
-			case EINTR:
-			case EAGAIN:
-				break;
-			default:
-				fprintf(stderr, "%s: poll([%d], 1, %d): %s\n",
-					argv0,
-					fd,
-					(int)(timewait*1000),
-					strerror(errno));
-				exit(2);
-			}
-			break;
-		default: /* can't happen */
-			fprintf(stderr, "%s: poll() returned %d!\n", argv0, n);
-			exit(2);
-			break;
-		}
+        if (!(workers = calloc(n, sizeof(struct Worker)))) {
+                int err = errno;
+                fprintf(stderr, "%s: calloc(%u workers): %s\n",
+                        argv0, n, strerror(err));
+                return 2;
+        }
+        printf("GTPING responder on %s port %s, %u thread%s\n",
+               options.source ? options.source : "any", options.port,
+               n, n == 1 ? "" : "s");
+        fflush(stdout);
 
-	}
-	printf("\n--- %s GTP ping statistics ---\n"
-               "%u packets transmitted, %u received, "
-               "%d%% packet loss, "
-               "time %dms\n"
-               "%u out of order, %u dups, "
-               "%u connection refused",
-	       options.target,
-               sent, recvd,
-	       (int)((100.0*(sent-recvd))/(sent?sent:1)),
-               (int)(1000*(clock_get_dbl()-startTime)),
-               reorder, dups,
-               connectionRefused);
-        errInspectionPrintSummary();
-        printf("\n");
-	if (totalTimeCount) {
-		printf("rtt min/avg/max/mdev = %.3f/%.3f/%.3f/%.3f ms",
-		       1000*totalMin,
-		       1000*(totalTime / totalTimeCount),
-		       1000*totalMax,
-		       1000*sqrt((totalTimeSquared -
-				  (totalTime * totalTime)
-				  /totalTimeCount)/totalTimeCount));
-	}
-	printf("\n");
-	return recvd == 0;
+	startTime = clock_get_dbl();
+        if (n < 2) {
+                workers->wakefd[0] = workers->wakefd[1] = -1;
+                ret = responderLoop(workers, 1);
+        } else {
+#ifdef HAVE_THREADS
+                ret = responderThreads(workers, n);
+#else
+                ret = 2;
+#endif
+        }
+        responderReport(workers, n, clock_get_dbl() - startTime, 1);
+        free(workers);
+        return ret;
 }
 
 /**
@@ -1302,31 +3944,64 @@ argv0lenSpaces()
 static void
 usage(int err)
 {
+	printf("GTPing %s\n", version);
         printf("Usage: %s "
-               "[ -46hfvV ] "
+               "[ -46hfkLSvV ] "
+               "[ -b <num> ] "
                "[ -c <count> ] "
+               "[ -e <[addr:]port> ] "
                "[ -i <time> ] "
+               "[ -I <time> ] "
+               "[ -j <num> ] "
+               "[ -l <list> ] "
+               "[ -m <num> ] "
                "\n       %s "
+               "[ -M <flows> ] "
+               "[ -o <format> ] "
                "[ -p <port> ] "
                "[ -P <port> ] "
                "[ -Q <dscp> ] "
                "[ -r[<perhop>] ] "
+               "[ -R[<perhop>] ] "
                "\n       %s "
                "[ -s <source> ] "
                "[ -t <teid> ] "
                "[ -T <ttl> ] "
                "\n       %s "
                "[ -w <time> ] "
-               "<target>\n"
+               "[ -F <file> | <target> ... ]\n"
                "\t-4               Force IPv4 (default: auto-detect)\n"
                "\t-6               Force IPv6 (default: auto-detect)\n"
+               "\t-b <num>         Send num pings per target each interval,\n"
+               "\t                 batched in one syscall (default: %u)\n"
                "\t-c <count>       Stop after sending count pings "
                "(default: 0=Infinite)\n"
+               "\t-e <[addr:]port> Serve Prometheus metrics over HTTP\n"
+               "\t                 (default addr: 127.0.0.1)\n"
                "\t-f               Flood ping mode (limit with -i)\n"
+               "\t-F <file>        Read targets from file, one per line\n"
                "\t-h, --help       Show this help text\n"
                "\t-g <version>     Set GTP version (default: %u)\n"
                "\t-i <time>        Time between pings in seconds "
                "(default: %.1f)\n"
+               "\t-I <time>        Print interval statistics every "
+               "<time> seconds,\n"
+               "\t                 and on SIGQUIT (default: only SIGQUIT)\n"
+               "\t-j <num>         Worker threads, each with its own "
+               "sockets (default: 1)\n"
+               "\t-k               Use kernel timestamps for RTT. "
+               "Twice for hardware.\n"
+               "\t-l <list>        RTT percentiles to report "
+               "(default: %s)\n"
+               "\t-L               Responder mode: answer pings on -p, "
+               "with -j threads\n"
+               "\t-m <num>         Max pings in flight per target "
+               "(default: from -i and -w)\n"
+               "\t-M <flows>       Multipath traceroute with -R, "
+               "flows from as many\n"
+               "\t                 source ports (default: 1)\n"
+               "\t-o <format>      Output format: text, json or csv "
+               "(default: text)\n"
                "\t-p <port>        GTP-C UDP port to ping (default: %s)\n"
                "\t                 GTP-C is 2123, GTP-U is port 2152, "
                "GTP' is port 3386.\n"
@@ -1338,8 +4013,13 @@ usage(int err)
                "(default: %d)\n"
                "\t                 Traceroute will only work correctly "
                "on Linux.\n"
+               "\t-R[<perhop>]     Parallel traceroute. All probes at once, "
+               "-T is max TTL\n"
+               "\t                 (default: %d)\n"
                "\t-s <source>      Use this source address or interface\n"
                "\t                 Interface name will not work on all OSs\n"
+               "\t-S               Print time spent per stage at exit "
+               "and on SIGQUIT\n"
                "\t-t <teid>        Transaction ID "
                "(default: not present or 0)\n"
                "\t-T <ttl>         IP TTL (default: system default)\n"
@@ -1355,10 +4035,13 @@ usage(int err)
                argv0lenSpaces(),
                argv0lenSpaces(),
                argv0lenSpaces(),
+               DEFAULT_BATCH,
                DEFAULT_GTPVERSION,
                DEFAULT_INTERVAL,
+               DEFAULT_PERCENTILES,
                DEFAULT_PORT,
                DEFAULT_TRACEROUTEHOPS,
+               DEFAULT_TRACEROUTEMAXTTL,
                DEFAULT_VERBOSE,
                DEFAULT_WAIT);
         exit(err);
@@ -1370,6 +4053,7 @@ usage(int err)
 static void
 printVersion()
 {
+	printf("GTPing %s\n", version);
         printf("Copyright (C) 2008-2010 Thomas Habets <thomas@habets.se>\n"
                "License GPLv2: GNU GPL version 2 or later "
                "<http://gnu.org/licenses/gpl-2.0.html>\n"
@@ -1380,6 +4064,114 @@ printVersion()
 }
 
 
+/**
+ * Add a target to be pinged. Name is not copied.
+ *
+ * return 0 on success, <0 (-errno) on error
+ */
+static int
+addTarget(const char *name)
+{
+        struct Target *t;
+
+        if (!(t = realloc(targets, (numTargets + 1) * sizeof(*targets)))) {
+                int err = errno;
+                fprintf(stderr, "%s: realloc(%u targets): %s\n",
+                        argv0, numTargets + 1, strerror(err));
+                return -err;
+        }
+        targets = t;
+        t = &targets[numTargets++];
+        memset(t, 0, sizeof(*t));
+        t->name = name;
+        t->fd = -1;
+        t->count = options.count;
+        t->totalMin = -1;
+        t->totalMax = -1;
+        return 0;
+}
+
+/**
+ * Read targets from file, one per line. Empty lines and everything
+ * after '#' is ignored.
+ *
+ * return 0 on success, <0 (-errno) on error
+ */
+static int
+readTargetFile(const char *fn)
+{
+        FILE *f;
+        char line[NI_MAXHOST];
+        int err = 0;
+
+        if (!(f = fopen(fn, "r"))) {
+                err = errno;
+                fprintf(stderr, "%s: fopen(%s): %s\n",
+                        argv0, fn, strerror(err));
+                return -err;
+        }
+        while (fgets(line, sizeof(line), f)) {
+                char *name;
+                char *p;
+
+                if ((p = strchr(line, '#'))) {
+                        *p = 0;
+                }
+                for (name = line; isspace((unsigned char)*name); name++);
+                for (p = name; *p && !isspace((unsigned char)*p); p++);
+                *p = 0;
+                if (!*name) {
+                        continue;
+                }
+                if (!(name = strdup(name))) {
+                        err = -errno;
+                        fprintf(stderr, "%s: strdup(): %s\n",
+                                argv0, strerror(errno));
+                        break;
+                }
+                if ((err = addTarget(name))) {
+                        break;
+                }
+        }
+        fclose(f);
+        return err;
+}
+
+/**
+ * Parse comma separated list of percentiles into options.
+ *
+ * return 0 on success, -1 on error.
+ */
+static int
+parsePercentiles(const char *str)
+{
+        const char *p = str;
+        char *end;
+        double d;
+
+        options.numPercentiles = 0;
+        for (;;) {
+                d = strtod(p, &end);
+                if (end == p || d < 0 || d > 100
+                    || (*end && *end != ',')) {
+                        fprintf(stderr, "%s: invalid percentile list \"%s\"\n",
+                                argv0, str);
+                        return -1;
+                }
+                if (options.numPercentiles == MAX_PERCENTILES) {
+                        fprintf(stderr, "%s: max %d percentiles\n",
+                                argv0, MAX_PERCENTILES);
+                        return -1;
+                }
+                options.percentiles[options.numPercentiles++] = d;
+                if (!*end) {
+                        break;
+                }
+                p = end + 1;
+        }
+        return 0;
+}
+
 /**
  * return -1 on error, or 8bit number to put in IP ToS-field.
  */
@@ -1445,11 +4237,8 @@ string2Tos(const char *instr)
 int
 main(int argc, char **argv)
 {
-	int fd;
         int port_set = 0;
 
-	printf("GTPing %s\n", version);
-
 	argv0 = argv[0];
 
         { /* handle GNU options */
@@ -1471,7 +4260,7 @@ main(int argc, char **argv)
                 unsigned int tmpu;
 		while (-1 != (c=getopt(argc,
                                        argv,
-                                       "46c:fhi:g:p:P:Q:r::s:t:T:vVw:"))) {
+                                       "46b:c:e:fF:hki:I:g:j:l:Lm:M:o:p:P:Q:r::R::s:St:T:vVw:"))) {
 			switch(c) {
                         case '4':
                                 options.af = AF_INET;
@@ -1479,9 +4268,22 @@ main(int argc, char **argv)
                         case '6':
                                 options.af = AF_INET6;
                                 break;
+                        case 'b':
+                                options.batch = strtoul(optarg, 0, 0);
+                                if (options.batch < 1) {
+                                        fprintf(stderr,
+                                                "%s: invalid batch size "
+                                                "\"%s\", set to 1\n",
+                                                argv0, optarg);
+                                        options.batch = 1;
+                                }
+                                break;
 			case 'c':
 				options.count = strtoul(optarg, 0, 0);
 				break;
+                        case 'F':
+                                options.targetfile = optarg;
+                                break;
                         case 'f':
                                 options.flood = 1;
                                 /* if interval not alread set, set it to 0 */
@@ -1506,6 +4308,27 @@ main(int argc, char **argv)
 			case 'h':
 				usage(0);
 				break;
+                        case 'j':
+                                options.threads = strtoul(optarg, 0, 0);
+                                if (options.threads < 1
+                                    || options.threads > MAX_THREADS) {
+                                        fprintf(stderr,
+                                                "%s: invalid number of "
+                                                "threads \"%s\". Valid are "
+                                                "1-%d.\n",
+                                                argv0, optarg, MAX_THREADS);
+                                        return 1;
+                                }
+                                break;
+                        case 'e':
+                                options.metrics = optarg;
+                                break;
+                        case 'k':
+                                options.kerneltime++;
+                                break;
+                        case 'm':
+                                options.inflight = strtoul(optarg, 0, 0);
+                                break;
 			case 'p':
 				options.port = optarg;
                                 port_set = 1;
@@ -1516,6 +4339,9 @@ main(int argc, char **argv)
                         case 's':
                                 options.source = optarg;
                                 break;
+                        case 'S':
+                                options.profile = 1;
+                                break;
 			case 't':
 				options.teid = strtoul(optarg, 0, 0);
                                 options.has_teid = 1;
@@ -1535,6 +4361,30 @@ main(int argc, char **argv)
 			case 'i':
 				options.interval = atof(optarg);
 				break;
+                        case 'o':
+                                if (!strcmp(optarg, "text")) {
+                                        options.output = OUTPUT_TEXT;
+                                } else if (!strcmp(optarg, "json")) {
+                                        options.output = OUTPUT_JSON;
+                                } else if (!strcmp(optarg, "csv")) {
+                                        options.output = OUTPUT_CSV;
+                                } else {
+                                        fprintf(stderr,
+                                                "%s: invalid output format "
+                                                "\"%s\". Valid are text, "
+                                                "json and csv.\n",
+                                                argv0, optarg);
+                                        return 1;
+                                }
+                                break;
+                        case 'I':
+                                options.report = atof(optarg);
+                                break;
+                        case 'l':
+                                if (parsePercentiles(optarg)) {
+                                        return 1;
+                                }
+                                break;
 			case 'w':
 				options.wait = atof(optarg);
 				break;
@@ -1551,7 +4401,19 @@ main(int argc, char **argv)
                                 }
                                 break;
                         case 'r':
-                                options.traceroute = 1;
+                                options.traceroute = TRACEROUTE_SERIAL;
+                                if (optarg) {
+                                        options.traceroutehops = atoi(optarg);
+                                }
+                                break;
+                        case 'L':
+                                options.responder = 1;
+                                break;
+                        case 'M':
+                                options.traceflows = strtoul(optarg, 0, 0);
+                                break;
+                        case 'R':
+                                options.traceroute = TRACEROUTE_PARALLEL;
                                 if (optarg) {
                                         options.traceroutehops = atoi(optarg);
                                 }
@@ -1565,6 +4427,9 @@ main(int argc, char **argv)
         if (0 > options.interval) {
                 options.interval = DEFAULT_INTERVAL;
         }
+        if (!options.numPercentiles) {
+                parsePercentiles(DEFAULT_PERCENTILES);
+        }
         if (0 > options.wait) {
                 options.wait = DEFAULT_WAIT;
                 options.autowait = 1;
@@ -1575,25 +4440,145 @@ main(int argc, char **argv)
                 }
         }
 
-	if (optind + 1 != argc) {
+        if (options.targetfile) {
+                if (readTargetFile(options.targetfile)) {
+                        return 1;
+                }
+        } else if (optind == argc && !options.responder) {
 		usage(2);
 	}
+        for (; optind < argc; optind++) {
+                if (addTarget(argv[optind])) {
+                        return 1;
+                }
+        }
+        options.multi = numTargets > 1;
+        if (options.responder
+            && (numTargets || options.traceroute
+                || options.output != OUTPUT_TEXT)) {
+                fprintf(stderr,
+                        "%s: responder mode takes no targets, traceroute "
+                        "or output format\n", argv0);
+                return 1;
+        }
+        if (options.metrics && (options.responder || options.traceroute)) {
+                fprintf(stderr,
+                        "%s: -e only works when pinging, not with "
+                        "responder mode or traceroute\n", argv0);
+                return 1;
+        }
+        if (options.traceflows < 1 || options.traceflows > MAX_TRACEFLOWS) {
+                fprintf(stderr, "%s: -M must be 1-%d\n",
+                        argv0, MAX_TRACEFLOWS);
+                return 1;
+        }
+        if (options.traceflows > 1
+            && options.traceroute != TRACEROUTE_PARALLEL) {
+                fprintf(stderr, "%s: -M only works with -R\n", argv0);
+                return 1;
+        }
+        if (options.traceflows > 1) {
+                char *end;
+                unsigned long port = strtoul(options.source_port, &end, 10);
+                if (*end || port + options.traceflows > 65536) {
+                        fprintf(stderr, "%s: -M needs a numeric -P port "
+                                "with room for %u flows\n",
+                                argv0, options.traceflows);
+                        return 1;
+                }
+        }
+        if (options.traceroute == TRACEROUTE_PARALLEL) {
+                if (options.ttl > 0) {
+                        options.traceroutemaxttl = options.ttl;
+                }
+                if (options.traceroutehops < 1
+                    || (options.traceroutemaxttl * options.traceroutehops
+                        * options.traceflows > MAX_INFLIGHT)) {
+                        fprintf(stderr,
+                                "%s: invalid number of probes per hop: %d\n",
+                                argv0, options.traceroutehops);
+                        return 1;
+                }
+        }
+        if (options.multi && options.traceroute) {
+                fprintf(stderr,
+                        "%s: traceroute only supports one target\n",
+                        argv0);
+                return 1;
+        }
+        if (options.output != OUTPUT_TEXT && options.traceroute) {
+                fprintf(stderr,
+                        "%s: traceroute only supports text output\n",
+                        argv0);
+                return 1;
+        }
+        if (options.threads > 1) {
+#ifndef HAVE_THREADS
+                fprintf(stderr,
+                        "%s: compiled without thread support, -j not "
+                        "supported\n", argv0);
+                return 1;
+#endif
+                if (options.traceroute) {
+                        fprintf(stderr,
+                                "%s: traceroute does not support -j\n",
+                                argv0);
+                        return 1;
+                }
+#ifndef SO_REUSEPORT
+                if (options.responder) {
+                        fprintf(stderr,
+                                "%s: no SO_REUSEPORT, responder mode does "
+                                "not support -j\n", argv0);
+                        return 1;
+                }
+#endif
+                /* all workers would need the same source port, and
+                 * replies would go to whichever socket the kernel
+                 * picks */
+                if (strcmp(options.source_port, "0")) {
+                        fprintf(stderr,
+                                "%s: -P is not supported with -j\n",
+                                argv0);
+                        return 1;
+                }
+        }
+        if (options.output == OUTPUT_TEXT) {
+                printf("GTPing %s\n", version);
+        }
+        outputInit();
 
-	options.target = argv[optind];
-
-	if (SIG_ERR == signal(SIGINT, sigint)) {
-		fprintf(stderr, "%s: signal(SIGINT, ...): %s\n",
-			argv0, strerror(errno));
-		return 1;
-	}
+        if (evInit()
+            || evSignal(SIGINT, sigint)
+            || evSignal(SIGQUIT, sigquit)
+            || (options.metrics && metricsInit(options.metrics))) {
+                return 1;
+        }
+        profileInit();
+        if (options.responder) {
+                return responderMainloop();
+        }
 
-	if (0 > (fd = setupSocket())) {
+        if (options.multi && options.threads < 2) {
+                /* start pinging targets as they are resolved */
+                if (resolveTargetsStart() || targetHashAlloc()) {
+                        return 1;
+                }
+        } else if (resolveTargets()) {
 		return 1;
 	}
+        waitTime = options.wait;
+        mkping();
         if (options.traceroute) {
-                return tracerouteMainloop(fd);
+                if (openSockets()) {
+                        return 1;
+                }
+                if (options.traceroute == TRACEROUTE_PARALLEL) {
+                        return tracerouteParallel();
+                }
+                return tracerouteMainloop(targets->fd);
         } else {
-                return pingMainloop(fd);
+                return pingMainloop();
         }
 }
 
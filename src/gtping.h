@@ -14,6 +14,15 @@
 
 #include "getaddrinfo.h"
 
+/* Worker threads (-j) need thread local storage for the per-shard state
+ * that is otherwise file scope globals. */
+#if defined(HAVE_PTHREAD_CREATE) && defined(HAVE_THREAD_LOCAL)
+# define HAVE_THREADS 1
+# define THREAD_LOCAL __thread
+#else
+# define THREAD_LOCAL
+#endif
+
 /* GTP packet as used with GTP Echo */
 #pragma pack(1)
 struct GtpEchoV1 {
@@ -52,6 +61,10 @@ struct GtpEchoV2 {
         uint16_t spare2;
 };
 #pragma pack()
+union GtpEcho {
+        struct GtpEchoV1 v1;
+        struct GtpEchoV2 v2;
+};
 struct GtpReply {
         int ok;
 
@@ -77,6 +90,285 @@ enum {
         GTPMSG_ECHOREPLY = 2,
 };
 
+/* Pings in flight are tracked in a ring per target. Pings that have
+ * dropped off the ring are old and are considered lost.
+ * Size is a power of two, at most the 16bit GTP sequence number space.
+ */
+#define MIN_INFLIGHT 64
+#define MAX_INFLIGHT 65536
+
+/**
+ * One sent ping, in its target's in-flight ring.
+ */
+struct InFlight {
+        double sendTime;
+        double sendHw;      /* NIC TX timestamp (NIC clock), or 0 */
+        uint32_t seq;       /* full sequence number using this slot */
+        uint32_t replies;   /* >1 means dups */
+};
+
+/* RTT histogram, log-linear like HdrHistogram. Values are in ns.
+ * Values below 2^HIST_SUBBITS are exact, above that each power of two
+ * is split in 2^(HIST_SUBBITS-1) buckets, for < 1/64 relative error.
+ * Values above 2^HIST_MAXBITS ns (~18 minutes) go in the last bucket.
+ */
+#define HIST_SUBBITS 7
+#define HIST_MAXBITS 40
+#define HIST_BUCKETS ((1 << HIST_SUBBITS)                       \
+                      + (HIST_MAXBITS - HIST_SUBBITS)           \
+                      * (1 << (HIST_SUBBITS - 1)))
+
+/**
+ * Fixed size, so memory use doesn't grow with run length.
+ */
+struct Histogram {
+        uint64_t count;
+        uint64_t buckets[HIST_BUCKETS];
+};
+
+/**
+ * Counters since the last interval report (-I). Reset after each report.
+ */
+struct Window {
+        unsigned int sent;
+        unsigned int recvd;
+        unsigned int dups;
+        unsigned int reorder;
+        struct Histogram hist;
+};
+
+/**
+ * One host being pinged, and everything we know about it.
+ */
+struct Target {
+        const char *name;            /* as given on cmdline or in file */
+        char ip[NI_MAXHOST];         /* numeric address */
+        struct sockaddr_storage addr;
+        socklen_t addrlen;
+        int fd;                      /* socket to send from */
+        int resolved;                /* 0 = pending, 1 = ok, <0 = failed */
+
+        unsigned long count;         /* pings to send, 0 = infinite */
+        unsigned int origin;         /* index in main target list (-j) */
+
+        unsigned int curSeq;
+        unsigned int highestSeq;
+        unsigned int sent;
+        unsigned int recvd;
+        unsigned int dups;
+        unsigned int reorder;
+        unsigned int connectionRefused;
+        unsigned int icmpErrors;     /* from the error queue */
+
+        struct InFlight *inflight;   /* RTT data and dup check */
+        unsigned int inflightSize;
+        unsigned int totalTimeCount;
+        double totalTime;
+        double totalTimeSquared;
+        double totalMin;
+        double totalMax;
+        struct Histogram hist;
+        struct Window win;
+        struct Window winDone;       /* win handed over to main thread */
+        double lastRecvTime;
+};
+
+/* max number of packets handed to the kernel in one doSendBatch() */
+#define MAX_SENDBATCH 1024
+
+/**
+ * One packet to send with doSendBatch()
+ */
+struct SendMsg {
+        void *data;
+        size_t len;
+        const struct sockaddr *to; /* NULL if socket is connected */
+        socklen_t tolen;
+        int af;                    /* address family of socket */
+        int ttl;                   /* TTL or hop limit, 0 = socket's */
+};
+
+/* max number of packets received in one doRecvBatch() */
+#define MAX_RECVBATCH 64
+
+/**
+ * One packet received with doRecvBatch()
+ */
+struct RecvMsg {
+        char data[1024];
+        ssize_t len;
+        int ttl;
+        int tos;
+        double rxtime;   /* kernel timestamp (wall clock), or 0 */
+        double rxhw;     /* NIC timestamp (NIC clock), or 0 */
+        struct sockaddr_storage from;
+        socklen_t fromlen;
+};
+
+/**
+ * One error from the error queue, from recvErrDetail().
+ */
+struct RecvErr {
+        int ret;            /* as handleRecvErr() */
+        char from[64];      /* sender address, "" if unknown */
+        char tos[64];       /* "" if unknown */
+        int ttl;            /* return TTL, <0 if unknown */
+        char error[64];
+        char data[64];      /* start of the packet that caused it */
+        size_t len;
+};
+
+/* max events returned by one evWait(), and max fds for poll() backend */
+#define MAX_EVENTS 64
+#define EV_IN  1
+#define EV_ERR 2
+
+/**
+ * One ready fd, from evWait().
+ */
+struct Event {
+        int fd;
+        int events;  /* EV_IN and/or EV_ERR */
+};
+
+/* max seconds to sleep while metrics responses are not fully written */
+#define METRICS_WAIT 0.01
+
+/* if this many rounds behind schedule, skip instead of catching up */
+#define PACER_MAXBURST 100
+
+/**
+ * Send schedule. Round n is due at start + n * interval.
+ */
+struct Pacer {
+        double interval;
+        double nextSend;     /* deadline of next round */
+        double firstSend;
+        double lastSend;
+        unsigned int rounds; /* rounds sent */
+        unsigned int late;   /* rounds sent more than an interval late */
+        unsigned int skipped;/* rounds dropped to get back on schedule */
+};
+
+/**
+ * One name to look up with resolveQueue() or resolveSync().
+ */
+struct Resolve {
+        const char *name;
+        const char *service;
+        struct addrinfo hints;       /* flags, family, socktype, protocol */
+        void *data;                  /* for the caller */
+
+        int err;                     /* getaddrinfo() return value */
+        int syserr;                  /* errno, if err is EAI_SYSTEM */
+        const struct addrinfo *addrs;/* cached, don't free */
+        struct Resolve *next;        /* resolveDone() list */
+};
+
+/* max worker threads (-j) */
+#define MAX_THREADS 256
+
+/**
+ * Stages of the self-profile (-S).
+ */
+enum {
+        PROF_SEND,          /* send syscalls */
+        PROF_RECV,          /* recv syscalls */
+        PROF_PARSE,         /* parseReply() */
+        PROF_STATS,         /* RTT, dup and reorder accounting */
+        PROF_OUTPUT,        /* printing replies */
+        PROF_WAIT,          /* evWait() */
+        PROF_STAGES
+};
+
+struct ProfStage {
+        uint64_t calls;
+        uint64_t items;     /* packets, or events for PROF_WAIT */
+        uint64_t ns;
+};
+
+/**
+ * Self-profile counters of one thread.
+ */
+struct Profile {
+        struct ProfStage stage[PROF_STAGES];
+};
+
+/* Time a stage:
+ *   uint64_t t = PROF_START();
+ *   ...
+ *   PROF_END(PROF_SEND, t, packets);
+ *
+ * Without -S this is a predictable branch on profiling, with no clock
+ * read and no counter written.
+ */
+#define PROF_START() (profiling ? profClock() : 0)
+#define PROF_END(s, t, n) do {                                  \
+                if (profiling) {                                \
+                        struct ProfStage *ps_ = &profile->stage[s]; \
+                        ps_->calls++;                           \
+                        ps_->items += (n);                      \
+                        ps_->ns += profClock() - (t);           \
+                }                                               \
+        } while (0)
+
+/* assumed size of a cache line, for keeping apart data of different threads */
+#define CACHE_LINE 64
+
+/* RTT histogram buckets exported by -e, not counting +Inf */
+#define METRICS_BUCKETS 16
+
+/**
+ * What the exporter (-e) shows of one target. Workers (-j) fill these in
+ * when the main thread asks, so that it never reads their live targets.
+ */
+struct MetricsTarget {
+        unsigned int sent;
+        unsigned int recvd;
+        unsigned int dups;
+        unsigned int reorder;
+        unsigned int connectionRefused;
+        unsigned int icmpErrors;
+        double rttSum;                /* seconds */
+        uint64_t rttCount;
+        uint64_t rttBuckets[METRICS_BUCKETS];  /* cumulative */
+};
+
+/**
+ * One worker thread (-j) and its shard of the targets.
+ *
+ * Counters and windows are only written by the worker. The main thread
+ * asks for the window with reportWant, and may read winDone of all the
+ * worker's targets once reportDone has caught up.
+ */
+struct Worker {
+        unsigned int id;
+        struct Target *targets;
+        unsigned int numTargets;
+        double start;                 /* first round */
+        double interval;              /* between rounds */
+        int wakefd[2];                /* main thread -> worker */
+        int notifyfd;                 /* worker -> main thread */
+        volatile unsigned int reportWant;
+        volatile unsigned int reportDone;
+        volatile unsigned int metricsWant;
+        volatile unsigned int metricsDone;
+        struct MetricsTarget *metrics; /* per target, for -e */
+        volatile int finished;
+        volatile int failed;
+        unsigned int sent;
+        unsigned int recvd;
+        unsigned int bad;             /* responder: not echo requests */
+        struct Pacer pacer;
+        /* written by the worker on every packet with -S. Padded so that
+         * it shares no cache line with the fields the main thread polls,
+         * or with the next worker. */
+        char profilePad[CACHE_LINE];
+        struct Profile profile;
+        char profilePadEnd[CACHE_LINE];
+        void *thread;                 /* threads_*.c private */
+};
+
 /**
  * options
  */
@@ -86,24 +378,52 @@ enum {
 #define DEFAULT_INTERVAL 1.0
 #define DEFAULT_WAIT 10.0
 #define DEFAULT_TRACEROUTEHOPS 3
+#define DEFAULT_TRACEROUTEMAXTTL 30
+#define MAX_TRACEFLOWS 64
+#define DEFAULT_BATCH 1
+#define DEFAULT_PERCENTILES "50,90,99,99.9"
+#define MAX_PERCENTILES 16
+enum {
+        OUTPUT_TEXT = 0,
+        OUTPUT_JSON,
+        OUTPUT_CSV,
+};
+enum {
+        TRACEROUTE_OFF = 0,
+        TRACEROUTE_SERIAL,    /* -r */
+        TRACEROUTE_PARALLEL,  /* -R */
+};
 struct Options {
         const char *port;
         int verbose;
         int flood;
+        int kerneltime;
+        int output;
+        unsigned int batch;
+        unsigned int inflight;
+        unsigned int threads;
+        double percentiles[MAX_PERCENTILES];
+        unsigned int numPercentiles;
         double interval;
         double wait;
         int autowait;
+        double report;
         unsigned long count;
         int has_teid;
         uint32_t teid;
-        const char *target;
-        char *targetip;
+        const char *targetfile;
+        int multi;
         int ttl;
         int tos;
         int af;
         unsigned int version;
         int traceroute;
         int traceroutehops;
+        int traceroutemaxttl;
+        unsigned int traceflows;
+        int responder;
+        int profile;
+        const char *metrics;          /* -e listen address, or NULL */
         const char *source;
         const char *source_port;
 };
@@ -111,15 +431,80 @@ struct Options {
 extern struct Options options;
 extern const char *argv0;
 
-ssize_t doRecv(int sock, void *data, size_t len, int *ttl, int *tos);
+int doSendBatch(int sock, const struct SendMsg *msgs, unsigned int n);
+ssize_t doRecv(int sock, struct RecvMsg *m);
+void parseCmsg(struct msghdr *msgh, struct RecvMsg *m);
+int doRecvBatch(int sock, struct RecvMsg *msgs, unsigned int n);
 
 void errInspectionPrintSummary();
+unsigned int errInspectionCount();
+void errInspectionForEach(void (*fn)(void *arg, const char *from,
+                                    const char *origin, int type, int code,
+                                    const char *error, unsigned int count),
+                          void *arg);
+void errInspectionReport(int interval);
 void errInspectionInit(int fd, const struct addrinfo *addrs);
 int handleRecvErr(int fd, const char *reason, double lastPingTime);
+unsigned int handleRecvErrs(int fd, unsigned int max, int *more);
+int recvErrDetail(int fd, struct RecvErr *re, int *empty);
 const char *tos2String(int tos, char *buf, size_t buflen);
 struct addrinfo* getIfAddrs(const struct addrinfo *dest);
 int sockaddrlen(int af);
+void txTimestamp(int fd, uint32_t id, double when, double hw);
+void targetError(const struct sockaddr *dst, int refused);
+void outputInit();
+void outputFlush(double now);
+void outputReply(const struct Target *t, uint32_t seq, double rtt,
+                 int ttl, int tos, int isDup, int isReorder);
+void outputError(const char *from, int ttl, int tos, double rtt,
+                 const char *error);
+void outputInterval(const struct Target *t, double elapsed);
+void outputErrorStat(int interval, const char *from, const char *origin,
+                     int type, int code, int err, const char *error,
+                     unsigned int count);
+void outputSummary(const struct Target *t, double elapsed);
+void outputPacing(unsigned int rounds, double requested, double achieved,
+                  unsigned int late, unsigned int skipped);
+int evInit();
+int evAdd(int fd);
+int evDel(int fd);
+void evRearm(int fd);
+int evSignal(int sig, void (*handler)(int));
+int evWait(struct Event *evs, int max, double timeout);
+int timerCreate();
+int timerSet(int fd, double when);
+void timerAck(int fd);
+void histAdd(struct Histogram *h, double seconds);
+double histPercentile(const struct Histogram *h, double pct);
+void histMerge(struct Histogram *dst, const struct Histogram *src);
+void histCumulative(const struct Histogram *h, const double *limits,
+                    unsigned int n, uint64_t *counts);
+int resolveInit();
+int resolveFd();
+int resolveQueue(struct Resolve *r);
+struct Resolve *resolveDone(int block);
+int resolveSync(struct Resolve *r);
+int threadStart(struct Worker *w, void *(*fn)(void*));
+int threadJoin(struct Worker *w);
 double clock_get_dbl();
+double clock_get_real_dbl();
+
+extern int profiling;
+uint64_t profClock();
+extern THREAD_LOCAL struct Profile *profile;
+void profileInit();
+void profileAdd(struct Profile *p);
+void profileReport();
+int metricsInit(const char *spec);
+int metricsOwns(int fd);
+int metricsRead(int fd);
+void metricsSnapshot(const struct Target *t, struct MetricsTarget *m);
+void metricsMerge(struct MetricsTarget *dst, const struct MetricsTarget *src);
+void metricsRespond(const struct Target *targets,
+                    const struct MetricsTarget *m, unsigned int n,
+                    double uptime);
+void metricsFlush();
+int metricsBusy();
 
 /* ---- Emacs Variables ----
  * Local Variables:
@@ -0,0 +1,156 @@
+/** gtping/src/histogram.c
+ *
+ *  By Thomas Habets <thomas@habets.se> 2009
+ *
+ * Fixed memory log-linear RTT histogram, for percentiles.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "gtping.h"
+
+#define HIST_HALF (1 << (HIST_SUBBITS - 1))
+
+/**
+ * Index of the highest bit set. v must be nonzero.
+ */
+static int
+msb(uint64_t v)
+{
+        int ret = 0;
+        while (v >>= 1) {
+                ret++;
+        }
+        return ret;
+}
+
+/**
+ * Bucket index for value v (ns).
+ */
+static unsigned int
+histIndex(uint64_t v)
+{
+        int m;
+
+        if (v < (1 << HIST_SUBBITS)) {
+                return v;
+        }
+        m = msb(v);
+        if (m >= HIST_MAXBITS) {
+                return HIST_BUCKETS - 1;
+        }
+        return (1 << HIST_SUBBITS)
+                + (m - HIST_SUBBITS) * HIST_HALF
+                + ((v >> (m - HIST_SUBBITS + 1)) - HIST_HALF);
+}
+
+/**
+ * Middle of the range of values (ns) in bucket i.
+ */
+static double
+histValue(unsigned int i)
+{
+        unsigned int e;
+        uint64_t lo;
+
+        if (i < (1 << HIST_SUBBITS)) {
+                return i;
+        }
+        i -= 1 << HIST_SUBBITS;
+        e = i / HIST_HALF + 1;
+        lo = (uint64_t)(HIST_HALF + i % HIST_HALF) << e;
+        return lo + ((uint64_t)1 << e) / 2.0;
+}
+
+/**
+ *
+ */
+void
+histAdd(struct Histogram *h, double seconds)
+{
+        uint64_t ns;
+
+        if (seconds < 0) {
+                seconds = 0;
+        }
+        ns = seconds * 1000000000.0;
+        h->buckets[histIndex(ns)]++;
+        h->count++;
+}
+
+/**
+ * Add all values in src to dst.
+ */
+void
+histMerge(struct Histogram *dst, const struct Histogram *src)
+{
+        unsigned int c;
+
+        if (!src->count) {
+                return;
+        }
+        for (c = 0; c < HIST_BUCKETS; c++) {
+                dst->buckets[c] += src->buckets[c];
+        }
+        dst->count += src->count;
+}
+
+/**
+ * return value at percentile pct (0-100), in seconds. 0 if empty.
+ */
+double
+histPercentile(const struct Histogram *h, double pct)
+{
+        uint64_t want;
+        uint64_t seen = 0;
+        unsigned int c;
+
+        if (!h->count) {
+                return 0;
+        }
+        want = (pct / 100.0) * h->count + 0.5;
+        if (want < 1) {
+                want = 1;
+        }
+        if (want > h->count) {
+                want = h->count;
+        }
+        for (c = 0; c < HIST_BUCKETS; c++) {
+                seen += h->buckets[c];
+                if (seen >= want) {
+                        return histValue(c) / 1000000000.0;
+                }
+        }
+        return histValue(HIST_BUCKETS - 1) / 1000000000.0;
+}
+
+/**
+ * Count values at or below each of the n limits (seconds, ascending) into
+ * counts[], as cumulative buckets for the exporter. A bucket of the
+ * histogram goes by its middle value.
+ */
+void
+histCumulative(const struct Histogram *h, const double *limits,
+               unsigned int n, uint64_t *counts)
+{
+        uint64_t seen = 0;
+        unsigned int c, l = 0;
+
+        for (c = 0; c < HIST_BUCKETS && l < n; c++) {
+                while (l < n && histValue(c) > limits[l] * 1000000000.0) {
+                        counts[l++] = seen;
+                }
+                seen += h->buckets[c];
+        }
+        while (l < n) {
+                counts[l++] = seen;
+        }
+}
+
+/* ---- Emacs Variables ----
+ * Local Variables:
+ * c-basic-offset: 8
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,659 @@
+/** gtping/src/metrics.c
+ *
+ *  By Thomas Habets <thomas@habets.se> 2010
+ *
+ * Prometheus exporter (-e). Per-target counters and RTT histograms are
+ * served in the Prometheus text format over a minimal HTTP/1.0 listener.
+ *
+ * The sockets are non-blocking and in the main thread's event loop, so
+ * a scrape never holds up sending. metricsRead() collects requests,
+ * metricsRespond() renders the answer for all clients with a complete
+ * request, and metricsFlush() writes what the socket takes, to be called
+ * again while metricsBusy().
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "gtping.h"
+
+/* max scrapes served at the same time */
+#define METRICS_MAXCLIENTS 16
+
+/* longest HTTP request header read */
+#define METRICS_MAXREQUEST 2048
+
+/* seconds a client may take to send its request and read the answer */
+#define METRICS_TIMEOUT 10
+
+#define METRICS_DEFAULT_ADDR "127.0.0.1"
+
+/* a scraper going away mid-response must not kill us with SIGPIPE */
+#ifdef MSG_NOSIGNAL
+#define METRICS_SENDFLAGS MSG_NOSIGNAL
+#else
+#define METRICS_SENDFLAGS 0
+#endif
+
+/**
+ * One HTTP connection.
+ */
+struct MetricsClient {
+        int fd;                      /* -1 if slot is free */
+        double since;                /* when accepted */
+        char req[METRICS_MAXREQUEST];
+        size_t reqlen;
+        int ready;                   /* whole request read */
+        char *out;                   /* response, NULL until rendered */
+        size_t outlen;
+        size_t outpos;
+};
+
+/**
+ * Growing output buffer.
+ */
+struct MetricsBuf {
+        char *data;
+        size_t len;
+        size_t size;
+        int failed;                  /* out of memory */
+};
+
+/* RTT histogram bucket limits, seconds */
+static const double rttLimits[METRICS_BUCKETS] = {
+        0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025,
+        0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10,
+};
+
+static int listenfd = -1;
+static struct MetricsClient clients[METRICS_MAXCLIENTS];
+
+/**
+ *
+ */
+static void
+bufPrintf(struct MetricsBuf *b, const char *fmt, ...)
+{
+        va_list ap;
+        int n;
+
+        for (;;) {
+                if (b->failed) {
+                        return;
+                }
+                va_start(ap, fmt);
+                n = vsnprintf(b->data + b->len, b->size - b->len, fmt, ap);
+                va_end(ap);
+                if (n < 0) {
+                        b->failed = 1;
+                        return;
+                }
+                if ((size_t)n < b->size - b->len) {
+                        b->len += n;
+                        return;
+                }
+                {
+                        size_t size = (b->size ? b->size * 2 : 16384) + n;
+                        char *p;
+                        if (!(p = realloc(b->data, size))) {
+                                b->failed = 1;
+                                return;
+                        }
+                        b->data = p;
+                        b->size = size;
+                }
+        }
+}
+
+/**
+ * Print s as a label value, escaped.
+ */
+static void
+bufLabel(struct MetricsBuf *b, const char *s)
+{
+        for (; *s; s++) {
+                switch (*s) {
+                case '\\':
+                        bufPrintf(b, "\\\\");
+                        break;
+                case '"':
+                        bufPrintf(b, "\\\"");
+                        break;
+                case '\n':
+                        bufPrintf(b, "\\n");
+                        break;
+                default:
+                        bufPrintf(b, "%c", *s);
+                }
+        }
+}
+
+/**
+ * Print '{target="...",ip="..."' for t, without the closing brace.
+ */
+static void
+bufTarget(struct MetricsBuf *b, const struct Target *t)
+{
+        bufPrintf(b, "{target=\"");
+        bufLabel(b, t->name);
+        bufPrintf(b, "\",ip=\"");
+        bufLabel(b, t->ip);
+        bufPrintf(b, "\"");
+}
+
+/**
+ * One counter per target.
+ */
+static void
+bufCounter(struct MetricsBuf *b, const char *name, const char *help,
+           const struct Target *targets, const struct MetricsTarget *m,
+           unsigned int n, size_t offset)
+{
+        unsigned int c;
+
+        bufPrintf(b, "# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+        for (c = 0; c < n; c++) {
+                if (targets[c].resolved <= 0) {
+                        continue;
+                }
+                bufPrintf(b, "%s", name);
+                bufTarget(b, &targets[c]);
+                bufPrintf(b, "} %u\n",
+                          *(const unsigned int*)((const char*)&m[c]
+                                                 + offset));
+        }
+}
+
+/**
+ * errInspectionForEach() callback.
+ */
+static void
+bufError(void *arg, const char *from, const char *origin, int type,
+         int code, const char *error, unsigned int count)
+{
+        struct MetricsBuf *b = arg;
+
+        bufPrintf(b, "gtping_errors_total{from=\"");
+        bufLabel(b, from);
+        bufPrintf(b, "\",origin=\"%s\",type=\"%d\",code=\"%d\",error=\"",
+                  origin, type, code);
+        bufLabel(b, error);
+        bufPrintf(b, "\"} %u\n", count);
+}
+
+/**
+ * Render all metrics.
+ */
+static void
+render(struct MetricsBuf *b, const struct Target *targets,
+       const struct MetricsTarget *m, unsigned int n, double uptime)
+{
+        unsigned int c, l;
+
+        bufCounter(b, "gtping_sent_total", "Echo requests sent.",
+                   targets, m, n, offsetof(struct MetricsTarget, sent));
+        bufCounter(b, "gtping_received_total",
+                   "Echo replies received, not counting duplicates.",
+                   targets, m, n, offsetof(struct MetricsTarget, recvd));
+        bufCounter(b, "gtping_duplicates_total",
+                   "Duplicate echo replies received.",
+                   targets, m, n, offsetof(struct MetricsTarget, dups));
+        bufCounter(b, "gtping_reordered_total",
+                   "Echo replies received out of order.",
+                   targets, m, n, offsetof(struct MetricsTarget, reorder));
+        bufCounter(b, "gtping_connection_refused_total",
+                   "Pings answered with port unreachable.",
+                   targets, m, n,
+                   offsetof(struct MetricsTarget, connectionRefused));
+        bufCounter(b, "gtping_icmp_errors_total",
+                   "ICMP and local errors caused by pings.",
+                   targets, m, n, offsetof(struct MetricsTarget, icmpErrors));
+
+        bufPrintf(b, "# HELP gtping_rtt_seconds Round trip time.\n"
+                  "# TYPE gtping_rtt_seconds histogram\n");
+        for (c = 0; c < n; c++) {
+                const struct Target *t = &targets[c];
+                if (t->resolved <= 0) {
+                        continue;
+                }
+                for (l = 0; l < METRICS_BUCKETS; l++) {
+                        bufPrintf(b, "gtping_rtt_seconds_bucket");
+                        bufTarget(b, t);
+                        bufPrintf(b, ",le=\"%g\"} %llu\n", rttLimits[l],
+                                  (unsigned long long)m[c].rttBuckets[l]);
+                }
+                bufPrintf(b, "gtping_rtt_seconds_bucket");
+                bufTarget(b, t);
+                bufPrintf(b, ",le=\"+Inf\"} %llu\n",
+                          (unsigned long long)m[c].rttCount);
+                bufPrintf(b, "gtping_rtt_seconds_sum");
+                bufTarget(b, t);
+                bufPrintf(b, "} %.9f\n", m[c].rttSum);
+                bufPrintf(b, "gtping_rtt_seconds_count");
+                bufTarget(b, t);
+                bufPrintf(b, "} %llu\n", (unsigned long long)m[c].rttCount);
+        }
+
+        bufPrintf(b, "# HELP gtping_errors_total "
+                  "Errors from the error queue, by sender and kind.\n"
+                  "# TYPE gtping_errors_total counter\n");
+        errInspectionForEach(bufError, b);
+
+        bufPrintf(b, "# HELP gtping_uptime_seconds "
+                  "Time since pinging started.\n"
+                  "# TYPE gtping_uptime_seconds gauge\n"
+                  "gtping_uptime_seconds %.3f\n", uptime);
+}
+
+/**
+ * Close client connection and free its slot.
+ */
+static void
+clientClose(struct MetricsClient *cl)
+{
+        evDel(cl->fd);
+        close(cl->fd);
+        free(cl->out);
+        cl->fd = -1;
+        cl->out = NULL;
+        cl->reqlen = cl->outlen = cl->outpos = 0;
+        cl->ready = 0;
+}
+
+/**
+ * Close connections older than METRICS_TIMEOUT, so idle clients can't
+ * hold all the slots.
+ */
+static void
+clientsExpire(double now)
+{
+        unsigned int c;
+
+        for (c = 0; c < METRICS_MAXCLIENTS; c++) {
+                struct MetricsClient *cl = &clients[c];
+                if (cl->fd >= 0 && now - cl->since > METRICS_TIMEOUT) {
+                        clientClose(cl);
+                }
+        }
+}
+
+/**
+ *
+ */
+static void
+setNonblock(int fd)
+{
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+}
+
+/**
+ * Open the listening socket on spec ("port", "addr:port" or
+ * "[addr]:port", default address 127.0.0.1), in the event loop of the
+ * calling thread.
+ *
+ * return 0 on success, <0 (-errno) on error
+ */
+int
+metricsInit(const char *spec)
+{
+        struct Resolve r;
+        const struct addrinfo *ai;
+        char addr[NI_MAXHOST];
+        const char *port;
+        const char *p;
+        int err;
+        int on = 1;
+        unsigned int c;
+
+        for (c = 0; c < METRICS_MAXCLIENTS; c++) {
+                clients[c].fd = -1;
+        }
+
+        snprintf(addr, sizeof(addr), "%s", METRICS_DEFAULT_ADDR);
+        port = spec;
+        if (*spec == '[' && (p = strstr(spec, "]:"))) {
+                snprintf(addr, sizeof(addr), "%.*s",
+                         (int)(p - spec - 1), spec + 1);
+                port = p + 2;
+        } else if ((p = strrchr(spec, ':'))) {
+                snprintf(addr, sizeof(addr), "%.*s", (int)(p - spec), spec);
+                port = p + 1;
+        }
+
+        memset(&r, 0, sizeof(r));
+        r.name = addr;
+        r.service = port;
+        r.hints.ai_flags = AI_PASSIVE;
+        r.hints.ai_socktype = SOCK_STREAM;
+        r.hints.ai_protocol = IPPROTO_TCP;
+        if ((err = resolveSync(&r))) {
+                fprintf(stderr, "%s: getaddrinfo(%s, %s): %s\n",
+                        argv0, addr, port, gai_strerror(err));
+                return -EINVAL;
+        }
+        err = EADDRNOTAVAIL;
+        for (ai = r.addrs; ai; ai = ai->ai_next) {
+                if (0 > (listenfd = socket(ai->ai_family, ai->ai_socktype,
+                                           ai->ai_protocol))) {
+                        err = errno;
+                        continue;
+                }
+                setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR,
+                           &on, sizeof(on));
+                if (!bind(listenfd, ai->ai_addr, ai->ai_addrlen)
+                    && !listen(listenfd, METRICS_MAXCLIENTS)) {
+                        break;
+                }
+                err = errno;
+                close(listenfd);
+                listenfd = -1;
+        }
+        if (listenfd < 0) {
+                fprintf(stderr, "%s: metrics listener on %s port %s: %s\n",
+                        argv0, addr, port, strerror(err));
+                return -err;
+        }
+#ifndef MSG_NOSIGNAL
+        signal(SIGPIPE, SIG_IGN);
+#endif
+        setNonblock(listenfd);
+        return evAdd(listenfd);
+}
+
+/**
+ * return 1 if fd is the listener or a client connection
+ */
+int
+metricsOwns(int fd)
+{
+        unsigned int c;
+
+        if (listenfd < 0) {
+                return 0;
+        }
+        if (fd == listenfd) {
+                return 1;
+        }
+        for (c = 0; c < METRICS_MAXCLIENTS; c++) {
+                if (clients[c].fd == fd) {
+                        return 1;
+                }
+        }
+        return 0;
+}
+
+/**
+ * Accept new connections.
+ */
+static void
+acceptClients()
+{
+        int fd;
+        unsigned int c;
+
+        while (0 <= (fd = accept(listenfd, NULL, NULL))) {
+                for (c = 0; c < METRICS_MAXCLIENTS; c++) {
+                        if (clients[c].fd < 0) {
+                                break;
+                        }
+                }
+                if (c == METRICS_MAXCLIENTS) {
+                        clientsExpire(clock_get_dbl());
+                        for (c = 0; c < METRICS_MAXCLIENTS; c++) {
+                                if (clients[c].fd < 0) {
+                                        break;
+                                }
+                        }
+                }
+                if (c == METRICS_MAXCLIENTS) {
+                        /* busy, try again later */
+                        close(fd);
+                        continue;
+                }
+                setNonblock(fd);
+                if (evAdd(fd)) {
+                        close(fd);
+                        continue;
+                }
+                clients[c].fd = fd;
+                clients[c].since = clock_get_dbl();
+        }
+}
+
+/**
+ * Read what's there of cl's request.
+ */
+static void
+clientRead(struct MetricsClient *cl)
+{
+        ssize_t n;
+
+        while (!cl->ready) {
+                n = read(cl->fd, cl->req + cl->reqlen,
+                         sizeof(cl->req) - 1 - cl->reqlen);
+                if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+                        return;
+                }
+                if (n <= 0) {
+                        clientClose(cl);
+                        return;
+                }
+                cl->reqlen += n;
+                cl->req[cl->reqlen] = 0;
+                if (strstr(cl->req, "\r\n\r\n") || strstr(cl->req, "\n\n")
+                    || cl->reqlen == sizeof(cl->req) - 1) {
+                        cl->ready = 1;
+                }
+        }
+}
+
+/**
+ * Handle event on fd, which metricsOwns().
+ *
+ * return number of clients waiting for metricsRespond()
+ */
+int
+metricsRead(int fd)
+{
+        unsigned int c;
+        int waiting = 0;
+
+        if (fd == listenfd) {
+                acceptClients();
+        }
+        for (c = 0; c < METRICS_MAXCLIENTS; c++) {
+                struct MetricsClient *cl = &clients[c];
+                if (cl->fd == fd) {
+                        clientRead(cl);
+                }
+                if (cl->fd >= 0 && cl->ready && !cl->out) {
+                        waiting++;
+                }
+        }
+        return waiting;
+}
+
+/**
+ * Take what the exporter shows of t.
+ */
+void
+metricsSnapshot(const struct Target *t, struct MetricsTarget *m)
+{
+        m->sent = t->sent;
+        m->recvd = t->recvd;
+        m->dups = t->dups;
+        m->reorder = t->reorder;
+        m->connectionRefused = t->connectionRefused;
+        m->icmpErrors = t->icmpErrors;
+        m->rttSum = t->totalTime;
+        m->rttCount = t->hist.count;
+        histCumulative(&t->hist, rttLimits, METRICS_BUCKETS, m->rttBuckets);
+}
+
+/**
+ * Add src (a worker's part of a target) to dst.
+ */
+void
+metricsMerge(struct MetricsTarget *dst, const struct MetricsTarget *src)
+{
+        unsigned int c;
+
+        dst->sent += src->sent;
+        dst->recvd += src->recvd;
+        dst->dups += src->dups;
+        dst->reorder += src->reorder;
+        dst->connectionRefused += src->connectionRefused;
+        dst->icmpErrors += src->icmpErrors;
+        dst->rttSum += src->rttSum;
+        dst->rttCount += src->rttCount;
+        for (c = 0; c < METRICS_BUCKETS; c++) {
+                dst->rttBuckets[c] += src->rttBuckets[c];
+        }
+}
+
+/**
+ * Answer all clients that have sent a whole request. Labels are from
+ * targets, numbers from m, or from targets too if m is NULL. uptime is
+ * seconds since pinging started.
+ */
+void
+metricsRespond(const struct Target *targets, const struct MetricsTarget *m,
+               unsigned int n, double uptime)
+{
+        struct MetricsTarget *own = NULL;
+        struct MetricsBuf body;
+        unsigned int c, i;
+
+        memset(&body, 0, sizeof(body));
+        for (c = 0; c < METRICS_MAXCLIENTS; c++) {
+                struct MetricsClient *cl = &clients[c];
+                struct MetricsBuf resp;
+                int found;
+
+                if (cl->fd < 0 || !cl->ready || cl->out) {
+                        continue;
+                }
+                found = !strncmp(cl->req, "GET / ", 6)
+                        || !strncmp(cl->req, "GET /metrics ", 13);
+                if (found && !m && !body.failed) {
+                        if (!(own = malloc(n * sizeof(*own)))) {
+                                body.failed = 1;
+                        } else {
+                                for (i = 0; i < n; i++) {
+                                        metricsSnapshot(&targets[i], &own[i]);
+                                }
+                                m = own;
+                        }
+                }
+                if (found && m && !body.len) {
+                        render(&body, targets, m, n, uptime);
+                }
+
+                memset(&resp, 0, sizeof(resp));
+                if (!found) {
+                        bufPrintf(&resp, "HTTP/1.0 404 Not Found\r\n"
+                                  "Content-Type: text/plain\r\n"
+                                  "Connection: close\r\n\r\n"
+                                  "Not found. Metrics are at /metrics\n");
+                } else if (body.failed) {
+                        bufPrintf(&resp, "HTTP/1.0 500 Out of memory\r\n"
+                                  "Connection: close\r\n\r\n");
+                } else {
+                        bufPrintf(&resp, "HTTP/1.0 200 OK\r\n"
+                                  "Content-Type: text/plain; "
+                                  "version=0.0.4\r\n"
+                                  "Content-Length: %lu\r\n"
+                                  "Connection: close\r\n\r\n",
+                                  (unsigned long)body.len);
+                        bufPrintf(&resp, "%.*s", (int)body.len, body.data);
+                }
+                if (resp.failed) {
+                        free(resp.data);
+                        clientClose(cl);
+                        continue;
+                }
+                cl->out = resp.data;
+                cl->outlen = resp.len;
+                cl->outpos = 0;
+        }
+        free(body.data);
+        free(own);
+        metricsFlush();
+}
+
+/**
+ * Write as much of the pending responses as the sockets take, and close
+ * the connections that are done or timed out.
+ */
+void
+metricsFlush()
+{
+        unsigned int c;
+
+        if (listenfd < 0) {
+                return;
+        }
+        clientsExpire(clock_get_dbl());
+        for (c = 0; c < METRICS_MAXCLIENTS; c++) {
+                struct MetricsClient *cl = &clients[c];
+                ssize_t n;
+
+                if (cl->fd < 0 || !cl->out) {
+                        continue;
+                }
+                while (cl->outpos < cl->outlen) {
+                        n = send(cl->fd, cl->out + cl->outpos,
+                                 cl->outlen - cl->outpos,
+                                 METRICS_SENDFLAGS);
+                        if (n < 0) {
+                                break;
+                        }
+                        cl->outpos += n;
+                }
+                if (cl->outpos == cl->outlen
+                    || (errno != EAGAIN && errno != EINTR)) {
+                        clientClose(cl);
+                }
+        }
+}
+
+/**
+ * return 1 if there are responses not yet fully written
+ */
+int
+metricsBusy()
+{
+        unsigned int c;
+
+        if (listenfd < 0) {
+                return 0;
+        }
+        for (c = 0; c < METRICS_MAXCLIENTS; c++) {
+                if (clients[c].fd >= 0 && clients[c].out) {
+                        return 1;
+                }
+        }
+        return 0;
+}
+
+/* ---- Emacs Variables ----
+ * Local Variables:
+ * c-basic-offset: 8
+ * indent-tabs-mode: nil
+ * End:
+ */
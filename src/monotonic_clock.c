@@ -3,6 +3,8 @@
  *  By Thomas Habets <thomas@habets.se> 2010
  *
  * get monotonic clock with clock_gettime(CLOCK_MONOTONIC,)
+ *
+ * Also get wall clock, for converting kernel packet timestamps.
  */
 #ifdef HAVE_CONFIG_H
 #include "config.h"
@@ -41,6 +43,25 @@ clock_get_dbl()
         return time(0);
 }
 
+/**
+ * Wall clock, in the same timebase as kernel packet timestamps.
+ */
+double
+clock_get_real_dbl()
+{
+        struct timespec ts;
+        struct timeval tv;
+
+        if (!clock_gettime(CLOCK_REALTIME, &ts)) {
+                return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+        }
+        if (!gettimeofday(&tv, NULL)) {
+                return tv.tv_sec + tv.tv_usec / 1000000.0;
+        }
+        fprintf(stderr, "%s: gettimeofday(): %s\n", argv0, strerror(errno));
+        return time(0);
+}
+
 /* ---- Emacs Variables ----
  * Local Variables:
  * c-basic-offset: 8
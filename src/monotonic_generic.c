@@ -30,6 +30,15 @@ clock_get_dbl()
         return tv.tv_sec + tv.tv_usec / 1000000.0;
 }
 
+/**
+ * Wall clock. Same as clock_get_dbl() here.
+ */
+double
+clock_get_real_dbl()
+{
+        return clock_get_dbl();
+}
+
 /* ---- Emacs Variables ----
  * Local Variables:
  * c-basic-offset: 8
@@ -0,0 +1,389 @@
+/** gtping/src/output.c
+ *
+ *  By Thomas Habets <thomas@habets.se> 2009
+ *
+ * Machine readable output (-o json, -o csv). One record per line, and
+ * stdout fully buffered so that at high rates it's one write() per
+ * buffer instead of per reply.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "gtping.h"
+
+/* stdout buffer size in machine readable mode */
+#define OUTPUT_BUFSIZE (1024*1024)
+
+/* flush at least this often (seconds), so readers don't wait forever */
+#define OUTPUT_FLUSH_INTERVAL 1.0
+
+static char *outputBuf = NULL;
+static THREAD_LOCAL double lastFlush = 0;
+
+/**
+ * Print string s as a JSON string, with quotes.
+ */
+static void
+jsonString(const char *s)
+{
+        putchar('"');
+        for (; *s; s++) {
+                if (*s == '"' || *s == '\\') {
+                        putchar('\\');
+                        putchar(*s);
+                } else if ((unsigned char)*s < 0x20) {
+                        printf("\\u%04x", (unsigned char)*s);
+                } else {
+                        putchar(*s);
+                }
+        }
+        putchar('"');
+}
+
+/**
+ * Print string s as a CSV field, quoted if it needs to be.
+ */
+static void
+csvString(const char *s)
+{
+        if (!strpbrk(s, ",\"\r\n")) {
+                fputs(s, stdout);
+                return;
+        }
+        putchar('"');
+        for (; *s; s++) {
+                if (*s == '"') {
+                        putchar('"');
+                }
+                putchar(*s);
+        }
+        putchar('"');
+}
+
+/**
+ * Print percentile header columns for CSV, e.g. ",p50,p90".
+ */
+static void
+csvPercentileHeader()
+{
+        unsigned int c;
+        for (c = 0; c < options.numPercentiles; c++) {
+                printf(",p%g", options.percentiles[c]);
+        }
+}
+
+/**
+ * Print one RTT (seconds, as ms) as a JSON member or CSV column. With
+ * nothing received (have == 0) it's null or an empty column.
+ */
+static void
+printMsField(const char *name, int have, double v)
+{
+        if (options.output == OUTPUT_JSON) {
+                if (have) {
+                        printf(",\"%s\":%.3f", name, 1000 * v);
+                } else {
+                        printf(",\"%s\":null", name);
+                }
+        } else if (have) {
+                printf(",%.3f", 1000 * v);
+        } else {
+                putchar(',');
+        }
+}
+
+/**
+ * Print percentiles (ms) of h, as JSON members or CSV columns.
+ */
+static void
+printPercentileFields(const struct Histogram *h)
+{
+        char name[32];
+        unsigned int c;
+        for (c = 0; c < options.numPercentiles; c++) {
+                snprintf(name, sizeof(name), "p%g", options.percentiles[c]);
+                printMsField(name, h->count != 0,
+                             histPercentile(h, options.percentiles[c]));
+        }
+}
+
+/**
+ * Set up buffering, and print CSV header.
+ */
+void
+outputInit()
+{
+        if (options.output == OUTPUT_TEXT) {
+                return;
+        }
+        if ((outputBuf = malloc(OUTPUT_BUFSIZE))) {
+                setvbuf(stdout, outputBuf, _IOFBF, OUTPUT_BUFSIZE);
+        }
+        if (options.output == OUTPUT_CSV) {
+                printf("# reply,time,target,seq,rtt_ms,ttl,tos,dup,reorder\n"
+                       "# error,time,from,ttl,tos,rtt_ms,error\n"
+                       "# interval,time,target,elapsed,sent,recvd,dups,"
+                       "reorder");
+                csvPercentileHeader();
+                printf("\n# summary,time,target,elapsed,sent,recvd,dups,"
+                       "reorder,refused,min_ms,avg_ms,max_ms,mdev_ms");
+                csvPercentileHeader();
+                printf("\n# pacing,time,rounds,requested_pps,achieved_pps,"
+                       "late,skipped\n"
+                       "# errors,time,scope,from,origin,type,code,errno,"
+                       "error,count\n");
+        }
+}
+
+/**
+ * Flush buffered output if it's been a while.
+ */
+void
+outputFlush(double now)
+{
+        if (options.output == OUTPUT_TEXT) {
+                return;
+        }
+        if (now - lastFlush >= OUTPUT_FLUSH_INTERVAL) {
+                fflush(stdout);
+                lastFlush = now;
+        }
+}
+
+/**
+ * One echo reply. rtt < 0 if it's not a reply to a known ping.
+ * ttl and tos < 0 if unknown.
+ */
+void
+outputReply(const struct Target *t, uint32_t seq, double rtt,
+            int ttl, int tos, int isDup, int isReorder)
+{
+        /* one record per line, even with worker threads */
+        flockfile(stdout);
+        if (options.output == OUTPUT_JSON) {
+                printf("{\"type\":\"reply\",\"time\":%.6f,\"target\":",
+                       clock_get_real_dbl());
+                jsonString(t->name);
+                printf(",\"seq\":%u", seq);
+                if (rtt >= 0) {
+                        printf(",\"rtt_ms\":%.3f", 1000 * rtt);
+                }
+                if (ttl >= 0) {
+                        printf(",\"ttl\":%d", ttl);
+                }
+                if (tos >= 0) {
+                        printf(",\"tos\":%d", tos);
+                }
+                printf(",\"dup\":%s,\"reorder\":%s}\n",
+                       isDup ? "true" : "false",
+                       isReorder ? "true" : "false");
+        } else {
+                printf("reply,%.6f,", clock_get_real_dbl());
+                csvString(t->name);
+                printf(",%u,", seq);
+                if (rtt >= 0) {
+                        printf("%.3f", 1000 * rtt);
+                }
+                putchar(',');
+                if (ttl >= 0) {
+                        printf("%d", ttl);
+                }
+                putchar(',');
+                if (tos >= 0) {
+                        printf("%d", tos);
+                }
+                printf(",%d,%d\n", !!isDup, !!isReorder);
+        }
+        funlockfile(stdout);
+}
+
+/**
+ * One ICMP or local error. from may be NULL, rtt, ttl and tos < 0 if
+ * unknown.
+ */
+void
+outputError(const char *from, int ttl, int tos, double rtt,
+            const char *error)
+{
+        /* one record per line, even with worker threads */
+        flockfile(stdout);
+        if (options.output == OUTPUT_JSON) {
+                printf("{\"type\":\"error\",\"time\":%.6f",
+                       clock_get_real_dbl());
+                if (from) {
+                        printf(",\"from\":");
+                        jsonString(from);
+                }
+                if (ttl >= 0) {
+                        printf(",\"ttl\":%d", ttl);
+                }
+                if (tos >= 0) {
+                        printf(",\"tos\":%d", tos);
+                }
+                if (rtt >= 0) {
+                        printf(",\"rtt_ms\":%.3f", 1000 * rtt);
+                }
+                printf(",\"error\":");
+                jsonString(error);
+                printf("}\n");
+        } else {
+                printf("error,%.6f,", clock_get_real_dbl());
+                csvString(from ? from : "");
+                putchar(',');
+                if (ttl >= 0) {
+                        printf("%d", ttl);
+                }
+                putchar(',');
+                if (tos >= 0) {
+                        printf("%d", tos);
+                }
+                putchar(',');
+                if (rtt >= 0) {
+                        printf("%.3f", 1000 * rtt);
+                }
+                putchar(',');
+                csvString(error);
+                putchar('\n');
+        }
+        funlockfile(stdout);
+}
+
+/**
+ * Stats for t since last interval report.
+ */
+void
+outputInterval(const struct Target *t, double elapsed)
+{
+        const struct Window *w = &t->win;
+
+        if (options.output == OUTPUT_JSON) {
+                printf("{\"type\":\"interval\",\"time\":%.6f,\"target\":",
+                       clock_get_real_dbl());
+                jsonString(t->name);
+                printf(",\"elapsed\":%.3f,\"sent\":%u,\"recvd\":%u,"
+                       "\"dups\":%u,\"reorder\":%u",
+                       elapsed, w->sent, w->recvd, w->dups, w->reorder);
+                printPercentileFields(&w->hist);
+                printf("}\n");
+        } else {
+                printf("interval,%.6f,", clock_get_real_dbl());
+                csvString(t->name);
+                printf(",%.3f,%u,%u,%u,%u",
+                       elapsed, w->sent, w->recvd, w->dups, w->reorder);
+                printPercentileFields(&w->hist);
+                printf("\n");
+        }
+}
+
+/**
+ * One row of the error table: count errors of one kind from one sender,
+ * since last interval report or in total. type and code < 0 if unknown.
+ */
+void
+outputErrorStat(int interval, const char *from, const char *origin,
+                int type, int code, int err, const char *error,
+                unsigned int count)
+{
+        const char *scope = interval ? "interval" : "summary";
+
+        if (options.output == OUTPUT_JSON) {
+                printf("{\"type\":\"errors\",\"time\":%.6f,"
+                       "\"scope\":\"%s\",\"from\":",
+                       clock_get_real_dbl(), scope);
+                jsonString(from);
+                printf(",\"origin\":\"%s\"", origin);
+                if (type >= 0) {
+                        printf(",\"icmp_type\":%d,\"icmp_code\":%d",
+                               type, code);
+                }
+                printf(",\"errno\":%d,\"error\":", err);
+                jsonString(error);
+                printf(",\"count\":%u}\n", count);
+        } else {
+                printf("errors,%.6f,%s,", clock_get_real_dbl(), scope);
+                csvString(from);
+                printf(",%s,", origin);
+                if (type >= 0) {
+                        printf("%d,%d", type, code);
+                } else {
+                        putchar(',');
+                }
+                printf(",%d,", err);
+                csvString(error);
+                printf(",%u\n", count);
+        }
+}
+
+/**
+ * Final stats for t.
+ */
+void
+outputSummary(const struct Target *t, double elapsed)
+{
+        double min = 0, avg = 0, max = 0, mdev = 0;
+
+        if (t->totalTimeCount) {
+                min = t->totalMin;
+                avg = t->totalTime / t->totalTimeCount;
+                max = t->totalMax;
+                mdev = sqrt((t->totalTimeSquared -
+                             (t->totalTime * t->totalTime)
+                             /t->totalTimeCount)/t->totalTimeCount);
+        }
+        if (options.output == OUTPUT_JSON) {
+                printf("{\"type\":\"summary\",\"time\":%.6f,\"target\":",
+                       clock_get_real_dbl());
+                jsonString(t->name);
+                printf(",\"ip\":\"%s\",\"elapsed\":%.3f,\"sent\":%u,"
+                       "\"recvd\":%u,\"dups\":%u,\"reorder\":%u,"
+                       "\"refused\":%u",
+                       t->ip, elapsed, t->sent, t->recvd, t->dups,
+                       t->reorder, t->connectionRefused);
+        } else {
+                printf("summary,%.6f,", clock_get_real_dbl());
+                csvString(t->name);
+                printf(",%.3f,%u,%u,%u,%u,%u",
+                       elapsed, t->sent, t->recvd, t->dups, t->reorder,
+                       t->connectionRefused);
+        }
+        printMsField("min_ms", t->totalTimeCount != 0, min);
+        printMsField("avg_ms", t->totalTimeCount != 0, avg);
+        printMsField("max_ms", t->totalTimeCount != 0, max);
+        printMsField("mdev_ms", t->totalTimeCount != 0, mdev);
+        printPercentileFields(&t->hist);
+        printf(options.output == OUTPUT_JSON ? "}\n" : "\n");
+}
+
+/**
+ * Requested vs achieved send rate. requested is 0 if unlimited.
+ */
+void
+outputPacing(unsigned int rounds, double requested, double achieved,
+             unsigned int late, unsigned int skipped)
+{
+        if (options.output == OUTPUT_JSON) {
+                printf("{\"type\":\"pacing\",\"time\":%.6f,"
+                       "\"rounds\":%u,\"requested_pps\":%.3f,"
+                       "\"achieved_pps\":%.3f,\"late\":%u,"
+                       "\"skipped\":%u}\n",
+                       clock_get_real_dbl(), rounds, requested, achieved,
+                       late, skipped);
+        } else {
+                printf("pacing,%.6f,%u,%.3f,%.3f,%u,%u\n",
+                       clock_get_real_dbl(), rounds, requested, achieved,
+                       late, skipped);
+        }
+}
+
+/* ---- Emacs Variables ----
+ * Local Variables:
+ * c-basic-offset: 8
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,122 @@
+/** gtping/src/profile.c
+ *
+ *  By Thomas Habets <thomas@habets.se> 2010
+ *
+ * Self-profile (-S): where the time goes per packet. Send and recv
+ * syscalls are the kernel, parse, stats and output are gtping, and time
+ * spent waiting for events is the peer (or the pacing).
+ *
+ * Each thread counts into its own struct Profile, found through the
+ * thread local pointer profile. Workers' profiles are registered with
+ * profileAdd() before they start, and profileReport() sums them all.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "gtping.h"
+
+static const char *stageNames[PROF_STAGES] = {
+        "send", "recv", "parse", "stats", "output", "wait",
+};
+
+/* for code not running in a worker */
+static struct Profile mainProfile;
+
+static struct Profile *profiles[MAX_THREADS + 1] = { &mainProfile };
+static unsigned int numProfiles = 1;
+static double profStart;
+
+/* -S given. Checked by PROF_START() and PROF_END(). */
+int profiling = 0;
+THREAD_LOCAL struct Profile *profile = &mainProfile;
+
+/**
+ * Monotonic clock in ns.
+ */
+uint64_t
+profClock()
+{
+        return (uint64_t)(clock_get_dbl() * 1000000000.0);
+}
+
+/**
+ * Start the clock if -S is on. Call before any threads start.
+ */
+void
+profileInit()
+{
+        profStart = clock_get_dbl();
+        profiling = options.profile;
+}
+
+/**
+ * Include p in reports. Call before the thread using it starts.
+ */
+void
+profileAdd(struct Profile *p)
+{
+        if (numProfiles < sizeof(profiles) / sizeof(profiles[0])) {
+                profiles[numProfiles++] = p;
+        }
+}
+
+/**
+ * Print time per stage, summed over all threads, and CPU time used.
+ * Workers may still be running, so it's a snapshot.
+ */
+void
+profileReport()
+{
+        struct ProfStage sum[PROF_STAGES];
+        struct rusage ru;
+        double elapsed = clock_get_dbl() - profStart;
+        unsigned int c, s;
+
+        if (!options.profile) {
+                return;
+        }
+        memset(sum, 0, sizeof(sum));
+        for (c = 0; c < numProfiles; c++) {
+                for (s = 0; s < PROF_STAGES; s++) {
+                        sum[s].calls += profiles[c]->stage[s].calls;
+                        sum[s].items += profiles[c]->stage[s].items;
+                        sum[s].ns += profiles[c]->stage[s].ns;
+                }
+        }
+
+        fprintf(stderr, "\n--- self-profile, %.3f s ---\n"
+                "%-8s %12s %12s %10s %7s %10s %10s\n",
+                elapsed,
+                "stage", "calls", "packets", "total ms", "% time",
+                "ns/call", "ns/packet");
+        for (s = 0; s < PROF_STAGES; s++) {
+                const struct ProfStage *p = &sum[s];
+                fprintf(stderr, "%-8s %12llu %12llu %10.3f %7.2f "
+                        "%10.0f %10.0f\n",
+                        stageNames[s],
+                        (unsigned long long)p->calls,
+                        (unsigned long long)p->items,
+                        p->ns / 1000000.0,
+                        elapsed > 0 ? p->ns / (10000000.0 * elapsed) : 0,
+                        p->calls ? (double)p->ns / p->calls : 0,
+                        p->items ? (double)p->ns / p->items : 0);
+        }
+        if (!getrusage(RUSAGE_SELF, &ru)) {
+                fprintf(stderr, "cpu: user %.3f s, system %.3f s\n",
+                        ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6,
+                        ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6);
+        }
+}
+
+/* ---- Emacs Variables ----
+ * Local Variables:
+ * c-basic-offset: 8
+ * indent-tabs-mode: nil
+ * End:
+ */
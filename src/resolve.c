@@ -0,0 +1,422 @@
+/** gtping/src/resolve.c
+ *
+ *  By Thomas Habets <thomas@habets.se> 2009
+ *
+ * Name lookups, cached for the life of the process.
+ *
+ * resolveQueue() hands names to a pool of resolver threads, so that a long
+ * target list doesn't wait for one slow name at a time. Finished lookups
+ * are picked up with resolveDone(), and resolveFd() becomes readable when
+ * there are any. Without thread support lookups are done in
+ * resolveQueue() itself.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#ifdef HAVE_PTHREAD_CREATE
+#include <pthread.h>
+#endif
+
+#include "gtping.h"
+
+/* cache hash buckets, power of two */
+#define RESOLVE_HASHSIZE 1024
+
+/* max resolver threads */
+#define RESOLVE_THREADS 16
+
+/**
+ * One cached lookup.
+ */
+struct CacheEntry {
+        char *name;
+        char *service;
+        struct addrinfo hints;
+
+        int busy;                   /* being looked up */
+        int done;
+        int err;
+        int syserr;
+        struct addrinfo *addrs;
+
+        struct Resolve *waiters;    /* queued requests for this entry */
+        struct CacheEntry *next;    /* hash chain */
+        struct CacheEntry *qnext;   /* work queue */
+};
+
+static struct CacheEntry *cache[RESOLVE_HASHSIZE];
+static struct Resolve *doneHead = NULL;
+static struct Resolve *doneTail = NULL;
+static unsigned int pending = 0;  /* requests queued but not done */
+static int notify[2] = { -1, -1 };
+
+#ifdef HAVE_THREADS
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t workCond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t doneCond = PTHREAD_COND_INITIALIZER;
+static struct CacheEntry *queueHead = NULL;
+static struct CacheEntry *queueTail = NULL;
+static unsigned int queueLen = 0;
+static unsigned int numThreads = 0;
+static unsigned int idleThreads = 0;
+# define LOCK()   pthread_mutex_lock(&lock)
+# define UNLOCK() pthread_mutex_unlock(&lock)
+#else
+# define LOCK()
+# define UNLOCK()
+#endif
+
+/**
+ *
+ */
+static unsigned int
+hashString(unsigned int h, const char *s)
+{
+        for (; s && *s; s++) {
+                h = h * 31 + (unsigned char)*s;
+        }
+        return h;
+}
+
+/**
+ * NULL-safe strcmp() == 0
+ */
+static int
+strEqual(const char *a, const char *b)
+{
+        if (!a || !b) {
+                return a == b;
+        }
+        return !strcmp(a, b);
+}
+
+/**
+ * Find cache entry for r, or create an empty one. Called with lock held.
+ *
+ * return NULL on out of memory
+ */
+static struct CacheEntry *
+cacheGet(const struct Resolve *r)
+{
+        struct CacheEntry *e;
+        unsigned int h;
+
+        h = hashString(hashString(r->hints.ai_family * 7
+                                  + r->hints.ai_flags,
+                                  r->name),
+                       r->service) & (RESOLVE_HASHSIZE - 1);
+        for (e = cache[h]; e; e = e->next) {
+                if (strEqual(e->name, r->name)
+                    && strEqual(e->service, r->service)
+                    && e->hints.ai_flags == r->hints.ai_flags
+                    && e->hints.ai_family == r->hints.ai_family
+                    && e->hints.ai_socktype == r->hints.ai_socktype
+                    && e->hints.ai_protocol == r->hints.ai_protocol) {
+                        return e;
+                }
+        }
+        if (!(e = calloc(1, sizeof(struct CacheEntry)))) {
+                return NULL;
+        }
+        if ((r->name && !(e->name = strdup(r->name)))
+            || (r->service && !(e->service = strdup(r->service)))) {
+                free(e->name);
+                free(e);
+                return NULL;
+        }
+        e->hints.ai_flags = r->hints.ai_flags;
+        e->hints.ai_family = r->hints.ai_family;
+        e->hints.ai_socktype = r->hints.ai_socktype;
+        e->hints.ai_protocol = r->hints.ai_protocol;
+        e->next = cache[h];
+        cache[h] = e;
+        return e;
+}
+
+/**
+ * Copy result of e into r.
+ */
+static void
+cacheCopy(const struct CacheEntry *e, struct Resolve *r)
+{
+        r->err = e->err;
+        r->syserr = e->syserr;
+        r->addrs = e->addrs;
+}
+
+/**
+ * Do the lookup for e. Called without lock held.
+ */
+static void
+cacheLookup(struct CacheEntry *e, int *err, int *syserr,
+            struct addrinfo **addrs)
+{
+        *addrs = NULL;
+        *syserr = 0;
+        if ((*err = getaddrinfo(e->name, e->service, &e->hints, addrs))) {
+                *syserr = errno;
+                *addrs = NULL;
+        }
+}
+
+/**
+ * Store result in e, and move its waiters to the done list. Called with
+ * lock held.
+ */
+static void
+cacheDone(struct CacheEntry *e, int err, int syserr, struct addrinfo *addrs)
+{
+        struct Resolve *r;
+
+        e->err = err;
+        e->syserr = syserr;
+        e->addrs = addrs;
+        e->busy = 0;
+        e->done = 1;
+        while ((r = e->waiters)) {
+                e->waiters = r->next;
+                cacheCopy(e, r);
+                r->next = NULL;
+                if (doneTail) {
+                        doneTail->next = r;
+                } else {
+                        doneHead = r;
+                }
+                doneTail = r;
+        }
+        if (1 != write(notify[1], "r", 1)) {
+                /* pipe full, reader is awake anyway */
+        }
+}
+
+#ifdef HAVE_THREADS
+/**
+ * Resolver thread.
+ */
+static void*
+resolveThread(void *unused)
+{
+        struct CacheEntry *e;
+        struct addrinfo *addrs;
+        int err, syserr;
+
+        unused = unused;
+
+        LOCK();
+        for (;;) {
+                while (!queueHead) {
+                        idleThreads++;
+                        pthread_cond_wait(&workCond, &lock);
+                        idleThreads--;
+                }
+                e = queueHead;
+                if (!(queueHead = e->qnext)) {
+                        queueTail = NULL;
+                }
+                queueLen--;
+                UNLOCK();
+
+                cacheLookup(e, &err, &syserr, &addrs);
+
+                LOCK();
+                cacheDone(e, err, syserr, addrs);
+                pthread_cond_broadcast(&doneCond);
+        }
+        return NULL;
+}
+
+/**
+ * Queue e for the resolver threads, starting another one if none is
+ * idle. Called with lock held.
+ */
+static void
+workQueue(struct CacheEntry *e)
+{
+        pthread_t th;
+        int err;
+
+        e->qnext = NULL;
+        if (queueTail) {
+                queueTail->qnext = e;
+        } else {
+                queueHead = e;
+        }
+        queueTail = e;
+        queueLen++;
+
+        if (queueLen > idleThreads && numThreads < RESOLVE_THREADS) {
+                if ((err = pthread_create(&th, NULL, resolveThread, NULL))) {
+                        /* the ones we have will get to it */
+                        if (!numThreads) {
+                                fprintf(stderr, "%s: pthread_create(): %s\n",
+                                        argv0, strerror(err));
+                                exit(1);
+                        }
+                } else {
+                        pthread_detach(th);
+                        numThreads++;
+                }
+        }
+        pthread_cond_signal(&workCond);
+}
+#endif
+
+/**
+ * return 0 on success, <0 (-errno) on error
+ */
+int
+resolveInit()
+{
+        int c;
+
+        if (notify[0] >= 0) {
+                return 0;
+        }
+        if (pipe(notify)) {
+                int err = errno;
+                fprintf(stderr, "%s: pipe(): %s\n", argv0, strerror(err));
+                return -err;
+        }
+        for (c = 0; c < 2; c++) {
+                fcntl(notify[c], F_SETFL, fcntl(notify[c], F_GETFL)
+                      | O_NONBLOCK);
+                fcntl(notify[c], F_SETFD, FD_CLOEXEC);
+        }
+        return 0;
+}
+
+/**
+ * fd that becomes readable when resolveDone() has something.
+ */
+int
+resolveFd()
+{
+        return notify[0];
+}
+
+/**
+ * Start looking up r->name. r must stay valid until returned by
+ * resolveDone().
+ *
+ * return 0 on success, <0 (-errno) on error
+ */
+int
+resolveQueue(struct Resolve *r)
+{
+        struct CacheEntry *e;
+
+        LOCK();
+        if (!(e = cacheGet(r))) {
+                UNLOCK();
+                fprintf(stderr, "%s: resolveQueue(%s): out of memory\n",
+                        argv0, r->name);
+                return -ENOMEM;
+        }
+        pending++;
+        r->next = e->waiters;
+        e->waiters = r;
+        if (e->done) {
+                cacheDone(e, e->err, e->syserr, e->addrs);
+        } else if (!e->busy) {
+                /* first one asking for it */
+                e->busy = 1;
+#ifdef HAVE_THREADS
+                workQueue(e);
+#else
+                int err, syserr;
+                struct addrinfo *addrs;
+                cacheLookup(e, &err, &syserr, &addrs);
+                cacheDone(e, err, syserr, addrs);
+#endif
+        }
+        UNLOCK();
+        return 0;
+}
+
+/**
+ * Get finished lookups, as a list linked with r->next. If block is set,
+ * wait for at least one unless none are pending.
+ *
+ * return NULL if nothing finished
+ */
+struct Resolve*
+resolveDone(int block)
+{
+        struct Resolve *ret;
+        struct Resolve *r;
+        char buf[64];
+
+        while (0 < read(notify[0], buf, sizeof(buf)));
+
+        LOCK();
+#ifdef HAVE_THREADS
+        while (block && !doneHead && pending) {
+                pthread_cond_wait(&doneCond, &lock);
+        }
+#endif
+        ret = doneHead;
+        doneHead = doneTail = NULL;
+        for (r = ret; r; r = r->next) {
+                pending--;
+        }
+        UNLOCK();
+        return ret;
+}
+
+/**
+ * Look up r->name and wait for the result, for when there's nothing else
+ * to do meanwhile.
+ *
+ * return getaddrinfo() return value
+ */
+int
+resolveSync(struct Resolve *r)
+{
+        struct CacheEntry *e;
+        struct addrinfo *addrs;
+        int err, syserr;
+
+        LOCK();
+        if (!(e = cacheGet(r))) {
+                UNLOCK();
+                r->err = EAI_MEMORY;
+                r->syserr = ENOMEM;
+                r->addrs = NULL;
+                return r->err;
+        }
+#ifdef HAVE_THREADS
+        while (e->busy) {
+                pthread_cond_wait(&doneCond, &lock);
+        }
+#endif
+        if (!e->done) {
+                e->busy = 1;
+                UNLOCK();
+                cacheLookup(e, &err, &syserr, &addrs);
+                LOCK();
+                cacheDone(e, err, syserr, addrs);
+#ifdef HAVE_THREADS
+                pthread_cond_broadcast(&doneCond);
+#endif
+        }
+        cacheCopy(e, r);
+        UNLOCK();
+        return r->err;
+}
+
+/* ---- Emacs Variables ----
+ * Local Variables:
+ * c-basic-offset: 8
+ * indent-tabs-mode: nil
+ * End:
+ */
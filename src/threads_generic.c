@@ -0,0 +1,38 @@
+/** gtping/src/threads_generic.c
+ *
+ *  By Thomas Habets <thomas@habets.se> 2009
+ *
+ * No thread support on this system. -j is refused in main().
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+
+#include "gtping.h"
+
+/**
+ *
+ */
+int
+threadStart(struct Worker *w, void *(*fn)(void*))
+{
+        return -ENOSYS;
+}
+
+/**
+ *
+ */
+int
+threadJoin(struct Worker *w)
+{
+        return 0;
+}
+
+/* ---- Emacs Variables ----
+ * Local Variables:
+ * c-basic-offset: 8
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,123 @@
+/** gtping/src/threads_pthread.c
+ *
+ *  By Thomas Habets <thomas@habets.se> 2009
+ *
+ * Worker threads (-j) with pthreads, pinned one per CPU where supported.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+#include <sched.h>
+#endif
+
+#include "gtping.h"
+
+/**
+ * Pin thread to the w->id:th CPU (modulo number of CPUs) that the
+ * process may run on, so that taskset and cpusets are respected.
+ */
+static void
+pinThread(const struct Worker *w, pthread_t th)
+{
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+        static cpu_set_t allowed;
+        static int nallowed = -1;
+        cpu_set_t cpus;
+        int cpu, n;
+        int err;
+
+        /* read once, before any worker is pinned */
+        if (nallowed < 0) {
+                nallowed = 0;
+                if (sched_getaffinity(0, sizeof(allowed), &allowed)) {
+                        fprintf(stderr, "%s: sched_getaffinity(): %s\n",
+                                argv0, strerror(errno));
+                        return;
+                }
+                nallowed = CPU_COUNT(&allowed);
+        }
+        if (nallowed < 1) {
+                return;
+        }
+        n = w->id % nallowed;
+        for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+                if (CPU_ISSET(cpu, &allowed) && !n--) {
+                        break;
+                }
+        }
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        if ((err = pthread_setaffinity_np(th, sizeof(cpus), &cpus))) {
+                fprintf(stderr, "%s: pthread_setaffinity_np(%u, cpu %d): "
+                        "%s\n", argv0, w->id, cpu, strerror(err));
+        }
+#endif
+}
+
+/**
+ * Start thread running fn(w).
+ *
+ * return 0 on success, <0 (-errno) on error
+ */
+int
+threadStart(struct Worker *w, void *(*fn)(void*))
+{
+        pthread_t *th;
+        int err;
+
+        if (!(th = malloc(sizeof(pthread_t)))) {
+                err = errno;
+                fprintf(stderr, "%s: malloc(): %s\n", argv0, strerror(err));
+                return -err;
+        }
+        if ((err = pthread_create(th, NULL, fn, w))) {
+                fprintf(stderr, "%s: pthread_create(): %s\n",
+                        argv0, strerror(err));
+                free(th);
+                return -err;
+        }
+        pinThread(w, *th);
+        w->thread = th;
+        return 0;
+}
+
+/**
+ * Wait for worker thread to finish.
+ */
+int
+threadJoin(struct Worker *w)
+{
+        pthread_t *th = w->thread;
+        int err;
+
+        if (!th) {
+                return 0;
+        }
+        if ((err = pthread_join(*th, NULL))) {
+                fprintf(stderr, "%s: pthread_join(): %s\n",
+                        argv0, strerror(err));
+                return -err;
+        }
+        free(th);
+        w->thread = NULL;
+        return 0;
+}
+
+/* ---- Emacs Variables ----
+ * Local Variables:
+ * c-basic-offset: 8
+ * indent-tabs-mode: nil
+ * End:
+ */
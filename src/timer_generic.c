@@ -0,0 +1,45 @@
+/** gtping/src/timer_generic.c
+ *
+ *  By Thomas Habets <thomas@habets.se> 2009
+ *
+ * No timer fd on this system. The main loop falls back to the poll()
+ * timeout, rounded up to the next millisecond.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "gtping.h"
+
+/**
+ *
+ */
+int
+timerCreate()
+{
+        return -1;
+}
+
+/**
+ *
+ */
+int
+timerSet(int fd, double when)
+{
+        return 0;
+}
+
+/**
+ *
+ */
+void
+timerAck(int fd)
+{
+}
+
+/* ---- Emacs Variables ----
+ * Local Variables:
+ * c-basic-offset: 8
+ * indent-tabs-mode: nil
+ * End:
+ */
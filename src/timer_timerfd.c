@@ -0,0 +1,89 @@
+/** gtping/src/timer_timerfd.c
+ *
+ *  By Thomas Habets <thomas@habets.se> 2009
+ *
+ * Absolute deadline timer using timerfd, so that the main loop can wait
+ * for the next send time and for replies in the same poll().
+ *
+ * Systems known to use this code: Linux
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/timerfd.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+
+#include "gtping.h"
+
+/**
+ * return fd to poll for POLLIN, or <0 on error.
+ */
+int
+timerCreate()
+{
+        int fd;
+
+#ifdef PR_SET_TIMERSLACK
+        /* default slack is 50us, which is more than a short -i */
+        prctl(PR_SET_TIMERSLACK, 1, 0, 0, 0);
+#endif
+        if (0 > (fd = timerfd_create(CLOCK_MONOTONIC,
+                                     TFD_NONBLOCK | TFD_CLOEXEC))) {
+                int err = errno;
+                fprintf(stderr, "%s: timerfd_create(): %s\n",
+                        argv0, strerror(err));
+                return -err;
+        }
+        return fd;
+}
+
+/**
+ * Fire once at clock_get_dbl() time 'when'.
+ */
+int
+timerSet(int fd, double when)
+{
+        struct itimerspec its;
+
+        memset(&its, 0, sizeof(its));
+        its.it_value.tv_sec = (time_t)when;
+        its.it_value.tv_nsec = (long)((when - its.it_value.tv_sec) * 1e9);
+        if (!its.it_value.tv_sec && !its.it_value.tv_nsec) {
+                /* zero would disarm */
+                its.it_value.tv_nsec = 1;
+        }
+        if (timerfd_settime(fd, TFD_TIMER_ABSTIME, &its, NULL)) {
+                int err = errno;
+                fprintf(stderr, "%s: timerfd_settime(%d): %s\n",
+                        argv0, fd, strerror(err));
+                return -err;
+        }
+        return 0;
+}
+
+/**
+ * Clear readability after the timer fired.
+ */
+void
+timerAck(int fd)
+{
+        uint64_t expirations;
+        if (0 > read(fd, &expirations, sizeof(expirations))) {
+                /* EAGAIN if it didn't fire. That's fine */
+        }
+}
+
+/* ---- Emacs Variables ----
+ * Local Variables:
+ * c-basic-offset: 8
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,918 @@
+/** gtping/test/gsnsim.c
+ *
+ *  By Thomas Habets <thomas@habets.se> 2010
+ *
+ * Simulate a GSN node in that it responds to GTP pings in different ways:
+ * seeded loss, duplication, reordering, delay and rate limiting. Used to
+ * check gtping's dup, reorder and percentile accounting at high rates
+ * without a real network.
+ *
+ * Every decision about request number n (loss, copies, delay of each
+ * copy) comes from a random generator seeded with (seed, n), so a run
+ * with the same seed and the same requests gets the same treatment no
+ * matter how the replies and the rate limit interleave.
+ *
+ * Delayed replies wait in a timer wheel of WHEEL_SLOTS slots, one per
+ * WHEEL_TICK_US. Requests are read, and replies sent, in batches of up to
+ * BATCH packets per syscall where the OS has recvmmsg() and sendmmsg().
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+/* recvmmsg() and sendmmsg() are GNU extensions */
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
+
+/* timer wheel resolution, and number of slots (one lap is 6.5s) */
+#define WHEEL_TICK_US 100
+#define WHEEL_SLOTS 65536
+
+/* packets per recvmmsg()/sendmmsg() */
+#define BATCH 64
+
+/* biggest request answered */
+#define MAX_PACKET 512
+
+#define GTPMSG_ECHO 1
+#define GTPMSG_ECHOREPLY 2
+
+#define DEFAULT_PORT "2123"
+#define DEFAULT_SEED 1
+#define DEFAULT_COPIES 2
+#define DEFAULT_REORDERGAP 10.0
+#define DEFAULT_MAXQUEUE 1000000
+#define SOCKBUF (4 * 1024 * 1024)
+
+/* options given on the command line, so modes don't override them */
+#define SET_LOSS   1
+#define SET_DUP    2
+#define SET_COPIES 4
+#define SET_DELAY  8
+
+enum { DELAY_CONST, DELAY_UNIFORM, DELAY_NORMAL, DELAY_EXP };
+
+/**
+ * One reply waiting to be sent.
+ */
+struct Pending {
+        struct Pending *next;
+        uint64_t due;                   /* tick */
+        struct sockaddr_storage to;
+        socklen_t tolen;
+        size_t len;
+        unsigned char data[MAX_PACKET];
+};
+
+static const char *argv0 = 0;
+
+static struct {
+        const char *source;
+        const char *port;
+        uint64_t seed;
+        double loss;                    /* probabilities, 0-1 */
+        double dup;
+        double reorder;
+        unsigned int copies;
+        double reorderGap;              /* seconds */
+        int delayDist;
+        double delayA;                  /* seconds */
+        double delayB;
+        double rate;                    /* replies/s, 0 = unlimited */
+        double burst;
+        unsigned int maxQueue;
+} options = {
+        NULL, DEFAULT_PORT, DEFAULT_SEED,
+        0, 0, 0, DEFAULT_COPIES, DEFAULT_REORDERGAP / 1000,
+        DELAY_CONST, 0, 0,
+        0, 0, DEFAULT_MAXQUEUE,
+};
+
+static struct {
+        unsigned long long recvd;
+        unsigned long long invalid;
+        unsigned long long lost;
+        unsigned long long dups;        /* extra copies scheduled */
+        unsigned long long reordered;
+        unsigned long long ratelimited;
+        unsigned long long overflow;
+        unsigned long long sent;
+        unsigned long long senderr;
+} stats;
+
+static struct Pending *wheelHead[WHEEL_SLOTS];
+static struct Pending *wheelTail[WHEEL_SLOTS];
+static struct Pending *freeList = NULL;
+static unsigned int numPending = 0;
+static uint64_t curTick = 0;
+
+static struct Pending *outQueue[BATCH];
+static unsigned int numOut = 0;
+
+static double tokens = 0;
+static uint64_t tokenTick = 0;
+
+static volatile sig_atomic_t sigint = 0;
+static volatile sig_atomic_t sigquit = 0;
+
+/**
+ * splitmix64 step
+ */
+static uint64_t
+rngNext(uint64_t *state)
+{
+        uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+}
+
+/**
+ * Uniform in [0,1)
+ */
+static double
+rngDouble(uint64_t *state)
+{
+        return (rngNext(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/**
+ * One sample of the delay distribution, in seconds, never negative.
+ */
+static double
+delaySample(uint64_t *rng)
+{
+        double u, v, d = 0;
+
+        switch (options.delayDist) {
+        case DELAY_CONST:
+                d = options.delayA;
+                break;
+        case DELAY_UNIFORM:
+                d = options.delayA
+                        + rngDouble(rng) * (options.delayB - options.delayA);
+                break;
+        case DELAY_NORMAL:
+                /* Box-Muller */
+                u = 1.0 - rngDouble(rng);
+                v = rngDouble(rng);
+                d = options.delayA + options.delayB
+                        * sqrt(-2 * log(u)) * cos(2 * M_PI * v);
+                break;
+        case DELAY_EXP:
+                d = -options.delayA * log(1.0 - rngDouble(rng));
+                break;
+        }
+        return d < 0 ? 0 : d;
+}
+
+/**
+ * Monotonic time in ticks.
+ */
+static uint64_t
+nowTick()
+{
+#ifdef HAVE_CLOCK_MONOTONIC
+        struct timespec ts;
+        if (!clock_gettime(CLOCK_MONOTONIC, &ts)) {
+                return ((uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000)
+                        / WHEEL_TICK_US;
+        }
+#endif
+        {
+                struct timeval tv;
+                gettimeofday(&tv, NULL);
+                return ((uint64_t)tv.tv_sec * 1000000 + tv.tv_usec)
+                        / WHEEL_TICK_US;
+        }
+}
+
+/**
+ * return NULL if out of memory
+ */
+static struct Pending *
+pendingAlloc()
+{
+        struct Pending *p;
+
+        if ((p = freeList)) {
+                freeList = p->next;
+                return p;
+        }
+        return malloc(sizeof(struct Pending));
+}
+
+/**
+ *
+ */
+static void
+pendingFree(struct Pending *p)
+{
+        p->next = freeList;
+        freeList = p;
+}
+
+/**
+ * Send everything in outQueue.
+ */
+static void
+flushOut(int fd)
+{
+        unsigned int c;
+#ifdef HAVE_SENDMMSG
+        struct mmsghdr mm[BATCH];
+        struct iovec iov[BATCH];
+        unsigned int done = 0;
+        int n;
+
+        memset(mm, 0, sizeof(mm));
+        for (c = 0; c < numOut; c++) {
+                iov[c].iov_base = outQueue[c]->data;
+                iov[c].iov_len = outQueue[c]->len;
+                mm[c].msg_hdr.msg_name = &outQueue[c]->to;
+                mm[c].msg_hdr.msg_namelen = outQueue[c]->tolen;
+                mm[c].msg_hdr.msg_iov = &iov[c];
+                mm[c].msg_hdr.msg_iovlen = 1;
+        }
+        while (done < numOut) {
+                if (0 > (n = sendmmsg(fd, mm + done, numOut - done, 0))) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        /* drop the one that failed, try the rest */
+                        stats.senderr++;
+                        done++;
+                        continue;
+                }
+                stats.sent += n;
+                done += n;
+        }
+#else
+        for (c = 0; c < numOut; c++) {
+                if (0 > sendto(fd, outQueue[c]->data, outQueue[c]->len, 0,
+                               (struct sockaddr*)&outQueue[c]->to,
+                               outQueue[c]->tolen)) {
+                        stats.senderr++;
+                } else {
+                        stats.sent++;
+                }
+        }
+#endif
+        for (c = 0; c < numOut; c++) {
+                pendingFree(outQueue[c]);
+        }
+        numOut = 0;
+}
+
+/**
+ * Queue p for sending now.
+ */
+static void
+sendNow(int fd, struct Pending *p)
+{
+        outQueue[numOut++] = p;
+        if (numOut == BATCH) {
+                flushOut(fd);
+        }
+}
+
+/**
+ * Send everything due up to and including tick now.
+ */
+static void
+runWheel(int fd, uint64_t now)
+{
+        if (!numPending) {
+                curTick = now + 1;
+                return;
+        }
+        /* this tick has already been run */
+        if (now < curTick) {
+                return;
+        }
+        /* stalled for more than a lap, look at each slot once */
+        if (now - curTick >= WHEEL_SLOTS) {
+                curTick = now - WHEEL_SLOTS + 1;
+        }
+        for (; curTick <= now; curTick++) {
+                unsigned int slot = curTick & (WHEEL_SLOTS - 1);
+                struct Pending *p = wheelHead[slot];
+                struct Pending *keep = NULL, *keepTail = NULL;
+
+                while (p) {
+                        struct Pending *next = p->next;
+                        if (p->due <= now) {
+                                numPending--;
+                                sendNow(fd, p);
+                        } else {
+                                /* a later lap */
+                                p->next = NULL;
+                                if (keepTail) {
+                                        keepTail->next = p;
+                                } else {
+                                        keep = p;
+                                }
+                                keepTail = p;
+                        }
+                        p = next;
+                }
+                wheelHead[slot] = keep;
+                wheelTail[slot] = keepTail;
+        }
+        flushOut(fd);
+}
+
+/**
+ * Take a token from the rate limiter.
+ *
+ * return 1 if ok to send, 0 if over the rate
+ */
+static int
+rateAllow(uint64_t now)
+{
+        if (!options.rate) {
+                return 1;
+        }
+        tokens += (now - tokenTick) * (WHEEL_TICK_US / 1000000.0)
+                * options.rate;
+        tokenTick = now;
+        if (tokens > options.burst) {
+                tokens = options.burst;
+        }
+        if (tokens < 1) {
+                return 0;
+        }
+        tokens--;
+        return 1;
+}
+
+/**
+ * Schedule one copy of the reply, delay seconds from now.
+ */
+static void
+schedule(int fd, uint64_t now, double delay,
+         const unsigned char *reply, size_t len,
+         const struct sockaddr_storage *to, socklen_t tolen)
+{
+        struct Pending *p;
+        unsigned int slot;
+
+        if (!rateAllow(now)) {
+                stats.ratelimited++;
+                return;
+        }
+        if (numPending >= options.maxQueue || !(p = pendingAlloc())) {
+                stats.overflow++;
+                return;
+        }
+        memcpy(p->data, reply, len);
+        p->len = len;
+        memcpy(&p->to, to, tolen);
+        p->tolen = tolen;
+        p->next = NULL;
+        p->due = now + (uint64_t)ceil(delay * (1000000.0 / WHEEL_TICK_US));
+        if (p->due <= now) {
+                sendNow(fd, p);
+                return;
+        }
+        slot = p->due & (WHEEL_SLOTS - 1);
+        if (wheelTail[slot]) {
+                wheelTail[slot]->next = p;
+        } else {
+                wheelHead[slot] = p;
+        }
+        wheelTail[slot] = p;
+        numPending++;
+}
+
+/**
+ * Decide what happens to request number n, and schedule its replies.
+ */
+static void
+handleRequest(int fd, uint64_t now, uint64_t n,
+              unsigned char *data, size_t len,
+              const struct sockaddr_storage *from, socklen_t fromlen)
+{
+        uint64_t rng;
+        unsigned int copies;
+        unsigned int c;
+        int ver;
+
+        stats.recvd++;
+        ver = len ? data[0] >> 5 : 0;
+        if (len < 8 || len > MAX_PACKET
+            || (ver != 1 && ver != 2)
+            || data[1] != GTPMSG_ECHO) {
+                stats.invalid++;
+                return;
+        }
+        data[1] = GTPMSG_ECHOREPLY;
+
+        rng = options.seed ^ (n * 0xd1b54a32d192ed03ULL);
+        rngNext(&rng);
+
+        if (rngDouble(&rng) < options.loss) {
+                stats.lost++;
+                return;
+        }
+        copies = 1;
+        if (rngDouble(&rng) < options.dup) {
+                copies = options.copies;
+                stats.dups += copies - 1;
+        }
+        for (c = 0; c < copies; c++) {
+                double delay = delaySample(&rng);
+                if (rngDouble(&rng) < options.reorder) {
+                        delay += options.reorderGap;
+                        stats.reordered++;
+                }
+                schedule(fd, now, delay, data, len, from, fromlen);
+        }
+}
+
+/**
+ * Read up to BATCH requests and handle them.
+ *
+ * return number of packets read, 0 if none waiting
+ */
+static int
+readRequests(int fd, uint64_t *n)
+{
+        static unsigned char buf[BATCH][MAX_PACKET + 1];
+        static struct sockaddr_storage from[BATCH];
+        uint64_t now = nowTick();
+        int got;
+#ifdef HAVE_RECVMMSG
+        struct mmsghdr mm[BATCH];
+        struct iovec iov[BATCH];
+        int c;
+
+        memset(mm, 0, sizeof(mm));
+        for (c = 0; c < BATCH; c++) {
+                iov[c].iov_base = buf[c];
+                iov[c].iov_len = sizeof(buf[c]);
+                mm[c].msg_hdr.msg_name = &from[c];
+                mm[c].msg_hdr.msg_namelen = sizeof(from[c]);
+                mm[c].msg_hdr.msg_iov = &iov[c];
+                mm[c].msg_hdr.msg_iovlen = 1;
+        }
+        if (0 > (got = recvmmsg(fd, mm, BATCH, 0, NULL))) {
+                return 0;
+        }
+        for (c = 0; c < got; c++) {
+                handleRequest(fd, now, (*n)++, buf[c], mm[c].msg_len,
+                              &from[c], mm[c].msg_hdr.msg_namelen);
+        }
+#else
+        for (got = 0; got < BATCH; got++) {
+                socklen_t fromlen = sizeof(from[0]);
+                ssize_t len;
+                if (0 > (len = recvfrom(fd, buf[0], sizeof(buf[0]), 0,
+                                        (struct sockaddr*)&from[0],
+                                        &fromlen))) {
+                        break;
+                }
+                handleRequest(fd, now, (*n)++, buf[0], len,
+                              &from[0], fromlen);
+        }
+#endif
+        flushOut(fd);
+        return got;
+}
+
+/**
+ *
+ */
+static void
+printStats()
+{
+        fprintf(stderr,
+                "%s: %llu requests, %llu invalid, %llu lost, "
+                "%llu dup copies, %llu reordered, %llu rate limited, "
+                "%llu overflow, %llu sent, %llu send errors, "
+                "%u pending\n",
+                argv0, stats.recvd, stats.invalid, stats.lost,
+                stats.dups, stats.reordered, stats.ratelimited,
+                stats.overflow, stats.sent, stats.senderr, numPending);
+}
+
+/**
+ *
+ */
+static void
+sigHandler(int sig)
+{
+        if (sig == SIGQUIT) {
+                sigquit = 1;
+        } else {
+                sigint = 1;
+        }
+}
+
+/**
+ * Bind UDP socket, dual stack if possible.
+ *
+ * return fd, or <0 (-errno) on error
+ */
+static int
+setupSocket()
+{
+        struct addrinfo hints;
+        struct addrinfo *addrs, *ai;
+        int families[2] = { AF_INET6, AF_INET };
+        int err = EAFNOSUPPORT;
+        int c;
+
+        for (c = 0; c < 2; c++) {
+                int fd, on = 1, off = 0, bufsize = SOCKBUF;
+                memset(&hints, 0, sizeof(hints));
+                hints.ai_family = families[c];
+                hints.ai_socktype = SOCK_DGRAM;
+                hints.ai_flags = AI_PASSIVE;
+                if (getaddrinfo(options.source, options.port,
+                                &hints, &addrs)) {
+                        continue;
+                }
+                for (ai = addrs; ai; ai = ai->ai_next) {
+                        if (0 > (fd = socket(ai->ai_family, ai->ai_socktype,
+                                             ai->ai_protocol))) {
+                                err = errno;
+                                continue;
+                        }
+                        if (ai->ai_family == AF_INET6) {
+                                setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY,
+                                           &off, sizeof(off));
+                        }
+                        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR,
+                                   &on, sizeof(on));
+                        setsockopt(fd, SOL_SOCKET, SO_RCVBUF,
+                                   &bufsize, sizeof(bufsize));
+                        setsockopt(fd, SOL_SOCKET, SO_SNDBUF,
+                                   &bufsize, sizeof(bufsize));
+                        if (bind(fd, ai->ai_addr, ai->ai_addrlen)) {
+                                err = errno;
+                                close(fd);
+                                continue;
+                        }
+                        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+                        freeaddrinfo(addrs);
+                        return fd;
+                }
+                freeaddrinfo(addrs);
+        }
+        fprintf(stderr, "%s: bind(%s port %s): %s\n", argv0,
+                options.source ? options.source : "any",
+                options.port, strerror(err));
+        return -err;
+}
+
+/**
+ *
+ */
+static void
+mainloop(int fd)
+{
+        uint64_t n = 0;
+
+        tokenTick = curTick = nowTick();
+        tokens = options.burst;
+        while (!sigint) {
+                fd_set fds;
+                struct timeval tv;
+                uint64_t now;
+
+                if (sigquit) {
+                        sigquit = 0;
+                        printStats();
+                }
+
+                /* drain socket, with the wheel kept up to date */
+                while (readRequests(fd, &n) == BATCH) {
+                        runWheel(fd, nowTick());
+                }
+                now = nowTick();
+                runWheel(fd, now);
+
+                FD_ZERO(&fds);
+                FD_SET(fd, &fds);
+                tv.tv_sec = 0;
+                tv.tv_usec = WHEEL_TICK_US;
+                if (0 > select(fd + 1, &fds, NULL, NULL,
+                               numPending ? &tv : NULL)) {
+                        if (errno != EINTR) {
+                                fprintf(stderr, "%s: select(): %s\n",
+                                        argv0, strerror(errno));
+                                exit(1);
+                        }
+                }
+        }
+}
+
+/**
+ * Parse delay distribution spec like "normal:50:10" (ms).
+ *
+ * return 0 on success, -1 if invalid
+ */
+static int
+parseDelay(const char *spec)
+{
+        static const struct {
+                const char *name;
+                int dist;
+                int args;
+        } dists[] = {
+                { "const", DELAY_CONST, 1 },
+                { "uniform", DELAY_UNIFORM, 2 },
+                { "normal", DELAY_NORMAL, 2 },
+                { "exp", DELAY_EXP, 1 },
+        };
+        const char *p;
+        char *end;
+        double a, b = 0;
+        unsigned int c;
+        size_t len;
+
+        if (!(p = strchr(spec, ':'))) {
+                /* just a number, constant delay */
+                a = strtod(spec, &end);
+                if (end == spec || *end || a < 0) {
+                        return -1;
+                }
+                options.delayDist = DELAY_CONST;
+                options.delayA = a / 1000;
+                return 0;
+        }
+        len = p - spec;
+        for (c = 0; c < sizeof(dists) / sizeof(dists[0]); c++) {
+                if (strlen(dists[c].name) == len
+                    && !strncmp(dists[c].name, spec, len)) {
+                        break;
+                }
+        }
+        if (c == sizeof(dists) / sizeof(dists[0])) {
+                return -1;
+        }
+        a = strtod(p + 1, &end);
+        if (end == p + 1 || a < 0) {
+                return -1;
+        }
+        if (dists[c].args == 2) {
+                if (*end != ':') {
+                        return -1;
+                }
+                p = end + 1;
+                b = strtod(p, &end);
+                if (end == p || b < 0) {
+                        return -1;
+                }
+        }
+        if (*end) {
+                return -1;
+        }
+        if (dists[c].dist == DELAY_UNIFORM && b < a) {
+                return -1;
+        }
+        options.delayDist = dists[c].dist;
+        options.delayA = a / 1000;
+        options.delayB = b / 1000;
+        return 0;
+}
+
+/**
+ * Parse percentage into probability.
+ */
+static double
+parsePercent(const char *s)
+{
+        char *end;
+        double d = strtod(s, &end);
+        if (end == s || *end || d < 0 || d > 100) {
+                fprintf(stderr, "%s: invalid percentage \"%s\"\n", argv0, s);
+                exit(1);
+        }
+        return d / 100;
+}
+
+/**
+ * Modes of the old gsnsim.py, as presets. Options given on the command
+ * line win.
+ *
+ * return 0 on success, -1 on unknown mode
+ */
+static int
+applyMode(const char *mode, int set)
+{
+        if (!strcmp(mode, "normal")) {
+                return 0;
+        }
+        if (!strcmp(mode, "dup")) {
+                if (!(set & SET_DUP)) {
+                        options.dup = 1;
+                }
+                return 0;
+        }
+        if (!strcmp(mode, "random")) {
+                /* 0, 1 or 2 replies, equally likely */
+                if (!(set & SET_LOSS)) {
+                        options.loss = 1.0 / 3;
+                }
+                if (!(set & SET_DUP)) {
+                        options.dup = 0.5;
+                }
+                if (!(set & SET_COPIES)) {
+                        options.copies = 2;
+                }
+                return 0;
+        }
+        if (!strcmp(mode, "jitter")) {
+                if (!(set & SET_DELAY)) {
+                        parseDelay("uniform:0:1000");
+                }
+                return 0;
+        }
+        return -1;
+}
+
+/**
+ *
+ */
+static void
+usage(int err)
+{
+        printf("Usage: %s "
+               "[ -h ] "
+               "[ -s <address> ] "
+               "[ -p <port> ] "
+               "[ -S <seed> ] "
+               "[ -l <loss%%> ] "
+               "[ -d <dup%%> ] "
+               "[ -n <copies> ] "
+               "\n       %s "
+               "[ -r <reorder%%> ] "
+               "[ -g <gap> ] "
+               "[ -t <delay> ] "
+               "[ -R <pps> ] "
+               "[ -B <burst> ] "
+               "[ -q <max> ] "
+               "[ normal | dup | random | jitter ]\n"
+               "\t-h          Show this help text\n"
+               "\t-s <addr>   Address to listen on (default: any)\n"
+               "\t-p <port>   Port to listen on (default: %s)\n"
+               "\t-S <seed>   Random seed (default: %d)\n"
+               "\t-l <loss%%>  Drop this percentage of requests "
+               "(default: 0)\n"
+               "\t-d <dup%%>   Answer this percentage with -n copies "
+               "(default: 0)\n"
+               "\t-n <copies> Copies of duplicated replies (default: %d)\n"
+               "\t-r <pct>    Delay this percentage of replies "
+               "another -g ms (default: 0)\n"
+               "\t-g <gap>    Extra delay of reordered replies, ms "
+               "(default: %g)\n"
+               "\t-t <delay>  Reply delay in ms: <ms>, const:<ms>, "
+               "uniform:<min>:<max>,\n"
+               "\t            normal:<mean>:<stddev> or exp:<mean> "
+               "(default: 0)\n"
+               "\t-R <pps>    Max replies per second, excess dropped "
+               "(default: unlimited)\n"
+               "\t-B <burst>  Rate limiter burst, replies "
+               "(default: 10ms worth)\n"
+               "\t-q <max>    Max replies waiting to be sent "
+               "(default: %d)\n"
+               "\n"
+               "\tnormal      One reply per request (default)\n"
+               "\tdup         Always two replies (-d 100)\n"
+               "\trandom      0, 1 or 2 replies (-l 33.3 -d 50)\n"
+               "\tjitter      Delay 0-1s (-t uniform:0:1000)\n"
+               "\n"
+               "Prints statistics on SIGQUIT and on exit.\n",
+               argv0, argv0, DEFAULT_PORT, DEFAULT_SEED, DEFAULT_COPIES,
+               DEFAULT_REORDERGAP, DEFAULT_MAXQUEUE);
+        exit(err);
+}
+
+/**
+ *
+ */
+int
+main(int argc, char **argv)
+{
+        struct sigaction sa;
+        int set = 0;
+        int fd;
+        int c;
+
+        argv0 = argv[0];
+
+        while (-1 != (c = getopt(argc, argv, "B:d:g:hl:n:p:q:r:R:s:S:t:"))) {
+                switch (c) {
+                case 'B':
+                        options.burst = strtod(optarg, NULL);
+                        break;
+                case 'd':
+                        options.dup = parsePercent(optarg);
+                        set |= SET_DUP;
+                        break;
+                case 'g':
+                        options.reorderGap = strtod(optarg, NULL) / 1000;
+                        break;
+                case 'h':
+                        usage(0);
+                        break;
+                case 'l':
+                        options.loss = parsePercent(optarg);
+                        set |= SET_LOSS;
+                        break;
+                case 'n':
+                        options.copies = strtoul(optarg, NULL, 0);
+                        set |= SET_COPIES;
+                        break;
+                case 'p':
+                        options.port = optarg;
+                        break;
+                case 'q':
+                        options.maxQueue = strtoul(optarg, NULL, 0);
+                        break;
+                case 'r':
+                        options.reorder = parsePercent(optarg);
+                        break;
+                case 'R':
+                        options.rate = strtod(optarg, NULL);
+                        break;
+                case 's':
+                        options.source = optarg;
+                        break;
+                case 'S':
+                        options.seed = strtoull(optarg, NULL, 0);
+                        break;
+                case 't':
+                        if (parseDelay(optarg)) {
+                                fprintf(stderr, "%s: invalid delay \"%s\"\n",
+                                        argv0, optarg);
+                                exit(1);
+                        }
+                        set |= SET_DELAY;
+                        break;
+                default:
+                        usage(1);
+                }
+        }
+        if (optind + 1 < argc) {
+                usage(1);
+        }
+        if (optind < argc && applyMode(argv[optind], set)) {
+                fprintf(stderr, "%s: unknown mode \"%s\"\n",
+                        argv0, argv[optind]);
+                exit(1);
+        }
+        if (options.copies < 1) {
+                options.copies = 1;
+        }
+        if (options.rate < 0) {
+                options.rate = 0;
+        }
+        if (options.rate && options.burst < 1) {
+                options.burst = 1 + options.rate / 100;
+        }
+
+        if (0 > (fd = setupSocket())) {
+                exit(1);
+        }
+
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = sigHandler;
+        sigaction(SIGINT, &sa, NULL);
+        sigaction(SIGTERM, &sa, NULL);
+        sigaction(SIGQUIT, &sa, NULL);
+
+        mainloop(fd);
+        printStats();
+        return 0;
+}
+
+/* ---- Emacs Variables ----
+ * Local Variables:
+ * c-basic-offset: 8
+ * indent-tabs-mode: nil
+ * End:
+ */